@@ -20,6 +20,8 @@
  * SOFTWARE.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdarg.h>
@@ -27,11 +29,44 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bms2mid.h"
+
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
 
 #define ARRAY_LENGTH(x) (sizeof(x) / sizeof(*x))
 
+// Built with BMS2MID_THREADS defined, the state of the sequence being decoded is kept
+// per thread, so that the library functions in bms2mid.h can be called from several
+// threads at once, each with its own sequence. The options and instrument list are
+// still shared, and have to be set up before any thread starts.
+#ifdef BMS2MID_THREADS
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
+
 #define MAX_CHANNELS 16  // Midi channels range from 0 to 15, with channel 9 being percussion only
 #define STACK_LIMIT 4  // I don't know what the limit is (if any) for nested subroutines
 
@@ -41,34 +76,51 @@ struct MidiTrack
     int length;
     uint8_t *buffer;
     int bufferSize;
+    uint32_t tick;  // Absolute time the track's decoder has reached
+    uint32_t lastEventTick;  // Absolute time of the last MIDI event that passed the filters
 };
 
-static int voices[8];  // Stores notes that are held simultaneously. The note on/off events have a voice parameter which specifies which of the notes to activate/deactivate
-static unsigned long int delay = 0;  // MIDI event delay
-static int currTrack = 0;
-static bool inTrack = false;  // Set to true when we are processing a track
-static unsigned long int savedPos;  // file offset to return to after reading a track
-static struct MidiTrack *midiTracks = NULL;
-static unsigned int numMidiTracks = 0;
-static int metaTrack;
-static FILE *midiFile;
-static unsigned long int callStack[STACK_LIMIT];
-static int callStackTop = 0;
+static THREAD_LOCAL int voices[8];  // Stores notes that are held simultaneously. The note on/off events have a voice parameter which specifies which of the notes to activate/deactivate
+static THREAD_LOCAL unsigned long int delay = 0;  // MIDI event delay
+static THREAD_LOCAL int currTrack = 0;
+static THREAD_LOCAL bool inTrack = false;  // Set to true when we are processing a track
+static THREAD_LOCAL unsigned long int savedPos;  // file offset to return to after reading a track
+static THREAD_LOCAL struct MidiTrack *midiTracks = NULL;
+static THREAD_LOCAL unsigned int numMidiTracks = 0;
+static THREAD_LOCAL int metaTrack;
+static THREAD_LOCAL unsigned long int callStack[STACK_LIMIT];
+static THREAD_LOCAL int callStackTop = 0;
 static int *instrList = NULL;
 static int instrListCount = 0;
-static uint16_t usedChannelMask = 0;
-static int ticksPerQNote = 0;
+static THREAD_LOCAL uint16_t usedChannelMask = 0;
+static THREAD_LOCAL int ticksPerQNote = 0;
+static THREAD_LOCAL const uint8_t *bmsData = NULL;  // Contents of the BMS file
+static THREAD_LOCAL unsigned long int bmsSize = 0;
+static THREAD_LOCAL unsigned long int bmsPos = 0;  // Read cursor into bmsData
+static THREAD_LOCAL unsigned long int rangeStart = 0;  // Where the current run of sequential reads began
+static THREAD_LOCAL bool readPastEnd = false;  // Set when the decoder reads beyond the end of bmsData
+static const char *cacheDir = NULL;  // Directory to keep cached tracks in, or NULL for no caching
+static const char *eventsFilename = NULL;  // Optional outputs besides the MIDI file
+static const char *statsFilename = NULL;
+static const char *disasmFilename = NULL;
+static const char *renderFilename = NULL;
+static bool writeFormat0 = false;  // Write a single MIDI track, in time order as it is decoded
+
+// We will show extremely verbose messages if DEBUG is defined. They go to stderr,
+// so that they don't end up in an output written to standard output. Forked
+// children turn them off, since theirs would only get mixed together.
+static bool debugMessages = true;
 
-// We will show extremely verbose messages if DEBUG is defined.
 #ifdef DEBUG
 static void DEBUG_printf(const char *fmt, ...)
 {
     va_list args;
     
+    if (!debugMessages)
+        return;
     va_start(args, fmt);
-    vprintf(fmt, args);
+    vfprintf(stderr, fmt, args);
     va_end(args);
-    fflush(stdout);
 }
 #else
 static void DEBUG_printf(const char *fmt, ...) {(void)fmt;}
@@ -76,23 +128,131 @@ static void DEBUG_printf(const char *fmt, ...) {(void)fmt;}
 
 static void usage(const char *progName)
 {
-    printf("usage: %s bmsFile midiFile instrumentList\n"
+    printf("usage: %s [options] bmsFile midiFile instrumentList\n"
+      "       %s [options] --watch dir instrumentList\n"
+      "       %s --head count bmsFile instrumentList\n"
+      "       %s [options] --play target bmsFile [instrumentList]\n"
+      "       %s --reverse midiFile bmsFile\n"
+      "       %s --verify file1 file2 instrumentList\n"
+      "       %s [--update] [--baseline] --check dir [instrumentList]\n"
+      "       %s --gen-fixture seed bmsFile\n"
+      "       %s --sf2 sf2File --bank file --wsys file [instrumentList]\n"
+      "       %s --gen-instrument-list instrumentList --bank file [--wsys file]\n"
+      "       %s [--jobs n] --index indexFile dir [instrumentList]\n"
+      "       %s --search indexFile melody\n"
+      "       %s [--jobs n] --find-duplicates dir [instrumentList]\n"
+      "       %s [--jobs n] [--shard i/N] --batch dir manifest [instrumentList]\n"
+      "       %s --merge-manifests mergedManifest manifest...\n"
       "where bmsFile is the input .bms file, midiFile is the output .mid file,\n"
       "and instrumentList is a text file containing a list of instrument names\n"
       "or general MIDI numbers for each instrument ID. This file is optional,\n"
-      "but the instruments used in the MIDI will probably be wrong without it.\n",
-      progName);
+      "but the instruments used in the MIDI will probably be wrong without it.\n"
+      "\n",
+      progName, progName, progName, progName, progName, progName, progName, progName, progName, progName,
+      progName, progName, progName, progName, progName);
+    fputs("options:\n"
+      "  --watch dir    watch dir for changed .bms files (or a changed instrument\n"
+      "                 list) and reconvert each one to a .mid file next to it\n"
+      "  --jobs n       number of conversions to run at once in watch mode, or of\n"
+      "                 files to read at once with --index, --find-duplicates or\n"
+      "                 --batch\n"
+      "  --cache dir    keep the MIDI data of each track in dir, so that tracks\n"
+      "                 that haven't changed don't need to be decoded again\n"
+      "  --event-cache dir  keep the decoded events of each file in dir, so that\n"
+      "                 converting the same file again (to any outputs) doesn't\n"
+      "                 decode it. Files not in the cache don't use --cache.\n"
+      "  --events file  also write every decoded event to file, as JSON (or as\n"
+      "                 CSV if the name ends in .csv)\n"
+      "  --stats file   also write a summary of the sequence to file\n"
+      "  --disasm file  also write a disassembly of the sequence to file\n"
+      "  --trace file   write a trace of where the time went to file, in Chrome's\n"
+      "                 trace event format (for Perfetto), when the run finishes\n"
+      "  --memory-limit size  fail the conversion of any file whose MIDI tracks and\n"
+      "                 decoder tables need more than size bytes (may end in K, M\n"
+      "                 or G), instead of letting it use up the memory of a\n"
+      "                 --batch or --watch run\n"
+      "  --format0      write a single track MIDI file (format 0), with the events\n"
+      "                 of all tracks merged in time order. The file is written as\n"
+      "                 the sequence is decoded, so midiFile can be - to stream it\n"
+      "                 to another program.\n"
+      "  --render file  also play the sequence through a simple synthesizer and\n"
+      "                 write the audio to file as a WAV\n"
+      "  --bank file    render with the instruments in this IBNK file (may be\n"
+      "                 given more than once)\n"
+      "  --wsys file    WSYS file describing the waves the banks use (may be\n"
+      "                 given more than once)\n"
+      "  --aw-dir dir   directory of the .aw wave archives (default: next to the\n"
+      "                 WSYS file)\n", stdout);
+    fputs("  --sf2 file     write the instruments of the first bank as a SoundFont, with\n"
+      "                 presets numbered like the programs in converted MIDI files\n"
+      "  --gen-instrument-list file  write a suggested instrument list for the\n"
+      "                 first bank, guessed from its instruments and samples. With\n"
+      "                 --cache, the list is kept and reused for the same files.\n"
+      "  --play target  play bmsFile in real time, sending raw MIDI messages to\n"
+      "                 target: a FIFO, a Unix socket or a MIDI device such as\n"
+      "                 /dev/snd/midiC0D0. Reports how accurate the timing was.\n"
+      "  --index file   index the melodies of every .bms file under dir (including\n"
+      "                 subdirectories), in any key, and write the index to file\n"
+      "  --search file  list the tracks in an index that contain melody, given as\n"
+      "                 MIDI note numbers or names (e.g. \"C4 E4 G4 C5\"), best first\n"
+      "  --find-duplicates dir  list the tracks and subroutines of the .bms files\n"
+      "                 under dir that are identical or similar to each other\n"
+      "  --batch dir    convert every .bms file under dir to a .mid file next to\n"
+      "                 it, and list the files with hashes of their input and\n"
+      "                 output in manifest\n"
+      "  --shard i/N    with --batch, only convert the ith of N shards of the\n"
+      "                 files, balanced by size. Each machine gets the same shards.\n"
+      "  --metrics file  with --batch or --watch, keep counts of the conversions\n"
+      "                 and how long they took, and write them to file every few\n"
+      "                 seconds in Prometheus text format\n"
+      "  --merge-manifests file  check that the manifests of all N shards cover\n"
+      "                 each file once, and combine them into file\n"
+      "  --head count   print only the first count events of bmsFile, without\n"
+      "                 decoding the rest of it\n"
+      "  --tracks list  only convert these tracks, numbered from 1 in the order\n"
+      "                 they are started (e.g. 1,3,5-7). Other tracks are skipped.\n"
+      "                 Skipping a drum track can shift later tracks up a channel.\n"
+      "  --channels list  only keep events on these MIDI channels\n"
+      "  --only classes only keep these kinds of events: notes, program, volume,\n"
+      "                 pan, tempo, other (e.g. notes,program)\n"
+      "  --pitch lo-hi  only keep notes within this pitch range\n"
+      "  --reverse      convert midiFile to a BMS file instead. Repeated phrases\n"
+      "                 are turned into subroutines.\n"
+      "  --verify       check that two files (MIDI or BMS) play the same events,\n"
+      "                 ignoring differences in how they are laid out\n"
+      "  --check dir    convert each .bms file in dir and compare the results with\n"
+      "                 the stored golden files\n"
+      "  --baseline     with --check, also compare the time and memory of each\n"
+      "                 conversion with baseline.txt, recording any missing ones\n"
+      "  --update       with --check, replace the golden files (and the baseline,\n"
+      "                 with --baseline)\n"
+      "  --gen-fixture seed  write a synthetic BMS file for testing\n"
+      "a file name of - means standard output.\n", stdout);
 }
 
+// While a library entry point is running, errors jump back to it instead of exiting
+static THREAD_LOCAL jmp_buf *errorHandler = NULL;
+static THREAD_LOCAL char errorMessage[256];
+
+static void dump_flight_recorder(void);
+
 static void fatal_error(const char *fmt, ...)
 {
     va_list args;
     
+    if (errorHandler != NULL)
+    {
+        va_start(args, fmt);
+        vsnprintf(errorMessage, sizeof(errorMessage), fmt, args);
+        va_end(args);
+        longjmp(*errorHandler, 1);
+    }
     fflush(stdout);
     fputs("ERROR! ", stderr);
     va_start(args, fmt);
     vfprintf(stderr, fmt, args);
     va_end(args);
+    dump_flight_recorder();
     exit(1);
 }
 
@@ -100,38 +260,44 @@ static void fatal_error(const char *fmt, ...)
 // File Read/Write Functions
 //------------------------------------------------------------------------------
 
-static uint8_t read_u8(FILE *file)
+// The whole BMS file is loaded into memory and read through a cursor. Like fgetc,
+// reading past the end of the data yields 0xFF (EOF) without advancing.
+
+static uint8_t read_u8(void)
 {
-    return fgetc(file);
+    if (bmsPos < bmsSize)
+        return bmsData[bmsPos++];
+    readPastEnd = true;
+    return 0xFF;
 }
 
-static uint16_t read_u16(FILE *file)
+static uint16_t read_u16(void)
 {
     uint16_t val;
     
-    val = (fgetc(file) & 0xFF) << 8;
-    val |= fgetc(file) & 0xFF;
+    val = read_u8() << 8;
+    val |= read_u8();
     return val;
 }
 
-static uint32_t read_u24(FILE *file)
+static uint32_t read_u24(void)
 {
     uint32_t val;
     
-    val = (fgetc(file) & 0xFF) << 16;
-    val |= (fgetc(file) & 0xFF) << 8;
-    val |= fgetc(file) & 0xFF;
+    val = read_u8() << 16;
+    val |= read_u8() << 8;
+    val |= read_u8();
     return val;
 }
 
-static uint32_t read_u32(FILE *file)
+static uint32_t read_u32(void)
 {
     uint32_t val;
     
-    val = (fgetc(file) & 0xFF) << 24;
-    val |= (fgetc(file) & 0xFF) << 16;
-    val |= (fgetc(file) & 0xFF) << 8;
-    val |= fgetc(file) & 0xFF;
+    val = (uint32_t)read_u8() << 24;
+    val |= read_u8() << 16;
+    val |= read_u8() << 8;
+    val |= read_u8();
     return val;
 }
 
@@ -149,9 +315,169 @@ static void write_u32(FILE *file, uint32_t val)
     fwrite(buf, 1, sizeof(buf), file);
 }
 
-static void fskip(FILE *file, int len)
+static void write_varlen(FILE *file, uint32_t val)
+{
+    unsigned long int buf = val & 0x7F;
+    
+    while ((val >>= 7) != 0)
+    {
+        buf <<= 8;
+        buf |= (val & 0x7F) | 0x80;
+    }
+    while (1)
+    {
+        fputc(buf & 0xFF, file);
+        if (buf & 0x80)
+            buf >>= 8;
+        else
+            break;
+    }
+}
+
+static void track_cache_record_range(unsigned long int start, unsigned long int end);
+
+static void seek_to(unsigned long int pos)
+{
+    if (inTrack)
+        track_cache_record_range(rangeStart, bmsPos);
+    bmsPos = pos;
+    rangeStart = pos;
+}
+
+static uint8_t *read_file(const char *filename, unsigned long int *size)
+{
+    FILE *file = fopen(filename, "rb");
+    uint8_t *data;
+    long int len;
+    
+    if (file == NULL)
+        return NULL;
+    fseek(file, 0, SEEK_END);
+    len = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (len < 0)
+    {
+        fclose(file);
+        return NULL;
+    }
+    data = malloc(len + 1);
+    if (fread(data, 1, len, file) != (size_t)len)
+    {
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    *size = len;
+    return data;
+}
+
+//------------------------------------------------------------------------------
+// Memory Budget
+//------------------------------------------------------------------------------
+
+// The MIDI tracks and the decoder's tables are allocated through budget_realloc,
+// which keeps count of how many bytes they use. With a limit set (--memory-limit
+// or bms_set_memory_limit), a conversion that needs more than that fails with an
+// error like any invalid sequence does, instead of growing until the process
+// runs out of memory and takes every other conversion in it down too.
+
+static THREAD_LOCAL unsigned long int memoryLimit = 0;  // 0 for no limit
+static THREAD_LOCAL unsigned long int memoryUsed = 0;
+static THREAD_LOCAL unsigned long int memoryJobStart = 0;  // memoryUsed when the current conversion started
+static THREAD_LOCAL unsigned long int memoryPeak = 0;  // Most the current conversion has used
+
+// Memory used by the current conversion. Memory still held from earlier ones
+// (such as the notes of bms_notes_open) doesn't count against it.
+static unsigned long int budget_job_used(void)
+{
+    return (memoryUsed > memoryJobStart) ? memoryUsed - memoryJobStart : 0;
+}
+
+// Fails if size more bytes would go over the limit
+static void budget_check(size_t size)
+{
+    if (memoryLimit != 0 && (size > memoryLimit || budget_job_used() > memoryLimit - size))
+        fatal_error("Memory limit of %lu bytes exceeded\n", memoryLimit);
+}
+
+// Like realloc, but ptr's old size has to be given too. A newSize of 0 frees ptr.
+// On failure, ptr is left as it was.
+static void *budget_realloc(void *ptr, size_t oldSize, size_t newSize)
+{
+    if (newSize > oldSize)
+        budget_check(newSize - oldSize);
+    if (newSize == 0)
+    {
+        free(ptr);
+        ptr = NULL;
+    }
+    else
+    {
+        ptr = realloc(ptr, newSize);
+        if (ptr == NULL)
+            fatal_error("Out of memory allocating %lu bytes\n", (unsigned long int)newSize);
+    }
+    memoryUsed = memoryUsed - oldSize + newSize;
+    if (budget_job_used() > memoryPeak)
+        memoryPeak = budget_job_used();
+    return ptr;
+}
+
+static void budget_free(void *ptr, size_t size)
+{
+    budget_realloc(ptr, size, 0);
+}
+
+// Starts counting the peak of a new conversion
+static void budget_start_job(void)
+{
+    memoryJobStart = memoryUsed;
+    memoryPeak = 0;
+}
+
+// Parses a number of bytes, which may end in K, M or G
+static unsigned long int parse_memory_size(const char *str)
+{
+    char *end;
+    unsigned long int size;
+    int shift = 0;
+    
+    errno = 0;
+    size = strtoul(str, &end, 10);
+    switch (*end)
+    {
+    case 'G':
+    case 'g':
+        shift = 30;
+        end++;
+        break;
+    case 'M':
+    case 'm':
+        shift = 20;
+        end++;
+        break;
+    case 'K':
+    case 'k':
+        shift = 10;
+        end++;
+        break;
+    }
+    if (end == str || *end != '\0' || !isdigit((unsigned char)str[0]))
+        fatal_error("Invalid memory size '%s'\n", str);
+    if (errno == ERANGE || size > (ULONG_MAX >> shift))
+        fatal_error("Memory size '%s' is too large\n", str);
+    return size << shift;
+}
+
+void bms_set_memory_limit(unsigned long int bytes)
+{
+    memoryLimit = bytes;
+}
+
+unsigned long int bms_peak_memory(void)
 {
-    fseek(file, len, SEEK_CUR);
+    return memoryPeak;
 }
 
 //------------------------------------------------------------------------------
@@ -162,20 +488,37 @@ static int add_track(void)
 {
     int track = numMidiTracks;
     
+    // Grown before numMidiTracks changes, so that it still matches if this fails
+    midiTracks = budget_realloc(midiTracks, numMidiTracks * sizeof(*midiTracks), (numMidiTracks + 1) * sizeof(*midiTracks));
     numMidiTracks++;
-    midiTracks = realloc(midiTracks, numMidiTracks * sizeof(*midiTracks));
     midiTracks[track].length = 0;
     midiTracks[track].buffer = NULL;
+    midiTracks[track].bufferSize = 0;
     midiTracks[track].channel = -1;
+    midiTracks[track].tick = 0;
+    midiTracks[track].lastEventTick = 0;
     return track;
 }
 
+// Makes room in a track's buffer for size more bytes
+static void track_reserve(int track, int size)
+{
+    int bufferSize = (midiTracks[track].bufferSize != 0) ? midiTracks[track].bufferSize : 256;
+    
+    if (midiTracks[track].length + size <= midiTracks[track].bufferSize)
+        return;
+    while (bufferSize < midiTracks[track].length + size)
+        bufferSize *= 2;
+    midiTracks[track].buffer = budget_realloc(midiTracks[track].buffer, midiTracks[track].bufferSize, bufferSize);
+    midiTracks[track].bufferSize = bufferSize;
+}
+
 static void track_write_u8(int track, uint8_t val)
 {
     int offset = midiTracks[track].length;
     
+    track_reserve(track, 1);
     midiTracks[track].length++;
-    midiTracks[track].buffer = realloc(midiTracks[track].buffer, midiTracks[track].length);
     midiTracks[track].buffer[offset] = val;
 }
 
@@ -183,8 +526,8 @@ static void track_write_u24(int track, uint32_t val)
 {
     int offset = midiTracks[track].length;
     
+    track_reserve(track, 3);
     midiTracks[track].length += 3;
-    midiTracks[track].buffer = realloc(midiTracks[track].buffer, midiTracks[track].length);
     midiTracks[track].buffer[offset + 0] = (val >> 16) & 0xFF;
     midiTracks[track].buffer[offset + 1] = (val >> 8) & 0xFF;
     midiTracks[track].buffer[offset + 2] = val & 0xFF;
@@ -211,554 +554,9125 @@ static void track_write_varlen(int track, uint32_t val)
 }
 
 //------------------------------------------------------------------------------
-// BMS Event Handlers
+// Events
 //------------------------------------------------------------------------------
 
-// 0x00 - 0x7F
-static void event_note_on(FILE *file, uint8_t pitch)
+// The decoder doesn't write any output itself. Each event it decodes is passed to
+// every registered sink, so a single pass over the BMS file can produce the MIDI
+// file along with an event dump, statistics and a disassembly.
+
+static const char *const eventTypeNames[] =
 {
-    uint8_t voice = read_u8(file);
-    uint8_t volume = read_u8(file);
-    
-    // simple hack to make the percussion sound reasonably close,
-    // though the note numbers do not match up at all with General MIDI drum kits.
-    if (midiTracks[currTrack].channel == 9)
-        pitch -= 1;
-    
-    DEBUG_printf("[NOTE_ON]\tpitch %i, voice %i, volume %i\n", pitch, voice, volume);
-    assert(voice < 8);
-    track_write_varlen(currTrack, delay);
-    track_write_u8(currTrack, 0x90 + midiTracks[currTrack].channel);
-    track_write_u8(currTrack, pitch);
-    track_write_u8(currTrack, volume);
-    delay = 0;
-    voices[voice] = pitch;
+    [EVENT_NOTE_ON]         = "note_on",
+    [EVENT_NOTE_OFF]        = "note_off",
+    [EVENT_DELAY]           = "delay",
+    [EVENT_TRACK_START]     = "track_start",
+    [EVENT_TRACK_END]       = "track_end",
+    [EVENT_BANK]            = "bank",
+    [EVENT_PROGRAM]         = "program",
+    [EVENT_VOLUME]          = "volume",
+    [EVENT_PAN]             = "pan",
+    [EVENT_TEMPO]           = "tempo",
+    [EVENT_TICKS_PER_QNOTE] = "ticks_per_qnote",
+    [EVENT_CALL]            = "call",
+    [EVENT_RETURN]          = "return",
+    [EVENT_GOTO]            = "goto",
+    [EVENT_UNKNOWN]         = "unknown",
+};
+
+struct EventSink
+{
+    void (*handle_event)(struct EventSink *sink, const struct Event *event);
+    void (*finish)(struct EventSink *sink);
+    FILE *file;
+    unsigned long int count;  // Number of events handled so far
+};
+
+#define MAX_SINKS 8
+
+static THREAD_LOCAL struct EventSink *sinks[MAX_SINKS];
+static THREAD_LOCAL int numSinks = 0;
+static THREAD_LOCAL uint8_t currOpcode;  // Opcode being decoded
+static THREAD_LOCAL unsigned long int currOpcodeOffset;
+
+static void add_sink(struct EventSink *sink)
+{
+    assert(numSinks < MAX_SINKS);
+    sink->count = 0;
+    sinks[numSinks++] = sink;
 }
 
-// 0x81 - 0x87
-static void event_note_off(uint8_t voice)
+// Returns true for events that become MIDI events, which use up the pending delay
+static bool is_timed_event(enum EventType type)
 {
-    DEBUG_printf("[NOTE_OFF]\tvoice %i\n", voice);
-    assert(voice < 8);
-    assert(voices[voice] != -1);
-    track_write_varlen(currTrack, delay);
-    track_write_u8(currTrack, 0x80 + midiTracks[currTrack].channel);
-    track_write_u8(currTrack, voices[voice]);
-    track_write_u8(currTrack, 0);
-    delay = 0;
-    voices[voice] = -1;
+    switch (type)
+    {
+    case EVENT_NOTE_ON:
+    case EVENT_NOTE_OFF:
+    case EVENT_PROGRAM:
+    case EVENT_VOLUME:
+    case EVENT_PAN:
+    case EVENT_TEMPO:
+        return true;
+    default:
+        return false;
+    }
 }
 
-// 0x80
-static void event_delay_u8(FILE *file)
+//------------------------------------------------------------------------------
+// Flight Recorder
+//------------------------------------------------------------------------------
+
+// Keeps the last few events the decoder produced, so that when a conversion
+// fails, the error can be printed along with what led up to it. This is always
+// on, so recording is just a copy into a ring buffer.
+
+#define RECORDER_SIZE 32  // Must be a power of two
+
+static THREAD_LOCAL struct Event recorder[RECORDER_SIZE];
+static THREAD_LOCAL unsigned int recorderCount = 0;
+
+static void record_event(const struct Event *event)
+{
+    recorder[recorderCount & (RECORDER_SIZE - 1)] = *event;
+    recorderCount++;
+}
+
+// dump_flight_recorder is also called from the SIGABRT handler, where snprintf
+// isn't safe to use, so its lines are put together with these instead.
+
+struct RecorderLine
+{
+    char text[160];
+    int length;
+};
+
+static void line_put(struct RecorderLine *line, char c)
+{
+    if (line->length < (int)sizeof(line->text))
+        line->text[line->length++] = c;
+}
+
+// Appends str, padded with pad to width characters. A negative width pads on the right.
+static void line_append(struct RecorderLine *line, const char *str, int width, char pad)
 {
-    delay += read_u8(file);
+    int length = strlen(str);
     
-    DEBUG_printf("[DELAY8]\t%lu\n", delay);
+    for (int i = length; i < width; i++)
+        line_put(line, pad);
+    for (int i = 0; i < length; i++)
+        line_put(line, str[i]);
+    for (int i = length; i < -width; i++)
+        line_put(line, pad);
 }
 
-// 0x88
-static void event_delay_u16(FILE *file)
+static void line_append_number(struct RecorderLine *line, long int val, int base, int width, char pad)
 {
-    delay += read_u16(file);
+    char digits[24];
+    char str[24];
+    int numDigits = 0;
+    int length = 0;
+    unsigned long int n = (val < 0) ? -(unsigned long int)val : (unsigned long int)val;
     
-    DEBUG_printf("[DELAY16]\t%lu\n", delay);
+    do
+    {
+        digits[numDigits++] = "0123456789ABCDEF"[n % base];
+        n /= base;
+    } while (n != 0);
+    if (val < 0)
+        str[length++] = '-';
+    while (numDigits > 0)
+        str[length++] = digits[--numDigits];
+    str[length] = '\0';
+    line_append(line, str, width, pad);
 }
 
-static int get_available_channel(void)
+// Prints the recorded events to stderr
+static void dump_flight_recorder(void)
 {
-    // Search for a channel that hasn't been taken.
-    // Avoid using channel 9 because it is percussion only
-    for (int i = 0; i < MAX_CHANNELS; i++)
+    struct RecorderLine line;
+    unsigned int start = (recorderCount > RECORDER_SIZE) ? recorderCount - RECORDER_SIZE : 0;
+    
+    if (bmsData == NULL)
+        return;
+    line.length = 0;
+    line_append(&line, "while decoding opcode ", 0, ' ');
+    line_append_number(&line, currOpcode, 16, 2, '0');
+    line_append(&line, " at address 0x", 0, ' ');
+    line_append_number(&line, currOpcodeOffset, 16, 0, '0');
+    line_append(&line, ". The last ", 0, ' ');
+    line_append_number(&line, recorderCount - start, 10, 0, ' ');
+    line_append(&line, " events were:\n", 0, ' ');
+    if (write(STDERR_FILENO, line.text, line.length) < 0)
+        return;
+    for (unsigned int i = start; i < recorderCount; i++)
     {
-        if ((usedChannelMask & (1 << i)) == 0 && i != 9)
+        const struct Event *event = &recorder[i & (RECORDER_SIZE - 1)];
+        
+        line.length = 0;
+        line_append(&line, "  ", 0, ' ');
+        line_append_number(&line, event->offset, 16, 6, '0');
+        line_append(&line, "  ", 0, ' ');
+        line_append_number(&line, event->opcode, 16, 2, '0');
+        line_append(&line, "  track ", 0, ' ');
+        line_append_number(&line, event->track, 10, -3, ' ');
+        line_append(&line, " depth ", 0, ' ');
+        line_append_number(&line, event->depth, 10, 0, ' ');
+        line_append(&line, " tick ", 0, ' ');
+        line_append_number(&line, event->tick, 10, -7, ' ');
+        line_append(&line, " ", 0, ' ');
+        line_append(&line, eventTypeNames[event->type], -15, ' ');
+        for (int j = 0; j < event->numOperands; j++)
         {
-            usedChannelMask |= 1 << i;
-            return i;
+            line_append(&line, " ", 0, ' ');
+            line_append_number(&line, event->operands[j], 10, 0, ' ');
         }
+        line.length = (line.length < (int)sizeof(line.text)) ? line.length : (int)sizeof(line.text) - 1;
+        line_put(&line, '\n');
+        if (write(STDERR_FILENO, line.text, line.length) < 0)
+            return;
     }
-    // If we have no choice, use channel 9 if it's available
-    if ((usedChannelMask & (1 << 9)) == 0)
+}
+
+static void abort_handler(int sig)
+{
+    dump_flight_recorder();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+//------------------------------------------------------------------------------
+// Tracing
+//------------------------------------------------------------------------------
+
+// With --trace file, the time spent in each phase of a run is recorded as spans
+// and written to file in Chrome's trace event format when the program exits, to
+// be viewed in Perfetto or chrome://tracing. The decoder adds a span for each
+// track it decodes and each subroutine call, nested as they are in the file. Wave
+// decoding threads get their own rows, and so do the children that the corpus
+// modes fork: each writes its spans to a part file when it finishes, and the
+// parent adds those to its own when it writes the trace.
+
+#define TRACE_MAX_SPANS 1000000  // Beyond this, spans are counted but not kept
+#define TRACE_STACK_SIZE 64
+
+struct TraceSpan
+{
+    char name[56];
+    const char *category;
+    uint64_t start;  // Nanoseconds since the trace started
+    uint64_t end;
+    int tid;  // 0 for the main thread, numbered from 1 for worker threads
+};
+
+static const char *traceFilename = NULL;
+static struct TraceSpan *traceSpans = NULL;
+static unsigned int numTraceSpans = 0;
+static unsigned int traceSpanCapacity = 0;
+static unsigned long int droppedTraceSpans = 0;
+static struct timespec traceStartTime;
+static pid_t tracePid;  // Process that writes the trace file
+static int numTraceParts = 0;  // Part files written by forked children
+static pthread_mutex_t traceMutex = PTHREAD_MUTEX_INITIALIZER;
+static THREAD_LOCAL int traceStack[TRACE_STACK_SIZE];  // Open decoder spans
+static THREAD_LOCAL int traceStackTop = 0;
+
+static uint64_t trace_now(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - traceStartTime.tv_sec) * 1000000000 + now.tv_nsec - traceStartTime.tv_nsec;
+}
+
+static int trace_vbegin(int tid, const char *category, const char *fmt, va_list args)
+{
+    int span;
+    
+    pthread_mutex_lock(&traceMutex);
+    if (numTraceSpans >= TRACE_MAX_SPANS)
     {
-        usedChannelMask |= 1 << 9;
-        return 9;
+        droppedTraceSpans++;
+        pthread_mutex_unlock(&traceMutex);
+        return -1;
     }
-    fatal_error("Cannot use more than 16 MIDI channels\n");
-    return -1;
+    if (numTraceSpans == traceSpanCapacity)
+    {
+        traceSpanCapacity = (traceSpanCapacity != 0) ? traceSpanCapacity * 2 : 1024;
+        traceSpans = realloc(traceSpans, traceSpanCapacity * sizeof(*traceSpans));
+    }
+    span = numTraceSpans++;
+    vsnprintf(traceSpans[span].name, sizeof(traceSpans[span].name), fmt, args);
+    traceSpans[span].category = category;
+    traceSpans[span].tid = tid;
+    traceSpans[span].start = trace_now();
+    traceSpans[span].end = traceSpans[span].start;
+    pthread_mutex_unlock(&traceMutex);
+    return span;
 }
 
-// 0xC1
-static void event_track_start(FILE *file)
+// Starts a span and returns it, or returns -1 if tracing is off
+static int trace_begin(int tid, const char *category, const char *fmt, ...)
 {
-    long int trackOffset;
+    va_list args;
+    int span;
     
-    read_u8(file);
-    trackOffset = read_u24(file);
-    savedPos = ftell(file);
-    fseek(file, trackOffset, SEEK_SET);
-    currTrack = add_track();
-    midiTracks[currTrack].channel = get_available_channel();
-    inTrack = true;
-    DEBUG_printf("[TRACK_START]\t%i\n", currTrack);
+    if (traceFilename == NULL)
+        return -1;
+    va_start(args, fmt);
+    span = trace_vbegin(tid, category, fmt, args);
+    va_end(args);
+    return span;
 }
 
-static uint8_t convert_instrument(uint8_t instr)
+static void trace_end(int span)
 {
-    if (instr < instrListCount)
-        return instrList[instr];  // If alternative instrument is specified in list, return that
-    else
-        return instr;  // Otherwise, don't change it
+    if (span < 0)
+        return;
+    pthread_mutex_lock(&traceMutex);
+    traceSpans[span].end = trace_now();
+    pthread_mutex_unlock(&traceMutex);
 }
 
-// 0xA4
-static void event_instrument(FILE *file)
+// Decoder spans are kept on a stack, since a track or subroutine ends at an opcode of its own
+static void trace_push(const char *category, const char *fmt, ...)
 {
-    uint8_t event2 = read_u8(file);
+    va_list args;
+    int span;
     
-    DEBUG_printf("[INSTRUMENT]\t");
-    switch (event2)
+    if (traceFilename == NULL)
+        return;
+    va_start(args, fmt);
+    span = trace_vbegin(0, category, fmt, args);
+    va_end(args);
+    if (traceStackTop < TRACE_STACK_SIZE)
+        traceStack[traceStackTop++] = span;
+    else
+        trace_end(span);
+}
+
+// Ends the innermost open span of the category, and any inside it. The decoder
+// doesn't check that calls return before their track ends.
+static void trace_pop(const char *category)
+{
+    while (traceStackTop > 0)
     {
-        case 0x20:  // Bank
-        {
-            uint8_t bank = read_u8(file);
-            
-            DEBUG_printf("(set bank) %i\n", bank);
-            break;
-        }
-        case 0x21:  // Instrument
-        {
-            uint8_t oldInstr = read_u8(file);
-            uint8_t instr = convert_instrument(oldInstr);
-            
-            if (instr == 128)  // Drum Kit - move this track to channel 9
-            {
-                // Make sure channel 9 is not already in use
-                assert((usedChannelMask & (1 << 9)) == 0);
-                usedChannelMask &= ~(1 << midiTracks[currTrack].channel);
-                usedChannelMask |= (1 << 9);
-                midiTracks[currTrack].channel = 9;
-                instr = 0;
-            }
-            track_write_varlen(currTrack, delay);
-            track_write_u8(currTrack, 0xC0 + midiTracks[currTrack].channel);
-            track_write_u8(currTrack, instr);
-            delay = 0;
-            DEBUG_printf("(set instrument) %i, %i\n", oldInstr, instr);
+        int span = traceStack[--traceStackTop];
+        
+        trace_end(span);
+        if (span >= 0 && strcmp(traceSpans[span].category, category) == 0)
             break;
-        }
-        default:
-            // TODO: Figure out what event2 = 7 is supposed to mean
-            fskip(file, 1);
-            DEBUG_printf("(%u)\n", event2);
     }
 }
 
-// 0xFD
-static void event_tempo(FILE *file)
+static void trace_pop_all(void)
 {
-    uint16_t tempo = read_u16(file);
-    
-    DEBUG_printf("[TEMPO]\t%u bpm\n", tempo);
-    if (inTrack)
-        fputs("Warning: setting tempo within a track is not supported\n", stderr);
-    else
+    while (traceStackTop > 0)
+        trace_end(traceStack[--traceStackTop]);
+}
+
+static void write_json_string(FILE *file, const char *str)
+{
+    fputc('"', file);
+    for (; *str != '\0'; str++)
     {
-        unsigned int usec = 60 * 1000000 / tempo;  // microseconds per quarter note
-        
-        track_write_varlen(metaTrack, delay);
-        track_write_u8(metaTrack, 0xFF);
-        track_write_u8(metaTrack, 0x51);
-        track_write_u8(metaTrack, 0x03);
-        track_write_u24(metaTrack, usec);
-        delay = 0;
+        if (*str == '"' || *str == '\\')
+            fprintf(file, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            fprintf(file, "\\u%04x", *str);
+        else
+            fputc(*str, file);
     }
+    fputc('"', file);
 }
 
-// 0xC4
-static void event_subroutine_call(FILE *file)
+// Writes each span as a line of its own, so that part files can be joined with commas
+static void write_trace_spans(FILE *file, const char *processName)
 {
-    unsigned long int dest = read_u32(file);
+    pid_t pid = getpid();
     
-    if (callStackTop >= STACK_LIMIT)
-        fatal_error("Call stack limit reached\n");
-    callStack[callStackTop] = ftell(file);  // Push return address onto stack
-    callStackTop++;
-    fseek(file, dest, SEEK_SET);
-    DEBUG_printf("[CALL]\tCall to subroutine 0x%X\n", (unsigned int)dest);
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%i,\"tid\":0,\"args\":{\"name\":", (int)pid);
+    write_json_string(file, processName);
+    fputs("}}", file);
+    for (unsigned int i = 0; i < numTraceSpans; i++)
+    {
+        const struct TraceSpan *span = &traceSpans[i];
+        
+        fputs(",\n{\"name\":", file);
+        write_json_string(file, span->name);
+        fprintf(file, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%i,\"tid\":%i}", span->category,
+          span->start / 1000.0, (span->end - span->start) / 1000.0, (int)pid, span->tid);
+    }
 }
 
-// 0xC6
-static void event_subroutine_return(FILE *file)
+static char *trace_part_filename(int part)
 {
-    unsigned long int dest;
+    char *name = malloc(strlen(traceFilename) + 16);
     
-    callStackTop--;
-    if (callStackTop < 0)
-        fatal_error("Attempted to return outside of subroutine\n");
-    dest = callStack[callStackTop];  // Pop return address from stack
-    fseek(file, dest, SEEK_SET);
-    DEBUG_printf("[RETURN]\tReturning to 0x%X\n", (unsigned int)dest);
+    sprintf(name, "%s.part%i", traceFilename, part);
+    return name;
 }
 
-// 0xFE
-static void event_ticks_per_qnote(FILE *file)
+// Called in a forked child before it exits
+static void write_trace_part(int part)
 {
-    uint16_t val = read_u16(file);
+    char *partName;
+    char processName[32];
+    FILE *file;
     
-    DEBUG_printf("[TICKS]\t");
-    if (ticksPerQNote != 0)
-        DEBUG_printf("Warining: Ticks per quarter note already set. Ignoring.\n");
-    else
+    if (traceFilename == NULL)
+        return;
+    partName = trace_part_filename(part);
+    file = fopen(partName, "w");
+    if (file != NULL)
     {
-        DEBUG_printf("Setting ticks per quarter note to %u\n", val);
-        ticksPerQNote = val;
+        snprintf(processName, sizeof(processName), "worker %i", part);
+        trace_pop_all();
+        write_trace_spans(file, processName);
+        fclose(file);
     }
+    free(partName);
 }
 
-// 0x9C
-static void event_volume(FILE *file)
+static void write_trace(void)
 {
-    uint8_t event2 = read_u8(file);
+    FILE *file;
     
-    DEBUG_printf("[VOLUME]\t");
-    switch (event2)
+    if (traceFilename == NULL || getpid() != tracePid)
+        return;
+    trace_pop_all();
+    file = fopen(traceFilename, "w");
+    if (file == NULL)
     {
-    case 0:  // Volume change
+        fprintf(stderr, "Warning: failed to write trace '%s': %s\n", traceFilename, strerror(errno));
+        return;
+    }
+    fputs("{\"traceEvents\":[\n", file);
+    write_trace_spans(file, "bms2mid");
+    for (int i = 0; i < numTraceParts; i++)
     {
-        uint8_t volume = read_u8(file);
-        uint8_t duration = read_u8(file);  // Not really sure what this is for.
+        char *partName = trace_part_filename(i);
+        FILE *part = fopen(partName, "r");
+        char buffer[4096];
+        size_t len;
         
-        assert(volume <= 127);
-        DEBUG_printf("(set volume) vol = %u, duration = %u\n", volume, duration);
-        track_write_varlen(currTrack, delay);
-        track_write_u8(currTrack, 0xB0 + midiTracks[currTrack].channel);
-        track_write_u8(currTrack, 0x07);
-        track_write_u8(currTrack, volume);
+        if (part != NULL)
+        {
+            fputs(",\n", file);
+            while ((len = fread(buffer, 1, sizeof(buffer), part)) > 0)
+                fwrite(buffer, 1, len, file);
+            fclose(part);
+            remove(partName);
+        }
+        free(partName);
+    }
+    fputs("\n],\"displayTimeUnit\":\"ms\"}\n", file);
+    fclose(file);
+    if (droppedTraceSpans != 0)
+        fprintf(stderr, "Warning: the trace is missing %lu spans\n", droppedTraceSpans);
+}
+
+// Called in a forked child, which only writes its own spans
+static void trace_forked(void)
+{
+    numTraceSpans = 0;
+    traceStackTop = 0;
+}
+
+static void trace_start(void)
+{
+    if (traceFilename == NULL)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &traceStartTime);
+    tracePid = getpid();
+    atexit(write_trace);
+}
+
+//------------------------------------------------------------------------------
+// Event Filters
+//------------------------------------------------------------------------------
+
+// Filters are applied while decoding, so events that are filtered out never reach
+// the sinks, and tracks that are filtered out are never decoded at all.
+
+enum EventClass
+{
+    CLASS_NOTES   = 1 << 0,
+    CLASS_PROGRAM = 1 << 1,
+    CLASS_VOLUME  = 1 << 2,
+    CLASS_PAN     = 1 << 3,
+    CLASS_TEMPO   = 1 << 4,
+    CLASS_OTHER   = 1 << 5,  // Events that don't become MIDI events
+    CLASS_ALL     = (1 << 6) - 1,
+};
+
+static const struct
+{
+    const char *name;
+    unsigned int mask;
+} eventClassNames[] =
+{
+    {"notes",   CLASS_NOTES},
+    {"program", CLASS_PROGRAM},
+    {"volume",  CLASS_VOLUME},
+    {"pan",     CLASS_PAN},
+    {"tempo",   CLASS_TEMPO},
+    {"other",   CLASS_OTHER},
+};
+
+static uint32_t trackFilter = 0xFFFFFFFF;  // Bit n set = keep the nth track started by a 0xC1 event
+static uint16_t channelFilter = 0xFFFF;
+static unsigned int eventClassFilter = CLASS_ALL;
+static int minPitchFilter = 0;
+static int maxPitchFilter = 127;
+static THREAD_LOCAL int bmsTrackCount = 0;  // Number of 0xC1 events seen, including skipped tracks
+
+static bool filters_active(void)
+{
+    return trackFilter != 0xFFFFFFFF || channelFilter != 0xFFFF || eventClassFilter != CLASS_ALL
+      || minPitchFilter != 0 || maxPitchFilter != 127;
+}
+
+static unsigned int get_event_class(enum EventType type)
+{
+    switch (type)
+    {
+    case EVENT_NOTE_ON:
+    case EVENT_NOTE_OFF:
+        return CLASS_NOTES;
+    case EVENT_PROGRAM:
+        return CLASS_PROGRAM;
+    case EVENT_VOLUME:
+        return CLASS_VOLUME;
+    case EVENT_PAN:
+        return CLASS_PAN;
+    case EVENT_TEMPO:
+        return CLASS_TEMPO;
+    case EVENT_TRACK_START:
+    case EVENT_TRACK_END:
+        return CLASS_ALL;  // Always kept, since the tracks need to be delimited
+    default:
+        return CLASS_OTHER;
+    }
+}
+
+static bool event_passes_filters(const struct Event *event)
+{
+    if (!filters_active())
+        return true;
+    if ((get_event_class(event->type) & eventClassFilter) == 0)
+        return false;
+    switch (event->type)
+    {
+    case EVENT_NOTE_ON:
+    case EVENT_NOTE_OFF:
+        if ((int)event->operands[0] < minPitchFilter || (int)event->operands[0] > maxPitchFilter)
+            return false;
+        // fall through
+    case EVENT_PROGRAM:
+    case EVENT_VOLUME:
+    case EVENT_PAN:
+        return event->channel >= 0 && (channelFilter & (1 << event->channel));
+    default:
+        return true;
+    }
+}
+
+// Parses a list like "1,3,5-7" into a bit mask
+static uint32_t parse_number_list(const char *str, int max)
+{
+    uint32_t mask = 0;
+    
+    while (*str != '\0')
+    {
+        char *end;
+        long int first = strtol(str, &end, 10);
+        long int last = first;
+        
+        if (end == str)
+            fatal_error("invalid number list '%s'\n", str);
+        if (*end == '-')
+        {
+            str = end + 1;
+            last = strtol(str, &end, 10);
+            if (end == str)
+                fatal_error("invalid number list '%s'\n", str);
+        }
+        if (first < 0 || last > max || first > last)
+            fatal_error("numbers in list must be between 0 and %i\n", max);
+        for (long int i = first; i <= last; i++)
+            mask |= 1u << i;
+        str = end;
+        if (*str == ',')
+            str++;
+    }
+    return mask;
+}
+
+static unsigned int parse_event_classes(const char *str)
+{
+    unsigned int mask = 0;
+    
+    while (*str != '\0')
+    {
+        size_t len = strcspn(str, ",");
+        unsigned int i;
+        
+        for (i = 0; i < ARRAY_LENGTH(eventClassNames); i++)
+        {
+            if (strlen(eventClassNames[i].name) == len && strncmp(str, eventClassNames[i].name, len) == 0)
+                break;
+        }
+        if (i == ARRAY_LENGTH(eventClassNames))
+            fatal_error("unknown event class '%.*s'\n", (int)len, str);
+        mask |= eventClassNames[i].mask;
+        str += len;
+        if (*str == ',')
+            str++;
+    }
+    return mask;
+}
+
+//------------------------------------------------------------------------------
+// Event Emission
+//------------------------------------------------------------------------------
+
+static void emit_event(enum EventType type, int track, int numOperands, ...)
+{
+    struct Event event;
+    va_list args;
+    
+    // Events are copied byte for byte into the event cache and to Python, so
+    // the padding and unused operands mustn't be left uninitialized
+    memset(&event, 0, sizeof(event));
+    event.type = type;
+    event.opcode = currOpcode;
+    event.offset = currOpcodeOffset;
+    event.track = track;
+    event.channel = midiTracks[track].channel;
+    event.depth = callStackTop;
+    event.tick = midiTracks[track].tick;
+    event.delta = 0;
+    if (is_timed_event(type))
+    {
+        event.tick += delay;
+        midiTracks[track].tick += delay;
         delay = 0;
+    }
+    else if (type != EVENT_TRACK_END)  // The end of a track doesn't wait for the pending delay
+    {
+        event.tick += delay;
+    }
+    assert(numOperands <= (int)ARRAY_LENGTH(event.operands));
+    event.numOperands = numOperands;
+    va_start(args, numOperands);
+    for (int i = 0; i < numOperands; i++)
+        event.operands[i] = va_arg(args, unsigned int);
+    va_end(args);
+    record_event(&event);
+    
+    if (!event_passes_filters(&event))
+        return;
+    // Time since the previous MIDI event that was kept
+    if (is_timed_event(type))
+    {
+        event.delta = event.tick - midiTracks[track].lastEventTick;
+        midiTracks[track].lastEventTick = event.tick;
+    }
+    for (int i = 0; i < numSinks; i++)
+    {
+        sinks[i]->handle_event(sinks[i], &event);
+        sinks[i]->count++;
+    }
+}
+
+// Encodes the MIDI channel message an event becomes into msg. Returns its length,
+// or 0 if the event isn't a channel message.
+static int get_channel_message(const struct Event *event, uint8_t *msg)
+{
+    switch (event->type)
+    {
+    case EVENT_NOTE_ON:
+        msg[0] = 0x90 + event->channel;
+        msg[1] = event->operands[0];
+        msg[2] = event->operands[1];
+        return 3;
+    case EVENT_NOTE_OFF:
+        msg[0] = 0x80 + event->channel;
+        msg[1] = event->operands[0];
+        msg[2] = 0;
+        return 3;
+    case EVENT_PROGRAM:
+        msg[0] = 0xC0 + event->channel;
+        msg[1] = event->operands[0];
+        return 2;
+    case EVENT_VOLUME:
+        msg[0] = 0xB0 + event->channel;
+        msg[1] = 0x07;
+        msg[2] = event->operands[0];
+        return 3;
+    case EVENT_PAN:
+        msg[0] = 0xB0 + event->channel;
+        msg[1] = 0x0A;
+        msg[2] = event->operands[0];
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+// Standard MIDI File encoder. This writes the events into midiTracks.
+static void smf_handle_event(struct EventSink *sink, const struct Event *event)
+{
+    int track = event->track;
+    uint8_t msg[3];
+    int len = get_channel_message(event, msg);
+    
+    (void)sink;
+    if (len != 0)
+    {
+        track_write_varlen(track, event->delta);
+        for (int i = 0; i < len; i++)
+            track_write_u8(track, msg[i]);
+        return;
+    }
+    switch (event->type)
+    {
+    case EVENT_TEMPO:
+        track_write_varlen(track, event->delta);
+        track_write_u8(track, 0xFF);
+        track_write_u8(track, 0x51);
+        track_write_u8(track, 0x03);
+        track_write_u24(track, event->operands[1]);
+        break;
+    case EVENT_TRACK_END:
+        // The converter has always ended the last track that was started a second
+        // time when the meta track (track 0) ends, so its files keep doing that.
+        if (track == 0)
+        {
+            track_write_varlen(numMidiTracks - 1, 0);
+            track_write_u8(numMidiTracks - 1, 0xFF);
+            track_write_u8(numMidiTracks - 1, 0x2F);
+            track_write_u8(numMidiTracks - 1, 0);
+        }
+        track_write_varlen(track, 0);
+        track_write_u8(track, 0xFF);
+        track_write_u8(track, 0x2F);
+        track_write_u8(track, 0);
+        break;
+    default:
         break;
     }
-    case 0x09:  // Vibrato intensity?
-        DEBUG_printf("(vibrato?)\n");
-        fskip(file, 2);
+}
+
+static THREAD_LOCAL struct EventSink smfSink = {smf_handle_event, NULL, NULL, 0};
+
+// Format 0 Standard MIDI File encoder. This needs the events in time order (see
+// Interleaved Decoding), and writes them to the file as they arrive instead of
+// keeping them in midiTracks, so the file can be streamed to another program. The
+// length of the MTrk chunk is filled in at the end if the file is seekable, and
+// is left as 0 otherwise.
+
+static bool format0Started = false;
+static long int format0LengthPos;  // Offset of the MTrk chunk's length, or -1 if the file isn't seekable
+static uint32_t format0Tick;  // Time of the last event written
+
+// The header is written just before the first event, since the sequence sets the
+// number of ticks per quarter note with an event of its own
+static void format0_begin(FILE *file)
+{
+    fputs("MThd", file);
+    write_u32(file, 6);
+    write_u16(file, 0);  // format type
+    write_u16(file, 1);  // number of tracks
+    write_u16(file, (ticksPerQNote != 0) ? ticksPerQNote : 120);
+    fputs("MTrk", file);
+    format0LengthPos = ftell(file);
+    write_u32(file, 0);
+    format0Started = true;
+    format0Tick = 0;
+}
+
+static void format0_handle_event(struct EventSink *sink, const struct Event *event)
+{
+    uint8_t msg[3];
+    int len = get_channel_message(event, msg);
+    
+    if (len == 0 && event->type != EVENT_TEMPO)
+        return;
+    if (!format0Started)
+        format0_begin(sink->file);
+    write_varlen(sink->file, event->tick - format0Tick);
+    format0Tick = event->tick;
+    if (len != 0)
+    {
+        fwrite(msg, 1, len, sink->file);
+    }
+    else
+    {
+        uint8_t tempo[6] = {0xFF, 0x51, 0x03, event->operands[1] >> 16, event->operands[1] >> 8, event->operands[1]};
+        
+        fwrite(tempo, 1, sizeof(tempo), sink->file);
+    }
+    if (format0LengthPos < 0)
+        fflush(sink->file);  // Whatever reads the stream gets each event as soon as it's decoded
+}
+
+static void format0_finish(struct EventSink *sink)
+{
+    static const uint8_t endOfTrack[4] = {0x00, 0xFF, 0x2F, 0x00};
+    
+    if (!format0Started)
+        format0_begin(sink->file);
+    fwrite(endOfTrack, 1, sizeof(endOfTrack), sink->file);
+    if (format0LengthPos >= 0)
+    {
+        long int end = ftell(sink->file);
+        
+        fseek(sink->file, format0LengthPos, SEEK_SET);
+        write_u32(sink->file, end - format0LengthPos - 4);
+        fseek(sink->file, end, SEEK_SET);
+    }
+    format0Started = false;
+}
+
+static struct EventSink format0Sink = {format0_handle_event, format0_finish, NULL, 0};
+
+// Event dump in JSON format
+static void json_handle_event(struct EventSink *sink, const struct Event *event)
+{
+    fprintf(sink->file, "%s  {\"type\": \"%s\", \"track\": %i, \"channel\": %i, \"tick\": %u, "
+      "\"offset\": %u, \"opcode\": %u, \"operands\": [",
+      (sink->count == 0) ? "[\n" : ",\n", eventTypeNames[event->type], event->track,
+      event->channel, event->tick, event->offset, event->opcode);
+    for (int i = 0; i < event->numOperands; i++)
+        fprintf(sink->file, (i == 0) ? "%u" : ", %u", event->operands[i]);
+    fputs("]}", sink->file);
+}
+
+static void json_finish(struct EventSink *sink)
+{
+    fputs((sink->count == 0) ? "[]\n" : "\n]\n", sink->file);
+}
+
+// Event dump in CSV format
+static void csv_handle_event(struct EventSink *sink, const struct Event *event)
+{
+    if (sink->count == 0)
+        fputs("type,track,channel,tick,offset,opcode,operands\n", sink->file);
+    fprintf(sink->file, "%s,%i,%i,%u,%u,%u,", eventTypeNames[event->type], event->track,
+      event->channel, event->tick, event->offset, event->opcode);
+    for (int i = 0; i < event->numOperands; i++)
+        fprintf(sink->file, (i == 0) ? "%u" : " %u", event->operands[i]);
+    fputc('\n', sink->file);
+}
+
+// Disassembly listing
+static void disasm_handle_event(struct EventSink *sink, const struct Event *event)
+{
+    fprintf(sink->file, "%06X  %02X  track %-3i tick %-7u %*s%-15s", event->offset, event->opcode,
+      event->track, event->tick, event->depth * 2, "", eventTypeNames[event->type]);
+    for (int i = 0; i < event->numOperands; i++)
+    {
+        if (event->type == EVENT_CALL || event->type == EVENT_RETURN || event->type == EVENT_TRACK_START)
+            fprintf(sink->file, " 0x%X", event->operands[i]);
+        else
+            fprintf(sink->file, " %u", event->operands[i]);
+    }
+    fputc('\n', sink->file);
+}
+
+static struct EventSink jsonSink = {json_handle_event, json_finish, NULL, 0};
+static struct EventSink csvSink = {csv_handle_event, NULL, NULL, 0};
+static struct EventSink disasmSink = {disasm_handle_event, NULL, NULL, 0};
+
+// Summary statistics
+static struct
+{
+    unsigned long int eventCounts[NUM_EVENT_TYPES];
+    unsigned long int unknownCounts[256];  // by opcode
+    uint32_t length;  // in ticks
+    int numTracks;
+    uint16_t channelMask;
+    int minPitch;
+    int maxPitch;
+    int maxDepth;
+} stats;
+
+static void stats_reset(void)
+{
+    memset(&stats, 0, sizeof(stats));
+    stats.minPitch = 128;
+    stats.maxPitch = -1;
+}
+
+static void stats_handle_event(struct EventSink *sink, const struct Event *event)
+{
+    (void)sink;
+    stats.eventCounts[event->type]++;
+    if (event->tick > stats.length)
+        stats.length = event->tick;
+    if (event->depth > stats.maxDepth)
+        stats.maxDepth = event->depth;
+    switch (event->type)
+    {
+    case EVENT_NOTE_ON:
+        stats.channelMask |= 1 << event->channel;
+        if ((int)event->operands[0] < stats.minPitch)
+            stats.minPitch = event->operands[0];
+        if ((int)event->operands[0] > stats.maxPitch)
+            stats.maxPitch = event->operands[0];
+        break;
+    case EVENT_TRACK_START:
+        stats.numTracks++;
+        break;
+    case EVENT_UNKNOWN:
+        stats.unknownCounts[event->opcode]++;
         break;
     default:
-        DEBUG_printf("(unknown)\n");
-        fskip(file, 2);
+        break;
+    }
+}
+
+static void stats_finish(struct EventSink *sink)
+{
+    FILE *file = sink->file;
+    
+    fprintf(file, "tracks: %i\n", stats.numTracks);
+    fprintf(file, "ticks per quarter note: %i\n", (ticksPerQNote != 0) ? ticksPerQNote : 120);
+    fprintf(file, "length: %u ticks\n", stats.length);
+    fprintf(file, "channels:");
+    for (int i = 0; i < MAX_CHANNELS; i++)
+    {
+        if (stats.channelMask & (1 << i))
+            fprintf(file, " %i", i);
+    }
+    fputc('\n', file);
+    if (stats.maxPitch >= 0)
+        fprintf(file, "pitch range: %i - %i\n", stats.minPitch, stats.maxPitch);
+    fprintf(file, "max call depth: %i\n", stats.maxDepth);
+    fprintf(file, "events: %lu\n", sink->count);
+    for (int i = 0; i < NUM_EVENT_TYPES; i++)
+    {
+        if (stats.eventCounts[i] != 0)
+            fprintf(file, "  %-16s %lu\n", eventTypeNames[i], stats.eventCounts[i]);
+    }
+    for (int i = 0; i < 256; i++)
+    {
+        if (stats.unknownCounts[i] != 0)
+            fprintf(file, "  unknown 0x%02X      %lu\n", i, stats.unknownCounts[i]);
+    }
+}
+
+static struct EventSink statsSink = {stats_handle_event, stats_finish, NULL, 0};
+
+//------------------------------------------------------------------------------
+// Track Cache
+//------------------------------------------------------------------------------
+
+// A track's MIDI data depends only on the bytes its decoder reads (including the
+// subroutines it calls) and on the converter state when its 0xC1 event is reached.
+// While decoding a track, we record which byte ranges it reads. Its finished MTrk
+// data is then saved in the cache directory along with a hash of those bytes.
+// The next time the same file is converted, each track whose bytes and starting
+// state are unchanged is copied from the cache instead of being decoded again.
+
+#define TRACK_CACHE_MAGIC 0x314B5254  // "TRK1"
+
+struct TrackState
+{
+    int channel;
+    uint16_t usedChannelMask;
+    int ticksPerQNote;
+    uint64_t delay;
+    int voices[8];
+};
+
+struct ByteRange
+{
+    uint32_t start;
+    uint32_t end;
+};
+
+struct CachedTrackHeader
+{
+    uint32_t trackOffset;
+    struct TrackState startState;
+    struct TrackState endState;
+    uint64_t hash;  // Hash of the bytes within the track's ranges
+    uint32_t fileSize;  // Only checked if the track read past the end of the file
+    bool readPastEnd;
+    uint32_t numRanges;
+    uint32_t length;
+};
+
+struct CachedTrack
+{
+    struct CachedTrackHeader header;
+    struct ByteRange *ranges;
+    uint8_t *data;
+};
+
+static struct CachedTrack *oldCache = NULL;  // Tracks loaded from the cache file
+static unsigned int oldCacheCount = 0;
+static unsigned int oldCacheSize = 0;  // Entries allocated, more than oldCacheCount if the file was cut short
+static struct CachedTrack *newCache = NULL;  // Tracks that will be saved to the cache file
+static unsigned int newCacheCount = 0;
+static THREAD_LOCAL bool trackCacheEnabled = false;
+static THREAD_LOCAL struct ByteRange *trackRanges = NULL;  // Byte ranges read by the current track
+static THREAD_LOCAL unsigned int trackRangeCount = 0;
+static THREAD_LOCAL unsigned int trackRangeCapacity = 0;
+static THREAD_LOCAL struct CachedTrackHeader currTrackHeader;
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+    const uint8_t *bytes = data;
+    
+    // FNV-1a
+    for (size_t i = 0; i < len; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+#define HASH_INIT 0xCBF29CE484222325ULL
+
+static uint64_t hash_ranges(const struct ByteRange *ranges, unsigned int count)
+{
+    uint64_t hash = HASH_INIT;
+    
+    for (unsigned int i = 0; i < count; i++)
+    {
+        uint32_t start = ranges[i].start;
+        uint32_t end = ranges[i].end;
+        
+        hash = hash_bytes(hash, &ranges[i], sizeof(ranges[i]));
+        if (start < bmsSize)
+            hash = hash_bytes(hash, bmsData + start, ((end < bmsSize) ? end : bmsSize) - start);
+    }
+    return hash;
+}
+
+static uint64_t instrument_list_hash(void)
+{
+    return hash_bytes(HASH_INIT, instrList, instrListCount * sizeof(*instrList));
+}
+
+static void get_track_state(struct TrackState *state)
+{
+    memset(state, 0, sizeof(*state));  // clear padding, since the whole struct gets compared
+    state->channel = midiTracks[currTrack].channel;
+    state->usedChannelMask = usedChannelMask;
+    state->ticksPerQNote = ticksPerQNote;
+    state->delay = delay;
+    memcpy(state->voices, voices, sizeof(voices));
+}
+
+static void track_cache_record_range(unsigned long int start, unsigned long int end)
+{
+    if (!trackCacheEnabled || end <= start)
+        return;
+    if (trackRangeCount == trackRangeCapacity)
+    {
+        unsigned int newCapacity = (trackRangeCapacity != 0) ? trackRangeCapacity * 2 : 16;
+        
+        trackRanges = budget_realloc(trackRanges, trackRangeCapacity * sizeof(*trackRanges), newCapacity * sizeof(*trackRanges));
+        trackRangeCapacity = newCapacity;
+    }
+    trackRanges[trackRangeCount].start = start;
+    trackRanges[trackRangeCount].end = end;
+    trackRangeCount++;
+}
+
+static int compare_ranges(const void *a, const void *b)
+{
+    const struct ByteRange *ra = a;
+    const struct ByteRange *rb = b;
+    
+    if (ra->start != rb->start)
+        return (ra->start < rb->start) ? -1 : 1;
+    return (ra->end < rb->end) ? -1 : (ra->end > rb->end);
+}
+
+// Sorts the recorded ranges and merges overlapping ones. Subroutines that get
+// called many times would otherwise show up once per call.
+static void merge_track_ranges(void)
+{
+    unsigned int count = 0;
+    
+    qsort(trackRanges, trackRangeCount, sizeof(*trackRanges), compare_ranges);
+    for (unsigned int i = 0; i < trackRangeCount; i++)
+    {
+        if (count > 0 && trackRanges[i].start <= trackRanges[count - 1].end)
+        {
+            if (trackRanges[i].end > trackRanges[count - 1].end)
+                trackRanges[count - 1].end = trackRanges[i].end;
+        }
+        else
+        {
+            trackRanges[count++] = trackRanges[i];
+        }
+    }
+    trackRangeCount = count;
+}
+
+static char *track_cache_filename(const char *bmsFilename)
+{
+    char *path = malloc(strlen(cacheDir) + 32);
+    
+    sprintf(path, "%s/%016llx.trk", cacheDir,
+      (unsigned long long)hash_bytes(HASH_INIT, bmsFilename, strlen(bmsFilename)));
+    return path;
+}
+
+// Entries that were never filled in are zeroed, so only their headers' sizes are freed
+static void free_cached_tracks(struct CachedTrack *tracks, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (tracks[i].ranges != NULL)
+            budget_free(tracks[i].ranges, tracks[i].header.numRanges * sizeof(*tracks[i].ranges));
+        if (tracks[i].data != NULL)
+            budget_free(tracks[i].data, tracks[i].header.length);
+    }
+    budget_free(tracks, count * sizeof(*tracks));
+}
+
+static void track_cache_load(const char *bmsFilename)
+{
+    char *path;
+    FILE *file;
+    uint32_t magic;
+    uint64_t instrHash;
+    uint32_t count;
+    long int fileSize;
+    
+    // Tracks copied from the cache don't produce any events, so only use it if MIDI is the only output.
+    // The cache also doesn't know about filters.
+    trackCacheEnabled = (cacheDir != NULL && numSinks == 1 && !filters_active());
+    if (!trackCacheEnabled)
+        return;
+    path = track_cache_filename(bmsFilename);
+    file = fopen(path, "rb");
+    free(path);
+    if (file == NULL)
+        return;
+    fseek(file, 0, SEEK_END);
+    fileSize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    
+    // The instrument list affects every track, so a different list invalidates the whole file.
+    // The sizes in the file are checked against what's left of it before anything is
+    // allocated, so that a damaged file is just a cache miss.
+    if (fileSize < 0 || fread(&magic, sizeof(magic), 1, file) != 1 || magic != TRACK_CACHE_MAGIC
+     || fread(&instrHash, sizeof(instrHash), 1, file) != 1 || instrHash != instrument_list_hash()
+     || fread(&count, sizeof(count), 1, file) != 1
+     || count > (unsigned long int)(fileSize - ftell(file)) / sizeof(struct CachedTrackHeader))
+    {
+        fclose(file);
+        return;
+    }
+    oldCache = budget_realloc(NULL, 0, count * sizeof(*oldCache));
+    memset(oldCache, 0, count * sizeof(*oldCache));
+    oldCacheSize = count;
+    for (oldCacheCount = 0; oldCacheCount < count; oldCacheCount++)
+    {
+        struct CachedTrack *track = &oldCache[oldCacheCount];
+        
+        unsigned long int remaining;
+        
+        if (fread(&track->header, sizeof(track->header), 1, file) != 1)
+        {
+            memset(&track->header, 0, sizeof(track->header));
+            break;
+        }
+        remaining = fileSize - ftell(file);
+        if (track->header.numRanges > remaining / sizeof(*track->ranges)
+         || track->header.length > remaining - track->header.numRanges * sizeof(*track->ranges))
+        {
+            DEBUG_printf("Ignoring damaged track cache\n");
+            memset(&track->header, 0, sizeof(track->header));
+            free_cached_tracks(oldCache, oldCacheSize);
+            oldCache = NULL;
+            oldCacheSize = 0;
+            break;
+        }
+        track->ranges = budget_realloc(NULL, 0, track->header.numRanges * sizeof(*track->ranges));
+        track->data = budget_realloc(NULL, 0, track->header.length);
+        if (fread(track->ranges, sizeof(*track->ranges), track->header.numRanges, file) != track->header.numRanges
+         || fread(track->data, 1, track->header.length, file) != track->header.length)
+            break;
+    }
+    fclose(file);
+    DEBUG_printf("Loaded %u tracks from cache\n", oldCacheCount);
+}
+
+static void write_track_cache(const char *bmsFilename)
+{
+    char *path;
+    char *tmpPath;
+    FILE *file;
+    uint32_t magic = TRACK_CACHE_MAGIC;
+    uint64_t instrHash = instrument_list_hash();
+    
+    path = track_cache_filename(bmsFilename);
+    tmpPath = malloc(strlen(path) + 16);
+    sprintf(tmpPath, "%s.%lu", path, (unsigned long int)getpid());
+    file = fopen(tmpPath, "wb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Warning: failed to write track cache '%s': %s\n", tmpPath, strerror(errno));
+        free(tmpPath);
+        free(path);
+        return;
+    }
+    fwrite(&magic, sizeof(magic), 1, file);
+    fwrite(&instrHash, sizeof(instrHash), 1, file);
+    fwrite(&newCacheCount, sizeof(newCacheCount), 1, file);
+    for (unsigned int i = 0; i < newCacheCount; i++)
+    {
+        fwrite(&newCache[i].header, sizeof(newCache[i].header), 1, file);
+        fwrite(newCache[i].ranges, sizeof(*newCache[i].ranges), newCache[i].header.numRanges, file);
+        fwrite(newCache[i].data, 1, newCache[i].header.length, file);
     }
+    // Write to a temporary file and rename it, so that a concurrent conversion
+    // never sees a half-written cache
+    if (fclose(file) != 0 || rename(tmpPath, path) != 0)
+        remove(tmpPath);
+    free(tmpPath);
+    free(path);
 }
 
-// 0x9A
-static void event_pan(FILE *file)
+static void track_cache_save(const char *bmsFilename)
+{
+    if (trackCacheEnabled)
+        write_track_cache(bmsFilename);
+    free_cached_tracks(oldCache, oldCacheSize);
+    free_cached_tracks(newCache, newCacheCount);
+    oldCache = newCache = NULL;
+    oldCacheCount = oldCacheSize = newCacheCount = 0;
+    budget_free(trackRanges, trackRangeCapacity * sizeof(*trackRanges));
+    trackRanges = NULL;
+    trackRangeCount = trackRangeCapacity = 0;
+}
+
+static void add_cached_track(const struct CachedTrackHeader *header, const struct ByteRange *ranges, const uint8_t *data)
+{
+    struct CachedTrack *track;
+    
+    newCache = budget_realloc(newCache, newCacheCount * sizeof(*newCache), (newCacheCount + 1) * sizeof(*newCache));
+    track = &newCache[newCacheCount++];
+    memset(track, 0, sizeof(*track));
+    track->header = *header;
+    track->ranges = budget_realloc(NULL, 0, header->numRanges * sizeof(*ranges));
+    if (header->numRanges != 0)
+        memcpy(track->ranges, ranges, header->numRanges * sizeof(*ranges));
+    track->data = budget_realloc(NULL, 0, header->length);
+    if (header->length != 0)
+        memcpy(track->data, data, header->length);
+}
+
+// Called when a track starts. If an identical track is in the cache, its MIDI data
+// is copied into the current track, the cursor is moved back to where the track
+// was started from, and true is returned.
+static bool track_cache_begin_track(uint32_t trackOffset)
+{
+    if (!trackCacheEnabled)
+        return false;
+    memset(&currTrackHeader, 0, sizeof(currTrackHeader));
+    currTrackHeader.trackOffset = trackOffset;
+    get_track_state(&currTrackHeader.startState);
+    trackRangeCount = 0;
+    readPastEnd = false;
+    
+    for (unsigned int i = 0; i < oldCacheCount; i++)
+    {
+        const struct CachedTrack *cached = &oldCache[i];
+        const struct CachedTrackHeader *header = &cached->header;
+        struct MidiTrack *track = &midiTracks[currTrack];
+        
+        if (header->trackOffset != trackOffset
+         || memcmp(&header->startState, &currTrackHeader.startState, sizeof(header->startState)) != 0
+         || (header->readPastEnd && header->fileSize != bmsSize)
+         || hash_ranges(cached->ranges, header->numRanges) != header->hash)
+            continue;
+        
+        DEBUG_printf("[TRACK_CACHED]\t%i\n", currTrack);
+        track_reserve(currTrack, header->length);
+        memcpy(track->buffer + track->length, cached->data, header->length);
+        track->length += header->length;
+        track->channel = header->endState.channel;
+        usedChannelMask = header->endState.usedChannelMask;
+        ticksPerQNote = header->endState.ticksPerQNote;
+        memcpy(voices, header->endState.voices, sizeof(voices));
+        add_cached_track(header, cached->ranges, cached->data);
+        
+        // Same as what happens at the end of a decoded track
+        bmsPos = savedPos;
+        delay = 0;
+        inTrack = false;
+        return true;
+    }
+    return false;
+}
+
+// Called after a decoded track has ended (the cursor is already back in the parent track)
+static void track_cache_end_track(void)
+{
+    if (!trackCacheEnabled)
+        return;
+    merge_track_ranges();
+    get_track_state(&currTrackHeader.endState);
+    currTrackHeader.hash = hash_ranges(trackRanges, trackRangeCount);
+    currTrackHeader.readPastEnd = readPastEnd;
+    currTrackHeader.fileSize = bmsSize;
+    currTrackHeader.numRanges = trackRangeCount;
+    currTrackHeader.length = midiTracks[currTrack].length;
+    add_cached_track(&currTrackHeader, trackRanges, midiTracks[currTrack].buffer);
+}
+
+//------------------------------------------------------------------------------
+// Event Cache
+//------------------------------------------------------------------------------
+
+// Keeps the decoded events of a sequence in the --event-cache directory, under a
+// hash of the BMS file and everything else that affects its events (the
+// instrument list, the filters and whether the tracks are interleaved). The first
+// conversion records the events as they reach the sinks and writes them out along
+// with the tempo map and each track's channel. Later conversions of the same file,
+// to any outputs, map the cache file and feed its events straight to the sinks
+// without decoding anything.
+//
+// The file is laid out so that it can be used in place: a header, then arrays of
+// EventCacheTrack, EventCacheTempo and struct Event, each at the offset the header
+// gives. The events are stored exactly as the sinks got them, including their BMS
+// offsets and deltas. Since the structs are stored as they are in memory, a cache
+// is only read by the build that wrote it (eventSize and the magic number, which
+// is stored in the native byte order, catch most mismatches).
+
+#ifdef __linux__
+
+#define EVENT_CACHE_MAGIC 0x33435645  // "EVC3"
+
+struct EventCacheHeader
+{
+    uint32_t magic;
+    uint32_t eventSize;  // sizeof(struct Event)
+    uint64_t key;  // Same as the hash in the file name
+    uint32_t bmsSize;
+    int32_t ticksPerQNote;
+    uint32_t usedChannelMask;
+    uint32_t numTracks;
+    uint32_t numTempos;
+    uint32_t numEvents;
+    uint32_t tracksOffset;
+    uint32_t temposOffset;
+    uint32_t eventsOffset;
+    uint32_t ticksPerQNoteEvent;  // Index of the first event after ticksPerQNote was set, or UINT32_MAX
+};
+
+struct EventCacheTrack
+{
+    int32_t channel;  // Channel at the end of the track (the drum kit moves a track to channel 9)
+    uint32_t endTick;
+    uint32_t numEvents;
+};
+
+// Tempo changes of all tracks, sorted by tick
+struct EventCacheTempo
+{
+    uint32_t tick;
+    uint32_t usecPerQNote;
+    uint32_t event;  // Index of the tempo event
+};
+
+static const char *eventCacheDir = NULL;
+static struct Event *cacheEvents = NULL;  // Events recorded for the cache file
+static unsigned int numCacheEvents = 0;
+static unsigned int cacheEventCapacity = 0;
+static uint32_t cacheTicksPerQNoteEvent = UINT32_MAX;
+
+static uint64_t event_cache_key(void)
+{
+    uint64_t hash = hash_bytes(HASH_INIT, bmsData, bmsSize);
+    uint64_t instrHash = instrument_list_hash();
+    uint32_t settings[6] = {trackFilter, channelFilter, eventClassFilter, minPitchFilter, maxPitchFilter, writeFormat0};
+    
+    hash = hash_bytes(hash, &instrHash, sizeof(instrHash));
+    return hash_bytes(hash, settings, sizeof(settings));
+}
+
+static char *event_cache_filename(uint64_t key)
+{
+    char *path = malloc(strlen(eventCacheDir) + 32);
+    
+    sprintf(path, "%s/%016llx.evc", eventCacheDir, (unsigned long long)key);
+    return path;
+}
+
+static void event_cache_handle_event(struct EventSink *sink, const struct Event *event)
+{
+    (void)sink;
+    // The decoder sets ticksPerQNote after emitting its event, and even if the event is filtered out
+    if (ticksPerQNote != 0 && cacheTicksPerQNoteEvent == UINT32_MAX)
+        cacheTicksPerQNoteEvent = numCacheEvents;
+    if (numCacheEvents == cacheEventCapacity)
+    {
+        unsigned int capacity = (cacheEventCapacity != 0) ? cacheEventCapacity * 2 : 1024;
+        
+        cacheEvents = budget_realloc(cacheEvents, cacheEventCapacity * sizeof(*cacheEvents), capacity * sizeof(*cacheEvents));
+        cacheEventCapacity = capacity;
+    }
+    memcpy(&cacheEvents[numCacheEvents++], event, sizeof(*event));
+}
+
+static struct EventSink eventCacheSink = {event_cache_handle_event, NULL, NULL, 0};
+
+// Checks that an array of count elements of the given size at offset lies within the file
+static bool event_cache_array_valid(uint32_t offset, uint32_t count, size_t size, size_t fileSize)
+{
+    return offset % 4 == 0 && offset <= fileSize && count <= (fileSize - offset) / size;
+}
+
+// Feeds the events of the cache file for key to the sinks, and sets up the tracks
+// as decoding would have. Returns false if there is no usable cache file.
+static bool event_cache_replay(uint64_t key)
+{
+    char *path = event_cache_filename(key);
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    const uint8_t *data;
+    const struct EventCacheHeader *header;
+    const struct EventCacheTrack *tracks;
+    const struct Event *events;
+    bool valid;
+    
+    free(path);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(*header))
+    {
+        close(fd);
+        return false;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+    
+    header = (const struct EventCacheHeader *)data;
+    valid = header->magic == EVENT_CACHE_MAGIC && header->eventSize == sizeof(struct Event)
+      && header->key == key && header->bmsSize == bmsSize
+      && event_cache_array_valid(header->tracksOffset, header->numTracks, sizeof(*tracks), st.st_size)
+      && event_cache_array_valid(header->temposOffset, header->numTempos, sizeof(struct EventCacheTempo), st.st_size)
+      && event_cache_array_valid(header->eventsOffset, header->numEvents, sizeof(*events), st.st_size);
+    if (!valid)
+    {
+        munmap((void *)data, st.st_size);
+        return false;
+    }
+    tracks = (const struct EventCacheTrack *)(data + header->tracksOffset);
+    events = (const struct Event *)(data + header->eventsOffset);
+    
+    for (uint32_t i = 0; i < header->numTracks; i++)
+    {
+        int track = add_track();
+        
+        midiTracks[track].channel = tracks[i].channel;
+        midiTracks[track].tick = tracks[i].endTick;
+    }
+    usedChannelMask = header->usedChannelMask;
+    for (uint32_t i = 0; i < header->numEvents; i++)
+    {
+        const struct Event *event = &events[i];
+        
+        if (event->track < 0 || (unsigned int)event->track >= numMidiTracks)
+            fatal_error("event cache for '%016llx' is corrupt\n", (unsigned long long)key);
+        if (i == header->ticksPerQNoteEvent)
+            ticksPerQNote = header->ticksPerQNote;
+        for (int j = 0; j < numSinks; j++)
+        {
+            sinks[j]->handle_event(sinks[j], event);
+            sinks[j]->count++;
+        }
+    }
+    ticksPerQNote = header->ticksPerQNote;
+    DEBUG_printf("Replayed %u events from the event cache\n", header->numEvents);
+    munmap((void *)data, st.st_size);
+    return true;
+}
+
+static int compare_cache_tempos(const void *a, const void *b)
+{
+    const struct EventCacheTempo *t1 = a;
+    const struct EventCacheTempo *t2 = b;
+    
+    if (t1->tick != t2->tick)
+        return (t1->tick < t2->tick) ? -1 : 1;
+    return (t1->event < t2->event) ? -1 : (t1->event > t2->event);
+}
+
+// Writes the recorded events to the cache file for key, once the sequence has been decoded
+static void write_event_cache(uint64_t key)
+{
+    struct EventCacheHeader header = {0};
+    struct EventCacheTrack *tracks = calloc(numMidiTracks + 1, sizeof(*tracks));
+    struct EventCacheTempo *tempos = NULL;
+    char *path;
+    char *tmpPath;
+    FILE *file;
+    
+    for (unsigned int i = 0; i < numMidiTracks; i++)
+    {
+        tracks[i].channel = midiTracks[i].channel;
+        tracks[i].endTick = midiTracks[i].tick;
+    }
+    for (unsigned int i = 0; i < numCacheEvents; i++)
+    {
+        tracks[cacheEvents[i].track].numEvents++;
+        if (cacheEvents[i].type == EVENT_TEMPO)
+        {
+            tempos = realloc(tempos, (header.numTempos + 1) * sizeof(*tempos));
+            tempos[header.numTempos].tick = cacheEvents[i].tick;
+            tempos[header.numTempos].usecPerQNote = cacheEvents[i].operands[1];
+            tempos[header.numTempos].event = i;
+            header.numTempos++;
+        }
+    }
+    if (header.numTempos != 0)
+        qsort(tempos, header.numTempos, sizeof(*tempos), compare_cache_tempos);
+    
+    header.magic = EVENT_CACHE_MAGIC;
+    header.eventSize = sizeof(struct Event);
+    header.key = key;
+    header.bmsSize = bmsSize;
+    header.ticksPerQNote = ticksPerQNote;
+    header.usedChannelMask = usedChannelMask;
+    header.numTracks = numMidiTracks;
+    header.numEvents = numCacheEvents;
+    header.tracksOffset = sizeof(header);
+    header.temposOffset = header.tracksOffset + numMidiTracks * sizeof(*tracks);
+    header.eventsOffset = header.temposOffset + header.numTempos * sizeof(*tempos);
+    header.ticksPerQNoteEvent = (ticksPerQNote != 0 && cacheTicksPerQNoteEvent == UINT32_MAX) ? numCacheEvents : cacheTicksPerQNoteEvent;
+    
+    path = event_cache_filename(key);
+    tmpPath = malloc(strlen(path) + 16);
+    sprintf(tmpPath, "%s.%lu", path, (unsigned long int)getpid());
+    file = fopen(tmpPath, "wb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Warning: failed to write event cache '%s': %s\n", tmpPath, strerror(errno));
+    }
+    else
+    {
+        fwrite(&header, sizeof(header), 1, file);
+        fwrite(tracks, sizeof(*tracks), numMidiTracks, file);
+        fwrite(tempos, sizeof(*tempos), header.numTempos, file);
+        fwrite(cacheEvents, sizeof(*cacheEvents), numCacheEvents, file);
+        // Renamed into place like the track cache, so a concurrent conversion never sees half of it
+        if (fclose(file) != 0 || rename(tmpPath, path) != 0)
+            remove(tmpPath);
+    }
+    free(tmpPath);
+    free(path);
+    free(tempos);
+    free(tracks);
+    budget_free(cacheEvents, cacheEventCapacity * sizeof(*cacheEvents));
+    cacheEvents = NULL;
+    numCacheEvents = cacheEventCapacity = 0;
+    cacheTicksPerQNoteEvent = UINT32_MAX;
+}
+
+#endif
+
+//------------------------------------------------------------------------------
+// Interleaved Decoding
+//------------------------------------------------------------------------------
+
+// Normally, a track is decoded to its end as soon as its 0xC1 event is reached, so
+// the events come out one track at a time. When interleaveTracks is set, each track
+// gets a decoder of its own instead (its cursor, call stack, voices and pending
+// delay), which runs like a coroutine. The decoder that is furthest behind always
+// runs next, so events come out in time order across all of the tracks, and only
+// as far as they are asked for. A track started this way begins at the time it
+// was started rather than at time 0.
+
+struct TrackDecoder
+{
+    int track;  // MIDI track the decoder writes to
+    unsigned long int pos;
+    unsigned long int callStack[STACK_LIMIT];
+    int callStackTop;
+    int voices[8];
+    unsigned long int delay;
+    bool inTrack;
+};
+
+static THREAD_LOCAL bool interleaveTracks = false;
+static THREAD_LOCAL struct TrackDecoder *trackDecoders = NULL;
+static THREAD_LOCAL int *decoderHeap = NULL;  // Decoders whose tracks haven't ended, as a min-heap on their next tick
+static THREAD_LOCAL int numTrackDecoders = 0;
+static THREAD_LOCAL int decoderHeapSize = 0;
+static THREAD_LOCAL int trackDecodersCapacity = 0;
+static THREAD_LOCAL bool trackEnded = false;  // Set when the running decoder reaches the end of its track
+
+static bool decode_step(void);
+
+static uint32_t decoder_next_tick(int index)
+{
+    return midiTracks[trackDecoders[index].track].tick + trackDecoders[index].delay;
+}
+
+// Of the decoders at the same tick, the one started last runs first. A track that
+// was just started then runs before the track that started it goes on, like it does
+// without interleaving, so the tracks are given the same channels either way.
+static bool decoder_before(int a, int b)
+{
+    uint32_t tickA = decoder_next_tick(a);
+    uint32_t tickB = decoder_next_tick(b);
+    
+    return (tickA != tickB) ? tickA < tickB : a > b;
+}
+
+static void decoder_heap_swap(int i, int j)
+{
+    int temp = decoderHeap[i];
+    
+    decoderHeap[i] = decoderHeap[j];
+    decoderHeap[j] = temp;
+}
+
+static void decoder_heap_sift_up(int i)
+{
+    while (i > 0 && decoder_before(decoderHeap[i], decoderHeap[(i - 1) / 2]))
+    {
+        decoder_heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void decoder_heap_sift_down(int i)
+{
+    for (;;)
+    {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = 2 * i + 2;
+        
+        if (left < decoderHeapSize && decoder_before(decoderHeap[left], decoderHeap[smallest]))
+            smallest = left;
+        if (right < decoderHeapSize && decoder_before(decoderHeap[right], decoderHeap[smallest]))
+            smallest = right;
+        if (smallest == i)
+            break;
+        decoder_heap_swap(i, smallest);
+        i = smallest;
+    }
+}
+
+// Adds a decoder for a track that starts at offset. Its MIDI track's tick must
+// already be set to the time the track starts.
+static void start_track_decoder(int track, unsigned long int offset)
+{
+    struct TrackDecoder *decoder;
+    
+    if (numTrackDecoders == trackDecodersCapacity)
+    {
+        int capacity = (trackDecodersCapacity == 0) ? 16 : trackDecodersCapacity * 2;
+        
+        // Checked for both at once, so that the two arrays are always the same size
+        budget_check((capacity - trackDecodersCapacity) * (sizeof(*trackDecoders) + sizeof(*decoderHeap)));
+        trackDecoders = budget_realloc(trackDecoders, trackDecodersCapacity * sizeof(*trackDecoders), capacity * sizeof(*trackDecoders));
+        decoderHeap = budget_realloc(decoderHeap, trackDecodersCapacity * sizeof(*decoderHeap), capacity * sizeof(*decoderHeap));
+        trackDecodersCapacity = capacity;
+    }
+    decoder = &trackDecoders[numTrackDecoders];
+    memset(decoder, 0, sizeof(*decoder));
+    decoder->track = track;
+    decoder->pos = offset;
+    decoder->inTrack = (track != metaTrack);
+    decoderHeap[decoderHeapSize] = numTrackDecoders;
+    numTrackDecoders++;
+    decoderHeapSize++;
+    decoder_heap_sift_up(decoderHeapSize - 1);
+}
+
+static void begin_interleaved_decode(void)
+{
+    metaTrack = add_track();
+    currTrack = metaTrack;
+    start_track_decoder(metaTrack, 0);
+}
+
+// Runs the decoder that is furthest behind for one opcode. Returns false once
+// every track has ended.
+static bool interleave_step(void)
+{
+    int index;
+    struct TrackDecoder *decoder;
+    
+    if (decoderHeapSize == 0)
+        return false;
+    index = decoderHeap[0];
+    decoder = &trackDecoders[index];
+    currTrack = decoder->track;
+    inTrack = decoder->inTrack;
+    seek_to(decoder->pos);
+    memcpy(callStack, decoder->callStack, sizeof(callStack));
+    callStackTop = decoder->callStackTop;
+    memcpy(voices, decoder->voices, sizeof(voices));
+    delay = decoder->delay;
+    trackEnded = false;
+    
+    decode_step();
+    
+    decoder = &trackDecoders[index];  // Starting a track may have moved the decoders
+    decoder->pos = bmsPos;
+    memcpy(decoder->callStack, callStack, sizeof(callStack));
+    decoder->callStackTop = callStackTop;
+    memcpy(decoder->voices, voices, sizeof(voices));
+    decoder->delay = delay;
+    if (trackEnded)
+        decoderHeap[0] = decoderHeap[--decoderHeapSize];
+    decoder_heap_sift_down(0);
+    return true;
+}
+
+static void free_track_decoders(void)
+{
+    budget_free(trackDecoders, trackDecodersCapacity * sizeof(*trackDecoders));
+    budget_free(decoderHeap, trackDecodersCapacity * sizeof(*decoderHeap));
+    trackDecoders = NULL;
+    decoderHeap = NULL;
+    numTrackDecoders = 0;
+    decoderHeapSize = 0;
+    trackDecodersCapacity = 0;
+}
+
+//------------------------------------------------------------------------------
+// BMS Event Handlers
+//------------------------------------------------------------------------------
+
+// 0x00 - 0x7F
+static void event_note_on(uint8_t pitch)
+{
+    uint8_t voice = read_u8();
+    uint8_t volume = read_u8();
+    
+    // simple hack to make the percussion sound reasonably close,
+    // though the note numbers do not match up at all with General MIDI drum kits.
+    // Pitch 0 is kept at 0, since wrapping around to 255 isn't a valid MIDI note.
+    if (midiTracks[currTrack].channel == 9 && pitch > 0)
+        pitch -= 1;
+    
+    DEBUG_printf("[NOTE_ON]\tpitch %i, voice %i, volume %i\n", pitch, voice, volume);
+    if (voice >= 8)
+        fatal_error("Invalid voice %i at address 0x%X\n", voice, (unsigned int)currOpcodeOffset);
+    emit_event(EVENT_NOTE_ON, currTrack, 3, pitch, volume, voice);
+    voices[voice] = pitch;
+}
+
+// 0x81 - 0x87
+static void event_note_off(uint8_t voice)
+{
+    DEBUG_printf("[NOTE_OFF]\tvoice %i\n", voice);
+    if (voices[voice] == -1)
+        fatal_error("Voice %i is already off at address 0x%X\n", voice, (unsigned int)currOpcodeOffset);
+    emit_event(EVENT_NOTE_OFF, currTrack, 3, voices[voice], 0, voice);
+    voices[voice] = -1;
+}
+
+// 0x80
+static void event_delay_u8(void)
+{
+    uint8_t ticks = read_u8();
+    
+    emit_event(EVENT_DELAY, currTrack, 1, ticks);
+    delay += ticks;
+    
+    DEBUG_printf("[DELAY8]\t%lu\n", delay);
+}
+
+// 0x88
+static void event_delay_u16(void)
+{
+    uint16_t ticks = read_u16();
+    
+    emit_event(EVENT_DELAY, currTrack, 1, ticks);
+    delay += ticks;
+    
+    DEBUG_printf("[DELAY16]\t%lu\n", delay);
+}
+
+static int get_available_channel(void)
+{
+    // Search for a channel that hasn't been taken.
+    // Avoid using channel 9 because it is percussion only
+    for (int i = 0; i < MAX_CHANNELS; i++)
+    {
+        if ((usedChannelMask & (1 << i)) == 0 && i != 9)
+        {
+            usedChannelMask |= 1 << i;
+            return i;
+        }
+    }
+    // If we have no choice, use channel 9 if it's available
+    if ((usedChannelMask & (1 << 9)) == 0)
+    {
+        usedChannelMask |= 1 << 9;
+        return 9;
+    }
+    fatal_error("Cannot use more than 16 MIDI channels\n");
+    return -1;
+}
+
+// 0xC1
+static void event_track_start(void)
+{
+    long int trackOffset;
+    
+    read_u8();
+    trackOffset = read_u24();
+    bmsTrackCount++;
+    if (bmsTrackCount >= 32 || (trackFilter & (1u << bmsTrackCount)) == 0)
+    {
+        // Skip the track without decoding it. It still takes up a channel, so that the
+        // tracks after it usually get the channels they would without the filter. That
+        // doesn't hold if the skipped track sets the drum kit: decoded, it would move
+        // to channel 9 and give its channel to the next track, but skipped, it keeps it.
+        get_available_channel();
+        DEBUG_printf("[TRACK_SKIPPED]\t%i\n", bmsTrackCount);
+        return;
+    }
+    if (interleaveTracks)
+    {
+        int track = add_track();
+        unsigned long int parentDelay = delay;
+        
+        midiTracks[track].channel = get_available_channel();
+        midiTracks[track].tick = midiTracks[currTrack].tick + delay;
+        start_track_decoder(track, trackOffset);
+        delay = 0;
+        emit_event(EVENT_TRACK_START, track, 1, trackOffset);
+        delay = parentDelay;
+        DEBUG_printf("[TRACK_START]\t%i\n", track);
+        return;
+    }
+    // A track starting another track can't be cached, since its output would depend on the other one.
+    if (inTrack)
+        trackCacheEnabled = false;
+    savedPos = bmsPos;
+    seek_to(trackOffset);
+    currTrack = add_track();
+    midiTracks[currTrack].channel = get_available_channel();
+    inTrack = true;
+    trace_push("track", "track %i (0x%lX)", currTrack, trackOffset);
+    if (track_cache_begin_track(trackOffset))
+    {
+        trace_pop("track");
+        return;
+    }
+    emit_event(EVENT_TRACK_START, currTrack, 1, trackOffset);
+    DEBUG_printf("[TRACK_START]\t%i\n", currTrack);
+}
+
+static uint8_t convert_instrument(uint8_t instr)
+{
+    if (instr < instrListCount)
+        return instrList[instr];  // If alternative instrument is specified in list, return that
+    else
+        return instr;  // Otherwise, don't change it
+}
+
+// Sub-events we don't understand
+static void event_unknown_operands(uint8_t event2, int length)
+{
+    uint8_t val1 = read_u8();
+    uint8_t val2 = (length > 1) ? read_u8() : 0;
+    
+    emit_event(EVENT_UNKNOWN, currTrack, length + 1, event2, val1, val2);
+}
+
+// 0xA4
+static void event_instrument(void)
+{
+    uint8_t event2 = read_u8();
+    
+    DEBUG_printf("[INSTRUMENT]\t");
+    switch (event2)
+    {
+        case 0x20:  // Bank
+        {
+            uint8_t bank = read_u8();
+            
+            DEBUG_printf("(set bank) %i\n", bank);
+            emit_event(EVENT_BANK, currTrack, 1, bank);
+            break;
+        }
+        case 0x21:  // Instrument
+        {
+            uint8_t oldInstr = read_u8();
+            uint8_t instr = convert_instrument(oldInstr);
+            
+            if (instr == 128)  // Drum Kit - move this track to channel 9
+            {
+                if (midiTracks[currTrack].channel == -1)
+                    fatal_error("Drum kit set outside of a track at address 0x%X\n", (unsigned int)currOpcodeOffset);
+                // Make sure channel 9 is not already in use
+                if ((usedChannelMask & (1 << 9)) != 0 && midiTracks[currTrack].channel != 9)
+                    fatal_error("More than one track uses the drum kit\n");
+                usedChannelMask &= ~(1 << midiTracks[currTrack].channel);
+                usedChannelMask |= (1 << 9);
+                midiTracks[currTrack].channel = 9;
+                instr = 0;
+            }
+            emit_event(EVENT_PROGRAM, currTrack, 2, instr, oldInstr);
+            DEBUG_printf("(set instrument) %i, %i\n", oldInstr, instr);
+            break;
+        }
+        default:
+            // TODO: Figure out what event2 = 7 is supposed to mean
+            DEBUG_printf("(%u)\n", event2);
+            event_unknown_operands(event2, 1);
+    }
+}
+
+// 0xFD
+static void event_tempo(void)
+{
+    uint16_t tempo = read_u16();
+    
+    DEBUG_printf("[TEMPO]\t%u bpm\n", tempo);
+    if (inTrack)
+    {
+#ifndef BMS2MID_FUZZ  // Printing it for every input that does it would slow the fuzzer down
+        fputs("Warning: setting tempo within a track is not supported\n", stderr);
+#endif
+    }
+    else if (tempo == 0)
+        fatal_error("Invalid tempo 0 at address 0x%X\n", (unsigned int)currOpcodeOffset);
+    else
+    {
+        unsigned int usec = 60 * 1000000 / tempo;  // microseconds per quarter note
+        
+        emit_event(EVENT_TEMPO, metaTrack, 2, tempo, usec);
+    }
+}
+
+// 0xC4
+static void event_subroutine_call(void)
+{
+    unsigned long int dest = read_u32();
+    
+    if (callStackTop >= STACK_LIMIT)
+        fatal_error("Call stack limit reached\n");
+    emit_event(EVENT_CALL, currTrack, 1, dest);
+    callStack[callStackTop] = bmsPos;  // Push return address onto stack
+    callStackTop++;
+    trace_push("call", "call 0x%lX", dest);
+    seek_to(dest);
+    DEBUG_printf("[CALL]\tCall to subroutine 0x%X\n", (unsigned int)dest);
+}
+
+// 0xC6
+static void event_subroutine_return(void)
+{
+    unsigned long int dest;
+    
+    if (callStackTop == 0)
+        fatal_error("Attempted to return outside of subroutine\n");
+    callStackTop--;
+    dest = callStack[callStackTop];  // Pop return address from stack
+    emit_event(EVENT_RETURN, currTrack, 1, dest);
+    trace_pop("call");
+    seek_to(dest);
+    DEBUG_printf("[RETURN]\tReturning to 0x%X\n", (unsigned int)dest);
+}
+
+// 0xFE
+static void event_ticks_per_qnote(void)
+{
+    uint16_t val = read_u16();
+    
+    DEBUG_printf("[TICKS]\t");
+    emit_event(EVENT_TICKS_PER_QNOTE, currTrack, 1, val);
+    if (ticksPerQNote != 0)
+        DEBUG_printf("Warining: Ticks per quarter note already set. Ignoring.\n");
+    else
+    {
+        DEBUG_printf("Setting ticks per quarter note to %u\n", val);
+        ticksPerQNote = val;
+    }
+}
+
+// 0x9C
+static void event_volume(void)
+{
+    uint8_t event2 = read_u8();
+    
+    DEBUG_printf("[VOLUME]\t");
+    switch (event2)
+    {
+    case 0:  // Volume change
+    {
+        uint8_t volume = read_u8();
+        uint8_t duration = read_u8();  // Not really sure what this is for.
+        
+        if (volume > 127)
+            fatal_error("Invalid volume %u at address 0x%X\n", volume, (unsigned int)currOpcodeOffset);
+        DEBUG_printf("(set volume) vol = %u, duration = %u\n", volume, duration);
+        emit_event(EVENT_VOLUME, currTrack, 2, volume, duration);
+        break;
+    }
+    case 0x09:  // Vibrato intensity?
+        DEBUG_printf("(vibrato?)\n");
+        event_unknown_operands(event2, 2);
+        break;
+    default:
+        DEBUG_printf("(unknown)\n");
+        event_unknown_operands(event2, 2);
+    }
+}
+
+// 0x9A
+static void event_pan(void)
+{
+    uint8_t event2 = read_u8();
+    
+    DEBUG_printf("[PAN]\t");
+    switch (event2)
+    {
+        case 0x03:  // Change panning
+        {
+            uint8_t pan = read_u8();
+            uint8_t duration = read_u8();
+            
+            if (pan > 127)
+                fatal_error("Invalid pan %u at address 0x%X\n", pan, (unsigned int)currOpcodeOffset);
+            DEBUG_printf("(set pan) pan = %u, duration = %u\n", pan, duration);
+            emit_event(EVENT_PAN, currTrack, 2, pan, duration);
+            break;
+        }
+        default:
+            DEBUG_printf("(unknown)\n");
+            event_unknown_operands(event2, 2);
+    }
+}
+
+// We don't know what this event does. Just print out its data
+static void event_unknown(uint8_t event, int length)
+{
+    unsigned long int addr = bmsPos - 1;
+    uint8_t vals[7];
+    
+    assert(length <= (int)ARRAY_LENGTH(vals));
+    DEBUG_printf("[UNKNOWN 0x%X]\t", event);
+    for (int i = 0; i < length; i++)
+    {
+        vals[i] = read_u8();
+        DEBUG_printf("0x%X ", vals[i]);
+    }
+    DEBUG_printf(" at address 0x%X\n", (unsigned int)addr);
+    emit_event(EVENT_UNKNOWN, currTrack, length, vals[0], vals[1], vals[2], vals[3], vals[4], vals[5], vals[6]);
+}
+
+// Resets all of the decoder's state, so that another sequence can be decoded
+static void reset_decoder(void)
+{
+    for (unsigned int i = 0; i < numMidiTracks; i++)
+        budget_free(midiTracks[i].buffer, midiTracks[i].bufferSize);
+    budget_free(midiTracks, numMidiTracks * sizeof(*midiTracks));
+    midiTracks = NULL;
+    numMidiTracks = 0;
+    memset(voices, 0, sizeof(voices));
+    delay = 0;
+    currTrack = 0;
+    inTrack = false;
+    savedPos = 0;
+    callStackTop = 0;
+    usedChannelMask = 0;
+    ticksPerQNote = 0;
+    bmsTrackCount = 0;
+    bmsPos = 0;
+    rangeStart = 0;
+    readPastEnd = false;
+    recorderCount = 0;
+    free_track_decoders();
+    trace_pop_all();  // Spans left open by a sequence that failed
+}
+
+static void begin_decode(void)
+{
+    metaTrack = add_track();
+}
+
+// Decodes one opcode. Returns false once the end of the sequence has been reached.
+static bool decode_step(void)
+{
+    uint8_t event;
+    
+    currOpcodeOffset = bmsPos;
+    event = currOpcode = read_u8();
+    switch (event)
+    {
+    case 0x80:
+        event_delay_u8();
+        break;
+    case 0x88:
+        event_delay_u16();
+        break;
+    case 0xC1:
+        event_track_start();
+        break;
+    case 0x9A:
+        event_pan();
+        break;
+    case 0x9C:
+        event_volume();
+        break;
+    case 0xA4:
+        event_instrument();
+        break;
+    case 0x9E:  // Pitch bend, probably
+        event_unknown(event, 2);
+        break;
+    
+    // These events appear in mboss.bms and enemy2.bms. I have no idea what they do.
+    case 0xCC:
+        event_unknown(event, 2);
+        break;
+    case 0xAC:  // seems to always be followed by a 0xCC event.
+    {
+        uint8_t val1 = read_u8();
+        uint8_t val2 = read_u8();
+        uint8_t val3 = read_u8();
+        
+        DEBUG_printf("[UNKNOWN 0xAC] 0x%X, 0x%X, 0x%X\n", val1, val2, val3);
+        emit_event(EVENT_UNKNOWN, currTrack, 3, val1, val2, val3);
+        if (val3 == 0)
+            goto track_end;
+        break;
+    }
+    case 0xAD:
+        event_unknown(event, 3);
+        break;
+    case 0xD6:
+        event_unknown(event, 1);
+        break;
+    
+    case 0xF4:
+        event_unknown(event, 1);
+        break;
+    case 0x98:  // seems to appear near the beginning of a track
+    case 0xE6:  // seems to appear near the beginning of a track
+    case 0xE7:
+        event_unknown(event, 2);
+        break;
+    case 0xCB:  // Not really sure how long this is, but 7 bytes seems to do the trick.
+        event_unknown(event, 7);
+        break;
+    case 0xC4:
+        event_subroutine_call();
+        break;
+    case 0xC6:
+        event_subroutine_return();
+        break;
+    case 0xC8:  // Goto event for looping. We ignore this because MIDIs can't loop
+    {
+        uint8_t val1 = read_u8();
+        uint8_t val2 = read_u8();
+        uint8_t val3 = read_u8();
+        uint8_t val4 = read_u8();
+        
+        DEBUG_printf("[GOTO] %u, %u, %u, %u\n", val1, val2, val3, val4);
+        emit_event(EVENT_GOTO, currTrack, 4, val1, val2, val3, val4);
+        break;
+    }
+    case 0xFD:
+        event_tempo();
+        break;
+    case 0xFE:
+        event_ticks_per_qnote();
+        break;
+    case 0xFF:  // End of track
+        DEBUG_printf("[TRACK_END]\t%i\n", currTrack);
+      track_end:
+        if (!inTrack && !interleaveTracks)
+        {
+            // End of meta track
+            emit_event(EVENT_TRACK_END, metaTrack, 0);
+            trace_pop_all();
+            return false;
+        }
+        emit_event(EVENT_TRACK_END, currTrack, 0);
+        if (interleaveTracks)
+        {
+            trackEnded = true;
+            break;
+        }
+        trace_pop("track");
+        seek_to(savedPos);
+        track_cache_end_track();
+        delay = 0;
+        inTrack = false;
+        break;
+    default:
+        if (event < 0x80)  // Note on
+            event_note_on(event);
+        else if (event >= 0x81 && event <= 0x87)  // Note off
+            event_note_off(event & 7);
+        else
+        {
+            fatal_error("Unhandled BMS event 0x%X at address 0x%X\n",
+              event, (unsigned int)(bmsPos - 1));
+        }
+    }
+    return true;
+}
+
+static void read_bms(void)
+{
+    begin_decode();
+    while (decode_step())
+        ;
+}
+
+//------------------------------------------------------------------------------
+// Event Iterator
+//------------------------------------------------------------------------------
+
+// Decodes a sequence one event at a time, for callers that want to pull events
+// instead of having them pushed to a sink. Decoding only runs as far as the
+// last event requested, so stopping early skips the rest of the sequence.
+
+#define ITER_QUEUE_SIZE 4  // A single opcode produces at most two events
+
+static THREAD_LOCAL struct Event iterQueue[ITER_QUEUE_SIZE];
+static THREAD_LOCAL int iterQueueHead = 0;
+static THREAD_LOCAL int iterQueueCount = 0;
+static THREAD_LOCAL bool iterDone = false;
+
+static void iter_handle_event(struct EventSink *sink, const struct Event *event)
+{
+    (void)sink;
+    assert(iterQueueCount < ITER_QUEUE_SIZE);
+    iterQueue[(iterQueueHead + iterQueueCount) % ITER_QUEUE_SIZE] = *event;
+    iterQueueCount++;
+}
+
+static THREAD_LOCAL struct EventSink iterSink = {iter_handle_event, NULL, NULL, 0};
+
+static bool iter_open(const uint8_t *data, unsigned long int size, bool merged)
+{
+    jmp_buf handler;
+    
+    reset_decoder();
+    budget_start_job();
+    interleaveTracks = merged;
+    bmsData = data;
+    bmsSize = size;
+    trackCacheEnabled = false;
+    iterQueueHead = 0;
+    iterQueueCount = 0;
+    iterDone = false;
+    errorMessage[0] = '\0';
+    numSinks = 0;
+    add_sink(&iterSink);
+    // Starting the decoder allocates the first tracks, which can go over the memory limit
+    if (setjmp(handler) != 0)
+    {
+        errorHandler = NULL;
+        iterDone = true;
+        return false;
+    }
+    errorHandler = &handler;
+    if (merged)
+        begin_interleaved_decode();
+    else
+        begin_decode();
+    errorHandler = NULL;
+    return true;
+}
+
+bool bms_iter_open(const uint8_t *data, unsigned long int size)
+{
+    return iter_open(data, size, false);
+}
+
+bool bms_iter_open_merged(const uint8_t *data, unsigned long int size)
+{
+    return iter_open(data, size, true);
+}
+
+bool bms_iter_next(struct Event *event)
+{
+    jmp_buf handler;
+    
+    if (iterQueueCount == 0 && !iterDone)
+    {
+        if (setjmp(handler) != 0)
+        {
+            // Stop at the error. The events decoded before it are dropped.
+            errorHandler = NULL;
+            iterDone = true;
+            iterQueueCount = 0;
+            return false;
+        }
+        errorHandler = &handler;
+        while (iterQueueCount == 0 && !iterDone)
+            iterDone = interleaveTracks ? !interleave_step() : !decode_step();
+        errorHandler = NULL;
+    }
+    if (iterQueueCount == 0)
+        return false;
+    *event = iterQueue[iterQueueHead];
+    iterQueueHead = (iterQueueHead + 1) % ITER_QUEUE_SIZE;
+    iterQueueCount--;
+    return true;
+}
+
+void bms_iter_close(void)
+{
+    reset_decoder();
+    interleaveTracks = false;
+    numSinks = 0;
+    bmsData = NULL;
+    bmsSize = 0;
+}
+
+const char *bms_error(void)
+{
+    return (errorMessage[0] != '\0') ? errorMessage : NULL;
+}
+
+//------------------------------------------------------------------------------
+// Note Index
+//------------------------------------------------------------------------------
+
+// Pairs each note on event with the event that ends it (the note off for its
+// voice, another note on for the same voice, or the end of the track), so that a
+// sequence can be looked at as notes with durations, like in a piano roll.
+//
+// Each track's notes are sorted by start time, and the sorted array doubles as an
+// implicit interval tree: the note at index i is a node at level L, where L is the
+// number of trailing 1 bits in i, and its children are at i - 2^(L-1) and
+// i + 2^(L-1). A sidecar array holds the latest end time in each node's subtree,
+// so a query only walks into subtrees that have a note still sounding after the
+// window starts, and finds the notes in a window in O(log n + k) time.
+
+#define NOTE_INDEX_LEAF_LEVEL 3  // Subtrees this small are scanned instead of walked
+
+struct NoteTrack
+{
+    struct Note *notes;
+    uint32_t *noteEnds;  // End of each note (at least one tick after its start)
+    uint32_t *maxEnds;  // Latest end in the subtree of each node
+    unsigned int count;
+    unsigned int capacity;
+    int maxLevel;
+    int openNotes[8];  // Note sounding on each voice, or -1
+};
+
+static THREAD_LOCAL struct NoteTrack *noteTracks = NULL;
+static THREAD_LOCAL int numNoteTracks = 0;
+
+static struct NoteTrack *get_note_track(int track)
+{
+    if (track >= numNoteTracks)
+    {
+        noteTracks = budget_realloc(noteTracks, numNoteTracks * sizeof(*noteTracks), (track + 1) * sizeof(*noteTracks));
+        for (int i = numNoteTracks; i <= track; i++)
+        {
+            memset(&noteTracks[i], 0, sizeof(noteTracks[i]));
+            for (int v = 0; v < 8; v++)
+                noteTracks[i].openNotes[v] = -1;
+        }
+        numNoteTracks = track + 1;
+    }
+    return &noteTracks[track];
+}
+
+static void end_note(struct NoteTrack *t, int voice, uint32_t tick)
+{
+    if (t->openNotes[voice] < 0)
+        return;
+    t->notes[t->openNotes[voice]].duration = tick - t->notes[t->openNotes[voice]].start;
+    t->openNotes[voice] = -1;
+}
+
+static void notes_handle_event(struct EventSink *sink, const struct Event *event)
+{
+    struct NoteTrack *t = get_note_track(event->track);
+    int voice = event->operands[2] & 7;
+    struct Note *note;
+    
+    (void)sink;
+    switch (event->type)
+    {
+    case EVENT_NOTE_ON:
+        end_note(t, voice, event->tick);
+        if (t->count == t->capacity)
+        {
+            unsigned int newCapacity = (t->capacity != 0) ? t->capacity * 2 : 256;
+            
+            t->notes = budget_realloc(t->notes, t->capacity * sizeof(*t->notes), newCapacity * sizeof(*t->notes));
+            t->capacity = newCapacity;
+        }
+        note = &t->notes[t->count];
+        note->start = event->tick;
+        note->duration = 0;
+        note->pitch = event->operands[0];
+        note->velocity = event->operands[1];
+        note->channel = event->channel;
+        note->offset = event->offset;
+        t->openNotes[voice] = t->count++;
+        break;
+    case EVENT_NOTE_OFF:
+        end_note(t, voice, event->tick);
+        break;
+    case EVENT_TRACK_END:
+        for (int v = 0; v < 8; v++)
+            end_note(t, v, event->tick);
+        break;
+    default:
+        break;
+    }
+}
+
+static THREAD_LOCAL struct EventSink notesSink = {notes_handle_event, NULL, NULL, 0};
+
+static int compare_notes(const void *a, const void *b)
+{
+    const struct Note *n1 = a;
+    const struct Note *n2 = b;
+    
+    if (n1->start != n2->start)
+        return (n1->start < n2->start) ? -1 : 1;
+    return (n1->offset < n2->offset) ? -1 : (n1->offset > n2->offset);
+}
+
+// Sorts a track's notes and fills in maxEnds bottom up, one level at a time
+static void build_note_index(struct NoteTrack *t)
+{
+    unsigned int n = t->count;
+    unsigned int lastIndex = 0;  // Last node on the path to the root that covers the end of the array
+    uint32_t lastEnd = 0;  // Its maxEnd, which stands in for children past the end of the array
+    int level;
+    
+    if (n != 0)
+        qsort(t->notes, n, sizeof(*t->notes), compare_notes);
+    t->noteEnds = budget_realloc(NULL, 0, (n + 1) * sizeof(*t->noteEnds));
+    t->maxEnds = budget_realloc(NULL, 0, (n + 1) * sizeof(*t->maxEnds));
+    for (unsigned int i = 0; i < n; i++)
+        t->noteEnds[i] = t->notes[i].start + ((t->notes[i].duration != 0) ? t->notes[i].duration : 1);
+    for (unsigned int i = 0; i < n; i += 2)
+    {
+        lastIndex = i;
+        lastEnd = t->maxEnds[i] = t->noteEnds[i];
+    }
+    for (level = 1; (1u << level) <= n; level++)
+    {
+        unsigned int half = 1u << (level - 1);
+        
+        for (unsigned int i = (half << 1) - 1; i < n; i += half << 2)
+        {
+            uint32_t end = t->noteEnds[i];
+            uint32_t left = t->maxEnds[i - half];
+            uint32_t right = (i + half < n) ? t->maxEnds[i + half] : lastEnd;
+            
+            if (left > end)
+                end = left;
+            if (right > end)
+                end = right;
+            t->maxEnds[i] = end;
+        }
+        lastIndex = ((lastIndex >> level) & 1) ? lastIndex - half : lastIndex + half;
+        if (lastIndex < n && t->maxEnds[lastIndex] > lastEnd)
+            lastEnd = t->maxEnds[lastIndex];
+    }
+    t->maxLevel = level - 1;
+}
+
+static void free_note_tracks(void)
+{
+    for (int i = 0; i < numNoteTracks; i++)
+    {
+        struct NoteTrack *t = &noteTracks[i];
+        
+        budget_free(t->notes, t->capacity * sizeof(*t->notes));
+        // The index is missing if building it went over the memory limit
+        if (t->noteEnds != NULL)
+            budget_free(t->noteEnds, (t->count + 1) * sizeof(*t->noteEnds));
+        if (t->maxEnds != NULL)
+            budget_free(t->maxEnds, (t->count + 1) * sizeof(*t->maxEnds));
+    }
+    budget_free(noteTracks, numNoteTracks * sizeof(*noteTracks));
+    noteTracks = NULL;
+    numNoteTracks = 0;
+}
+
+bool bms_notes_open(const uint8_t *data, unsigned long int size)
+{
+    jmp_buf handler;
+    
+    free_note_tracks();
+    reset_decoder();
+    budget_start_job();
+    bmsData = data;
+    bmsSize = size;
+    trackCacheEnabled = false;
+    errorMessage[0] = '\0';
+    numSinks = 0;
+    add_sink(&notesSink);
+    if (setjmp(handler) != 0)
+    {
+        errorHandler = NULL;
+        free_note_tracks();
+        reset_decoder();
+        numSinks = 0;
+        bmsData = NULL;
+        bmsSize = 0;
+        return false;
+    }
+    errorHandler = &handler;
+    read_bms();
+    
+    // Notes still sounding when the sequence ends last until the end of their track
+    get_note_track(numMidiTracks - 1);
+    for (int i = 0; i < numNoteTracks; i++)
+    {
+        for (int v = 0; v < 8; v++)
+            end_note(&noteTracks[i], v, midiTracks[i].tick);
+        build_note_index(&noteTracks[i]);
+    }
+    errorHandler = NULL;
+    
+    reset_decoder();
+    numSinks = 0;
+    bmsData = NULL;
+    bmsSize = 0;
+    return true;
+}
+
+int bms_notes_track_count(void)
+{
+    return numNoteTracks;
+}
+
+const struct Note *bms_notes_track(int track, unsigned int *count)
+{
+    if (track < 0 || track >= numNoteTracks)
+    {
+        *count = 0;
+        return NULL;
+    }
+    *count = noteTracks[track].count;
+    return noteTracks[track].notes;
+}
+
+unsigned int bms_notes_between(int track, uint32_t startTick, uint32_t endTick, struct Note *notes, unsigned int maxNotes)
+{
+    struct
+    {
+        unsigned int index;
+        int level;
+        bool leftDone;
+    } stack[64];
+    int stackTop = 0;
+    const struct NoteTrack *t;
+    unsigned int found = 0;
+    
+    if (track < 0 || track >= numNoteTracks || noteTracks[track].count == 0 || startTick >= endTick)
+        return 0;
+    t = &noteTracks[track];
+    
+    // Nodes are visited in order, so the notes come out sorted by start time
+    stack[stackTop].index = (1u << t->maxLevel) - 1;
+    stack[stackTop].level = t->maxLevel;
+    stack[stackTop].leftDone = false;
+    stackTop++;
+    while (stackTop > 0)
+    {
+        unsigned int index = stack[stackTop - 1].index;
+        int level = stack[stackTop - 1].level;
+        bool leftDone = stack[stackTop - 1].leftDone;
+        
+        stackTop--;
+        if (level <= NOTE_INDEX_LEAF_LEVEL)
+        {
+            unsigned int first = index >> level << level;
+            unsigned int last = first + (2u << level) - 1;
+            
+            if (last > t->count)
+                last = t->count;
+            for (unsigned int i = first; i < last && t->notes[i].start < endTick; i++)
+            {
+                if (t->noteEnds[i] > startTick)
+                {
+                    if (found < maxNotes)
+                        notes[found] = t->notes[i];
+                    found++;
+                }
+            }
+        }
+        else if (!leftDone)
+        {
+            unsigned int left = index - (1u << (level - 1));
+            
+            // Come back to this node after its left subtree
+            stack[stackTop].index = index;
+            stack[stackTop].level = level;
+            stack[stackTop].leftDone = true;
+            stackTop++;
+            // Nothing in the left subtree sounds in the window if it all ends before the window starts
+            if (left >= t->count || t->maxEnds[left] > startTick)
+            {
+                stack[stackTop].index = left;
+                stack[stackTop].level = level - 1;
+                stack[stackTop].leftDone = false;
+                stackTop++;
+            }
+        }
+        else if (index < t->count && t->notes[index].start < endTick)
+        {
+            // Everything to the right starts later, so it's only worth looking at if this note starts in time
+            if (t->noteEnds[index] > startTick)
+            {
+                if (found < maxNotes)
+                    notes[found] = t->notes[index];
+                found++;
+            }
+            stack[stackTop].index = index + (1u << (level - 1));
+            stack[stackTop].level = level - 1;
+            stack[stackTop].leftDone = false;
+            stackTop++;
+        }
+    }
+    return found;
+}
+
+void bms_notes_close(void)
+{
+    free_note_tracks();
+}
+
+// General MIDI instrument names, which instrument lists may use instead of numbers.
+// Drum Kit (128) isn't a real MIDI program; it moves the track to channel 9.
+static const char *const instrNames[] =
+{
+    // Piano
+    "Acoustic Grand Piano", "Bright Piano", "Electric Grand Piano", "Honky-tonk Piano", "Electric Piano 1", "Electric Piano 2", "Harpsichord", "Clavinet",
+    // Melodic Percussion
+    "Celesta", "Glockenspiel", "Music Box", "Vibraphone", "Marimba", "Xylophone", "Tubular Bells", "Dulcimer",
+    // Organ
+    "Hammond Organ", "Percussive Organ", "Rock Organ", "Church Organ", "Reed Organ", "Accordian", "Harmonica", "Tango Accordian",
+    // Guitar
+    "Nylon String Guitar", "Steel String Guitar", "Jazz Guitar", "Clean Electric Guitar", "Muted Guitar", "Overdrive Guitar", "Distortion Guitar", "Guitar Harmonics",
+    // Bass
+    "Acoustic Bass", "Fingered Bass", "Picked Bass", "Fretless Bass", "Slap Bass 1", "Slap Bass 2", "Synth Bass 1", "Synth Bass 2",
+    // String
+    "Violin", "Viola", "Cello", "Contrabass", "Tremolo Strings", "Pizzicato Strings", "Orchestral Harp", "Timpani",
+    // Ensemble
+    "String Ensemble 1", "String Ensemble 2", "Synth Strings 1", "Synth Strings 2", "Choir Ahh", "Choir Oohh", "Synth Voice", "Orchestral Hit",
+    // Brass
+    "Trumpet", "Trombone", "Tuba", "Muted Trumpet", "French Horn", "Brass Section", "Synth Brass 1", "Synth Brass 2",
+    // Reed
+    "Soprano Sax", "Alto Sax", "Tenor Sax", "Baritone Sax", "Oboe", "English Horn", "Bassoon", "Clarinet",
+    // Pipe
+    "Piccolo", "Flute", "Recorder", "Pan Flute", "Blown Bottle", "Shakuhachi", "Whistle", "Ocarina",
+    // Synth Lead
+    "Square Lead", "Sawtooth Lead", "Calliope Lead", "Chiff Lead", "Charang Lead", "Voice Lead", "Fifth Lead", "Bass & Lead",
+    // Synth Pad
+    "New Age", "Warm", "Polysynth", "Choir", "Bowed", "Metallic", "Halo", "Sweep",
+    // Synth FX
+    "FX Rain", "FX Soundtrack", "FX Crystal", "FX Atmosphere", "FX Brightness", "FX Goblins", "FX Echo Drops", "FX Star Theme",
+    // Ethnic
+    "Sitar", "Banjo", "Shamisen", "Koto", "Kalimba", "Bagpipe", "Fiddle", "Shanai",
+    // Percussive
+    "Tinkle Bell", "Agogo", "Steel Drums", "Woodblock", "Taiko Drum", "Melodic Tom", "Synth Drum", "Reverse Cymbal",
+    // Sound Effects
+    "Guitar Fret Noise", "Breath Noise", "Seashore", "Bird Tweet", "Telephone Ring", "Helicopter", "Applause", "Gunshot",
+    "Drum Kit",
+};
+
+// Adds the instruments in file to instrList. Returns NULL, or the name of an
+// unknown instrument (to be freed by the caller) if it stopped at one.
+static char *create_instrument_conversion_table(FILE *file)
+{
+    size_t bufferSize = 1;
+    char *buffer = malloc(bufferSize);
+    bool endOfFile = false;
+    
+    while (!endOfFile)
+    {
+        int offset = 0;
+        int instrNum;
+        
+        buffer[0] = '\0';        
+        while (1)
+        {
+            if (fgets(buffer + offset, bufferSize - offset, file) == NULL)
+            {
+                endOfFile = true;  // The last line doesn't need to end with a newline
+                break;
+            }
+            offset = strlen(buffer);
+            if (offset > 0 && buffer[offset - 1] == '\n')
+                break;
+            bufferSize *= 2;
+            buffer = realloc(buffer, bufferSize);
+        }
+        if (offset == 0)
+            continue;
+        char *nl = strchr(buffer, '\n');
+        if (nl != NULL)
+            *nl = '\0';
+        if (sscanf(buffer, "%i", &instrNum) != 1)  // If it's not a number, check the names.
+        {
+            char *name;
+            
+            // Strip space
+            name = buffer + offset - 1;
+            while (isspace(*name))
+                *(name--) = '\0';
+            name = buffer;
+            while (isspace(*name))
+                name++;
+            
+            for (instrNum = 0; instrNum < ARRAY_LENGTH(instrNames); instrNum++)
+            {
+                if (strcmp(name, instrNames[instrNum]) == 0)
+                    goto got_instrument;
+            }
+            name = strdup(name);
+            free(buffer);
+            return name;
+        }
+      got_instrument:
+        DEBUG_printf("Instrument %i is %s\n", instrListCount, instrNames[instrNum]);
+        instrList = realloc(instrList, (instrListCount + 1) * sizeof(*instrList));
+        instrList[instrListCount] = instrNum;
+        instrListCount++;
+    }
+    free(buffer);
+    return NULL;
+}
+
+//------------------------------------------------------------------------------
+// MIDI File Reading
+//------------------------------------------------------------------------------
+
+// Events of a Standard MIDI File. Only channel messages and tempo changes are kept.
+struct MidiEvent
+{
+    uint32_t tick;  // Absolute time
+    int track;
+    uint8_t status;  // Status byte, or 0xFF for a tempo change
+    uint8_t data1;
+    uint8_t data2;
+    uint32_t tempo;  // Microseconds per quarter note, for tempo changes
+};
+
+struct MidiSong
+{
+    int format;
+    int ticksPerQNote;
+    int numTracks;
+    struct MidiEvent *events;  // Sorted by track, then by time
+    unsigned int numEvents;
+    unsigned int eventCapacity;
+};
+
+static uint32_t read_be(const uint8_t *p, int len)
+{
+    uint32_t val = 0;
+    
+    for (int i = 0; i < len; i++)
+        val = (val << 8) | p[i];
+    return val;
+}
+
+// Reads a variable length quantity. Returns false if it runs past end.
+static bool read_varlen(const uint8_t **p, const uint8_t *end, uint32_t *val)
+{
+    uint32_t v = 0;
+    
+    for (int i = 0; i < 4; i++)
+    {
+        if (*p >= end)
+            return false;
+        v = (v << 7) | (**p & 0x7F);
+        if ((*(*p)++ & 0x80) == 0)
+        {
+            *val = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void add_midi_event(struct MidiSong *song, const struct MidiEvent *event)
+{
+    if (song->numEvents == song->eventCapacity)
+    {
+        unsigned int newCapacity = (song->eventCapacity != 0) ? song->eventCapacity * 2 : 256;
+        
+        song->events = budget_realloc(song->events, song->eventCapacity * sizeof(*song->events), newCapacity * sizeof(*song->events));
+        song->eventCapacity = newCapacity;
+    }
+    song->events[song->numEvents++] = *event;
+}
+
+static void free_midi_song(struct MidiSong *song)
+{
+    budget_free(song->events, song->eventCapacity * sizeof(*song->events));
+    song->events = NULL;
+    song->numEvents = song->eventCapacity = 0;
+}
+
+// Parses the events of one MTrk chunk
+static void parse_midi_track(struct MidiSong *song, int track, const uint8_t *p, const uint8_t *trackEnd, const char *name)
+{
+    uint32_t tick = 0;
+    uint8_t runningStatus = 0;
+    
+    while (p < trackEnd)
+    {
+        struct MidiEvent event = {0};
+        uint32_t delta;
+        uint8_t status;
+        
+        if (!read_varlen(&p, trackEnd, &delta) || p >= trackEnd)
+            fatal_error("'%s': bad event in track %i\n", name, track);
+        tick += delta;
+        event.tick = tick;
+        event.track = track;
+        status = *p;
+        if (status & 0x80)
+            p++;
+        else if (runningStatus != 0)
+            status = runningStatus;
+        else
+            fatal_error("'%s': bad event in track %i\n", name, track);
+        
+        if (status == 0xFF)  // Meta event
+        {
+            uint8_t type;
+            uint32_t len;
+            
+            if (p >= trackEnd)
+                fatal_error("'%s': bad event in track %i\n", name, track);
+            type = *p++;
+            if (!read_varlen(&p, trackEnd, &len) || len > (uint32_t)(trackEnd - p))
+                fatal_error("'%s': bad event in track %i\n", name, track);
+            if (type == 0x51 && len == 3)
+            {
+                event.status = 0xFF;
+                event.data1 = 0x51;
+                event.tempo = read_be(p, 3);
+                add_midi_event(song, &event);
+            }
+            p += len;
+            if (type == 0x2F)
+                break;
+        }
+        else if (status == 0xF0 || status == 0xF7)  // SysEx
+        {
+            uint32_t len;
+            
+            if (!read_varlen(&p, trackEnd, &len) || len > (uint32_t)(trackEnd - p))
+                fatal_error("'%s': bad event in track %i\n", name, track);
+            p += len;
+        }
+        else
+        {
+            // Program change and channel pressure have one data byte, the rest have two
+            int len = ((status & 0xE0) == 0xC0) ? 1 : 2;
+            
+            if (trackEnd - p < len)
+                fatal_error("'%s': bad event in track %i\n", name, track);
+            runningStatus = status;
+            event.status = status;
+            event.data1 = p[0] & 0x7F;
+            event.data2 = (len == 2) ? (p[1] & 0x7F) : 0;
+            p += len;
+            add_midi_event(song, &event);
+        }
+    }
+}
+
+static void parse_midi(struct MidiSong *song, const uint8_t *data, unsigned long int size, const char *name)
+{
+    const uint8_t *p;
+    const uint8_t *end = data + size;
+    
+    memset(song, 0, sizeof(*song));
+    if (size < 14 || memcmp(data, "MThd", 4) != 0 || read_be(data + 4, 4) < 6 || read_be(data + 4, 4) > size - 8)
+        fatal_error("'%s' is not a MIDI file\n", name);
+    song->format = read_be(data + 8, 2);
+    song->numTracks = read_be(data + 10, 2);
+    song->ticksPerQNote = read_be(data + 12, 2);
+    if (song->ticksPerQNote & 0x8000)
+        fatal_error("'%s' uses SMPTE time, which is not supported\n", name);
+    p = data + 8 + read_be(data + 4, 4);
+    
+    for (int track = 0; track < song->numTracks; track++)
+    {
+        uint32_t len;
+        
+        if (end - p < 8 || memcmp(p, "MTrk", 4) != 0 || (len = read_be(p + 4, 4)) > (uint32_t)(end - p - 8))
+            fatal_error("'%s': track %i is missing or truncated\n", name, track);
+        parse_midi_track(song, track, p + 8, p + 8 + len, name);
+        p += 8 + len;
+    }
+}
+
+static void read_midi_file(const char *filename, struct MidiSong *song)
+{
+    unsigned long int size;
+    uint8_t *data = read_file(filename, &size);
+    
+    if (data == NULL)
+        fatal_error("failed to open input file '%s': %s\n", filename, strerror(errno));
+    parse_midi(song, data, size, filename);
+    free(data);
+}
+
+//------------------------------------------------------------------------------
+// BMS Writing
+//------------------------------------------------------------------------------
+
+// Converts a MIDI file back into BMS. Each MIDI channel becomes a BMS track.
+// Notes are assigned to voices 1-7 (0x80 is a delay, so voice 0 can't be turned
+// off). Phrases that repeat are moved into subroutines called with 0xC4.
+//
+// The decoder gives tracks channels in the order they start, skipping 9, so
+// channels without notes below the highest one get an empty track to keep the
+// rest on their own channels, and the drum track goes last. BMS tempos are whole
+// beats per minute, so other tempos are rounded.
+//
+// Each BMS event is first encoded as a token: up to 7 bytes packed into a
+// uint64_t, with the length in the top byte. Repeated phrases are found by
+// building a suffix array over the tokens of all tracks.
+
+#define MAX_VOICES 8
+#define MIN_PHRASE_TOKENS 2
+#define MAX_PHRASE_OCCURRENCES 256  // Occurrences of one phrase that are considered
+#define PHRASE_SAMPLES 16  // Occurrences checked before a phrase is considered at all
+#define CALL_SIZE 5  // 0xC4 and a 32-bit address
+#define SEPARATOR_TOKEN (0xFFULL << 56)  // Tokens with this length byte only separate tracks
+
+struct TokenList
+{
+    uint64_t *tokens;
+    unsigned int count;
+    unsigned int capacity;
+};
+
+static uint64_t make_token(int len, const uint8_t *bytes)
+{
+    uint64_t token = (uint64_t)len << 56;
+    
+    for (int i = 0; i < len; i++)
+        token |= (uint64_t)bytes[i] << (8 * i);
+    return token;
+}
+
+static int token_length(uint64_t token)
+{
+    return token >> 56;
+}
+
+static void add_token(struct TokenList *list, uint64_t token)
+{
+    if (list->count == list->capacity)
+    {
+        list->capacity = (list->capacity != 0) ? list->capacity * 2 : 256;
+        list->tokens = realloc(list->tokens, list->capacity * sizeof(*list->tokens));
+    }
+    list->tokens[list->count++] = token;
+}
+
+static void add_token_bytes(struct TokenList *list, int len, ...)
+{
+    uint8_t bytes[7];
+    va_list args;
+    
+    va_start(args, len);
+    for (int i = 0; i < len; i++)
+        bytes[i] = va_arg(args, int);
+    va_end(args);
+    add_token(list, make_token(len, bytes));
+}
+
+// Adds delay events using the shortest encoding
+static void add_delay_tokens(struct TokenList *list, uint32_t ticks)
+{
+    while (ticks > 0xFFFF)
+    {
+        add_token_bytes(list, 3, 0x88, 0xFF, 0xFF);
+        ticks -= 0xFFFF;
+    }
+    if (ticks > 0xFF)
+        add_token_bytes(list, 3, 0x88, ticks >> 8, ticks & 0xFF);
+    else if (ticks > 0)
+        add_token_bytes(list, 2, 0x80, ticks);
+}
+
+static int compare_midi_events_by_time(const void *a, const void *b)
+{
+    const struct MidiEvent *ea = *(const struct MidiEvent *const *)a;
+    const struct MidiEvent *eb = *(const struct MidiEvent *const *)b;
+    
+    if (ea->tick != eb->tick)
+        return (ea->tick < eb->tick) ? -1 : 1;
+    // Keep the original order otherwise
+    return (ea < eb) ? -1 : (ea > eb);
+}
+
+// Encodes all events on one MIDI channel as a BMS track
+static void encode_channel(const struct MidiSong *song, int channel, struct TokenList *list)
+{
+    const struct MidiEvent **events = malloc(song->numEvents * sizeof(*events));
+    unsigned int numEvents = 0;
+    int voicePitch[MAX_VOICES];
+    uint32_t voiceStart[MAX_VOICES];
+    uint32_t tick = 0;
+    
+    for (int i = 0; i < MAX_VOICES; i++)
+        voicePitch[i] = -1;
+    for (unsigned int i = 0; i < song->numEvents; i++)
+    {
+        if (song->events[i].status != 0xFF && (song->events[i].status & 0x0F) == channel)
+            events[numEvents++] = &song->events[i];
+    }
+    qsort(events, numEvents, sizeof(*events), compare_midi_events_by_time);
+    
+    // The decoder moves a track to channel 9 when it sees drum kit instrument 128
+    if (channel == 9)
+        add_token_bytes(list, 3, 0xA4, 0x21, 128);
+    for (unsigned int i = 0; i < numEvents; i++)
+    {
+        const struct MidiEvent *event = events[i];
+        uint8_t type = event->status & 0xF0;
+        int pitch = event->data1;
+        
+        if (type == 0x90 && event->data2 == 0)
+            type = 0x80;
+        // Only these become BMS events
+        if (!(type == 0x80 || type == 0x90 || (type == 0xC0 && channel != 9)
+         || (type == 0xB0 && (event->data1 == 0x07 || event->data1 == 0x0A))))
+            continue;
+        // The decoder lowers drum notes by one, so raise them to match
+        if (channel == 9 && (type == 0x80 || type == 0x90))
+            pitch = (pitch < 127) ? pitch + 1 : 127;
+        
+        add_delay_tokens(list, event->tick - tick);
+        tick = event->tick;
+        switch (type)
+        {
+        case 0x80:
+        {
+            // Release the voice that has been holding this pitch the longest
+            int voice = -1;
+            
+            for (int v = 1; v < MAX_VOICES; v++)
+            {
+                if (voicePitch[v] == pitch && (voice < 0 || voiceStart[v] < voiceStart[voice]))
+                    voice = v;
+            }
+            if (voice >= 0)
+            {
+                add_token_bytes(list, 1, 0x80 + voice);
+                voicePitch[voice] = -1;
+            }
+            break;
+        }
+        case 0x90:
+        {
+            int voice = -1;
+            
+            for (int v = 1; v < MAX_VOICES; v++)
+            {
+                if (voicePitch[v] == -1)
+                {
+                    voice = v;
+                    break;
+                }
+            }
+            if (voice < 0)
+            {
+                // All voices are in use. Cut off the oldest note.
+                voice = 1;
+                for (int v = 2; v < MAX_VOICES; v++)
+                {
+                    if (voiceStart[v] < voiceStart[voice])
+                        voice = v;
+                }
+                add_token_bytes(list, 1, 0x80 + voice);
+            }
+            add_token_bytes(list, 3, pitch, voice, event->data2);
+            voicePitch[voice] = pitch;
+            voiceStart[voice] = tick;
+            break;
+        }
+        case 0xC0:
+            add_token_bytes(list, 3, 0xA4, 0x21, event->data1);
+            break;
+        case 0xB0:
+            if (event->data1 == 0x07)
+                add_token_bytes(list, 4, 0x9C, 0x00, event->data2, 0);
+            else
+                add_token_bytes(list, 4, 0x9A, 0x03, event->data2, 0);
+            break;
+        }
+    }
+    // Release anything still held
+    for (int v = 1; v < MAX_VOICES; v++)
+    {
+        if (voicePitch[v] != -1)
+            add_token_bytes(list, 1, 0x80 + v);
+    }
+    free(events);
+}
+
+// Suffix array construction by prefix doubling
+static const uint64_t *saTokens;
+static unsigned int *saRank;
+static unsigned int *saRankTmp;
+static unsigned int saLength;
+static unsigned int saStep;
+
+static int compare_token_suffixes(const void *a, const void *b)
+{
+    uint64_t ta = saTokens[*(const unsigned int *)a];
+    uint64_t tb = saTokens[*(const unsigned int *)b];
+    
+    return (ta < tb) ? -1 : (ta > tb);
+}
+
+static int compare_rank_pairs(const void *a, const void *b)
+{
+    unsigned int ia = *(const unsigned int *)a;
+    unsigned int ib = *(const unsigned int *)b;
+    unsigned int ra2;
+    unsigned int rb2;
+    
+    if (saRank[ia] != saRank[ib])
+        return (saRank[ia] < saRank[ib]) ? -1 : 1;
+    ra2 = (ia + saStep < saLength) ? saRank[ia + saStep] + 1 : 0;
+    rb2 = (ib + saStep < saLength) ? saRank[ib + saStep] + 1 : 0;
+    return (ra2 < rb2) ? -1 : (ra2 > rb2);
+}
+
+static unsigned int *build_suffix_array(const uint64_t *tokens, unsigned int n)
+{
+    unsigned int *sa = malloc(n * sizeof(*sa));
+    
+    saTokens = tokens;
+    saLength = n;
+    saRank = malloc(n * sizeof(*saRank));
+    saRankTmp = malloc(n * sizeof(*saRankTmp));
+    for (unsigned int i = 0; i < n; i++)
+        sa[i] = i;
+    qsort(sa, n, sizeof(*sa), compare_token_suffixes);
+    for (unsigned int i = 0; i < n; i++)
+        saRank[sa[i]] = (i > 0 && tokens[sa[i]] == tokens[sa[i - 1]]) ? saRank[sa[i - 1]] : i;
+    for (saStep = 1; saStep < n; saStep *= 2)
+    {
+        qsort(sa, n, sizeof(*sa), compare_rank_pairs);
+        saRankTmp[sa[0]] = 0;
+        for (unsigned int i = 1; i < n; i++)
+            saRankTmp[sa[i]] = saRankTmp[sa[i - 1]] + (compare_rank_pairs(&sa[i - 1], &sa[i]) != 0);
+        memcpy(saRank, saRankTmp, n * sizeof(*saRank));
+        if (saRank[sa[n - 1]] == n - 1)  // All suffixes are distinct
+            break;
+    }
+    free(saRankTmp);
+    free(saRank);
+    return sa;
+}
+
+// lcp[i] is the length of the common prefix of suffixes sa[i - 1] and sa[i] (Kasai's algorithm)
+static unsigned int *build_lcp_array(const uint64_t *tokens, const unsigned int *sa, unsigned int n)
+{
+    unsigned int *rank = malloc(n * sizeof(*rank));
+    unsigned int *lcp = calloc(n + 1, sizeof(*lcp));
+    unsigned int h = 0;
+    
+    for (unsigned int i = 0; i < n; i++)
+        rank[sa[i]] = i;
+    for (unsigned int i = 0; i < n; i++)
+    {
+        if (rank[i] > 0)
+        {
+            unsigned int j = sa[rank[i] - 1];
+            
+            while (i + h < n && j + h < n && tokens[i + h] == tokens[j + h] && tokens[i + h] != SEPARATOR_TOKEN)
+                h++;
+            lcp[rank[i]] = h;
+            if (h > 0)
+                h--;
+        }
+        else
+        {
+            h = 0;
+        }
+    }
+    free(rank);
+    return lcp;
+}
+
+struct Phrase
+{
+    unsigned int length;  // in tokens
+    unsigned int lb;  // Range of the suffix array where it occurs
+    unsigned int rb;
+    long int savings;  // Estimated number of bytes saved by making it a subroutine
+};
+
+static unsigned int *phraseBytes;  // Prefix sums of token lengths
+
+static unsigned int token_range_bytes(unsigned int pos, unsigned int len)
+{
+    return phraseBytes[pos + len] - phraseBytes[pos];
+}
+
+static long int phrase_savings(unsigned int bytes, unsigned int count)
+{
+    // Each copy becomes a call, and the subroutine needs a return at the end.
+    return (long int)count * ((long int)bytes - CALL_SIZE) - (bytes + 1);
+}
+
+static int compare_phrases(const void *a, const void *b)
+{
+    const struct Phrase *pa = a;
+    const struct Phrase *pb = b;
+    
+    if (pa->savings != pb->savings)
+        return (pa->savings > pb->savings) ? -1 : 1;
+    return (pa->lb < pb->lb) ? -1 : (pa->lb > pb->lb);
+}
+
+static int compare_uints(const void *a, const void *b)
+{
+    unsigned int ua = *(const unsigned int *)a;
+    unsigned int ub = *(const unsigned int *)b;
+    
+    return (ua < ub) ? -1 : (ua > ub);
+}
+
+// Positions already replaced by calls are counted in a Fenwick tree, so that
+// whether a whole occurrence is free can be checked without visiting each token
+static unsigned int *coverTree;
+static unsigned int coverSize;
+
+static void cover_position(unsigned int pos)
+{
+    for (unsigned int i = pos + 1; i <= coverSize; i += i & -i)
+        coverTree[i]++;
+}
+
+// Number of covered positions before pos
+static unsigned int covered_before(unsigned int pos)
+{
+    unsigned int count = 0;
+    
+    for (unsigned int i = pos; i > 0; i -= i & -i)
+        count += coverTree[i];
+    return count;
+}
+
+static bool range_is_free(unsigned int pos, unsigned int len)
+{
+    return covered_before(pos + len) == covered_before(pos);
+}
+
+// True if the token before pos is the same as the one before other. A phrase
+// whose occurrences all have the same token before them isn't maximal: that
+// token can be added to it without losing any occurrences.
+static bool same_token_before(const uint64_t *tokens, unsigned int pos, unsigned int other)
+{
+    if (pos == 0 || other == 0 || tokens[pos - 1] == SEPARATOR_TOKEN)
+        return false;
+    return tokens[pos - 1] == tokens[other - 1];
+}
+
+// Finds repeated phrases and picks non-overlapping occurrences of them greedily,
+// best savings first. callTarget[pos] is set to the subroutine number + 1 for each
+// position where a call replaces a phrase. Returns the number of subroutines, and
+// the start and length of each in subStart and subLength.
+//
+// Only maximal repeats are considered, and at most MAX_PHRASE_OCCURRENCES
+// occurrences of each, so that periodic input (where there are repeats of
+// every length, each occurring almost everywhere) doesn't take quadratic time.
+static unsigned int factor_phrases(const uint64_t *tokens, unsigned int n, unsigned int *callTarget,
+  unsigned int **subStart, unsigned int **subLength)
+{
+    unsigned int *sa = build_suffix_array(tokens, n);
+    unsigned int *lcp = build_lcp_array(tokens, sa, n);
+    struct Phrase *phrases = NULL;
+    unsigned int numPhrases = 0;
+    unsigned int phraseCapacity = 0;
+    struct { unsigned int lcp; unsigned int lb; } *stack = malloc((n + 1) * sizeof(*stack));
+    unsigned int stackTop = 0;
+    unsigned int *leftChanges = malloc((n + 1) * sizeof(*leftChanges));
+    unsigned int occurrences[MAX_PHRASE_OCCURRENCES];
+    unsigned int numSubs = 0;
+    
+    phraseBytes = malloc((n + 1) * sizeof(*phraseBytes));
+    phraseBytes[0] = 0;
+    for (unsigned int i = 0; i < n; i++)
+        phraseBytes[i + 1] = phraseBytes[i] + token_length(tokens[i]);
+    coverSize = n;
+    coverTree = calloc(n + 1, sizeof(*coverTree));
+    // leftChanges[i] counts the neighbors in the suffix array up to i with different tokens before them,
+    // so that an interval of it is left maximal if the count changes within it
+    leftChanges[0] = 0;
+    for (unsigned int i = 1; i < n; i++)
+        leftChanges[i] = leftChanges[i - 1] + !same_token_before(tokens, sa[i], sa[i - 1]);
+    *subStart = NULL;
+    *subLength = NULL;
+    
+    // Enumerate the LCP intervals. Each one is a phrase that occurs rb - lb + 1 times.
+    stack[0].lcp = 0;
+    stack[0].lb = 0;
+    for (unsigned int i = 1; i <= n; i++)
+    {
+        unsigned int cur = (i < n) ? lcp[i] : 0;
+        unsigned int lb = i - 1;
+        
+        while (stack[stackTop].lcp > cur)
+        {
+            unsigned int len = stack[stackTop].lcp;
+            unsigned int start = stack[stackTop].lb;
+            
+            lb = start;
+            stackTop--;
+            if (len >= MIN_PHRASE_TOKENS && leftChanges[i - 1] != leftChanges[start])
+            {
+                long int savings = phrase_savings(token_range_bytes(sa[start], len), i - start);
+                
+                if (savings > 0)
+                {
+                    if (numPhrases == phraseCapacity)
+                    {
+                        phraseCapacity = (phraseCapacity != 0) ? phraseCapacity * 2 : 64;
+                        phrases = realloc(phrases, phraseCapacity * sizeof(*phrases));
+                    }
+                    phrases[numPhrases].length = len;
+                    phrases[numPhrases].lb = start;
+                    phrases[numPhrases].rb = i - 1;
+                    phrases[numPhrases].savings = savings;
+                    numPhrases++;
+                }
+            }
+        }
+        if (stack[stackTop].lcp < cur)
+        {
+            stackTop++;
+            stack[stackTop].lcp = cur;
+            stack[stackTop].lb = lb;
+        }
+    }
+    if (numPhrases != 0)
+        qsort(phrases, numPhrases, sizeof(*phrases), compare_phrases);
+    
+    for (unsigned int i = 0; i < numPhrases; i++)
+    {
+        const struct Phrase *phrase = &phrases[i];
+        unsigned int count = phrase->rb - phrase->lb + 1;
+        unsigned int samples = (count < PHRASE_SAMPLES) ? count : PHRASE_SAMPLES;
+        unsigned int freeSamples = 0;
+        unsigned int bytes = token_range_bytes(sa[phrase->lb], phrase->length);
+        unsigned int picked = 0;
+        unsigned int nextFree = 0;
+        
+        // Skip phrases that are mostly covered by better ones already. With count
+        // at most PHRASE_SAMPLES, this only skips phrases that would save nothing.
+        for (unsigned int j = 0; j < samples; j++)
+        {
+            unsigned int pos = sa[phrase->lb + (unsigned int)((uint64_t)j * count / samples)];
+            
+            freeSamples += range_is_free(pos, phrase->length);
+        }
+        if (freeSamples < 2 || phrase_savings(bytes, (uint64_t)count * freeSamples / samples) <= 0)
+            continue;
+        
+        // Spread the occurrences considered over the whole interval
+        if (count > MAX_PHRASE_OCCURRENCES)
+        {
+            for (unsigned int j = 0; j < MAX_PHRASE_OCCURRENCES; j++)
+                occurrences[j] = sa[phrase->lb + (unsigned int)((uint64_t)j * count / MAX_PHRASE_OCCURRENCES)];
+            count = MAX_PHRASE_OCCURRENCES;
+        }
+        else
+        {
+            memcpy(occurrences, &sa[phrase->lb], count * sizeof(*occurrences));
+        }
+        qsort(occurrences, count, sizeof(*occurrences), compare_uints);
+        for (unsigned int j = 0; j < count; j++)
+        {
+            unsigned int pos = occurrences[j];
+            
+            if (pos >= nextFree && range_is_free(pos, phrase->length))
+            {
+                occurrences[picked++] = pos;
+                nextFree = pos + phrase->length;
+            }
+        }
+        if (picked < 2 || phrase_savings(token_range_bytes(occurrences[0], phrase->length), picked) <= 0)
+            continue;
+        
+        *subStart = realloc(*subStart, (numSubs + 1) * sizeof(**subStart));
+        *subLength = realloc(*subLength, (numSubs + 1) * sizeof(**subLength));
+        (*subStart)[numSubs] = occurrences[0];
+        (*subLength)[numSubs] = phrase->length;
+        numSubs++;
+        for (unsigned int j = 0; j < picked; j++)
+        {
+            for (unsigned int k = 0; k < phrase->length; k++)
+                cover_position(occurrences[j] + k);
+            callTarget[occurrences[j]] = numSubs;
+        }
+    }
+    DEBUG_printf("%u repeated phrases, %u subroutines\n", numPhrases, numSubs);
+    
+    free(phraseBytes);
+    free(coverTree);
+    free(leftChanges);
+    free(stack);
+    free(phrases);
+    free(lcp);
+    free(sa);
+    return numSubs;
+}
+
+static void put_token(uint8_t **p, uint64_t token)
+{
+    for (int i = 0; i < token_length(token); i++)
+        *(*p)++ = token >> (8 * i);
+}
+
+static void put_be(uint8_t **p, uint32_t val, int len)
+{
+    for (int i = len - 1; i >= 0; i--)
+        *(*p)++ = val >> (8 * i);
+}
+
+// Size of a track's data once calls replace the phrases that were factored out
+static unsigned int encoded_size(const uint64_t *tokens, unsigned int start, unsigned int end,
+  const unsigned int *callTarget, const unsigned int *subLength)
+{
+    unsigned int size = 0;
+    
+    for (unsigned int pos = start; pos < end; )
+    {
+        if (callTarget[pos] != 0)
+        {
+            size += CALL_SIZE;
+            pos += subLength[callTarget[pos] - 1];
+        }
+        else
+        {
+            size += token_length(tokens[pos]);
+            pos++;
+        }
+    }
+    return size;
+}
+
+static void write_bms(const char *midiFilename, const char *bmsFilename)
+{
+    struct MidiSong song;
+    struct TokenList meta = {NULL, 0, 0};
+    struct TokenList tokens = {NULL, 0, 0};
+    unsigned int trackStart[MAX_CHANNELS + 1];  // Token index where each track starts
+    unsigned int trackOffset[MAX_CHANNELS];
+    int numTracks = 0;
+    unsigned int usedChannels = 0;  // Channels with notes
+    unsigned int *callTarget;
+    unsigned int *subStart;
+    unsigned int *subLength;
+    unsigned int *subOffset;
+    unsigned int numSubs;
+    unsigned int size = 0;
+    uint32_t tick = 0;
+    uint8_t *bms;
+    uint8_t *p;
+    FILE *file;
+    
+    read_midi_file(midiFilename, &song);
+    
+    // Encode each channel that has notes as a track
+    for (unsigned int i = 0; i < song.numEvents; i++)
+    {
+        if ((song.events[i].status & 0xF0) == 0x90)
+            usedChannels |= 1 << (song.events[i].status & 0x0F);
+    }
+    for (int channel = 0; channel < MAX_CHANNELS; channel++)
+    {
+        if (channel == 9 || ((usedChannels & ~(1u << 9)) >> channel) == 0)
+            continue;
+        trackStart[numTracks++] = tokens.count;
+        if (usedChannels & (1 << channel))
+            encode_channel(&song, channel, &tokens);
+        add_token(&tokens, SEPARATOR_TOKEN);
+    }
+    if (usedChannels & (1 << 9))
+    {
+        trackStart[numTracks++] = tokens.count;
+        encode_channel(&song, 9, &tokens);
+        add_token(&tokens, SEPARATOR_TOKEN);
+    }
+    trackStart[numTracks] = tokens.count;
+    
+    callTarget = calloc(tokens.count + 1, sizeof(*callTarget));
+    numSubs = factor_phrases(tokens.tokens, tokens.count, callTarget, &subStart, &subLength);
+    
+    // Encode the meta track. All tracks start at time 0, before any delays.
+    add_token_bytes(&meta, 3, 0xFE, song.ticksPerQNote >> 8, song.ticksPerQNote & 0xFF);
+    for (int i = 0; i < numTracks; i++)
+        size += 5;  // 0xC1 events are written separately, once the track offsets are known
+    for (unsigned int i = 0; i < song.numEvents; i++)
+    {
+        const struct MidiEvent *event = &song.events[i];
+        
+        // Tempo events are usually all in the first track, so they're already in order
+        if (event->status == 0xFF && event->tempo != 0 && event->tick >= tick)
+        {
+            unsigned int bpm = (60000000 + event->tempo / 2) / event->tempo;
+            
+            if (bpm == 0)
+                bpm = 1;
+            if (bpm > 0xFFFF)
+                bpm = 0xFFFF;
+            add_delay_tokens(&meta, event->tick - tick);
+            tick = event->tick;
+            add_token_bytes(&meta, 3, 0xFD, bpm >> 8, bpm & 0xFF);
+        }
+    }
+    add_token_bytes(&meta, 1, 0xFF);
+    
+    // Lay out the file: the meta track, then the tracks, then the subroutines
+    for (unsigned int i = 0; i < meta.count; i++)
+        size += token_length(meta.tokens[i]);
+    for (int i = 0; i < numTracks; i++)
+    {
+        trackOffset[i] = size;
+        size += encoded_size(tokens.tokens, trackStart[i], trackStart[i + 1] - 1, callTarget, subLength) + 1;
+    }
+    subOffset = malloc((numSubs + 1) * sizeof(*subOffset));
+    for (unsigned int i = 0; i < numSubs; i++)
+    {
+        subOffset[i] = size;
+        for (unsigned int k = 0; k < subLength[i]; k++)
+            size += token_length(tokens.tokens[subStart[i] + k]);
+        size++;
+    }
+    if (size > 0xFFFFFF)
+        fatal_error("BMS file would be too large\n");
+    
+    // Write it
+    bms = malloc(size);
+    p = bms;
+    put_token(&p, meta.tokens[0]);
+    for (int i = 0; i < numTracks; i++)
+    {
+        *p++ = 0xC1;
+        *p++ = i;
+        put_be(&p, trackOffset[i], 3);
+    }
+    for (unsigned int i = 1; i < meta.count; i++)
+        put_token(&p, meta.tokens[i]);
+    for (int i = 0; i < numTracks; i++)
+    {
+        for (unsigned int pos = trackStart[i]; pos < trackStart[i + 1] - 1; )
+        {
+            if (callTarget[pos] != 0)
+            {
+                *p++ = 0xC4;
+                put_be(&p, subOffset[callTarget[pos] - 1], 4);
+                pos += subLength[callTarget[pos] - 1];
+            }
+            else
+            {
+                put_token(&p, tokens.tokens[pos]);
+                pos++;
+            }
+        }
+        *p++ = 0xFF;
+    }
+    for (unsigned int i = 0; i < numSubs; i++)
+    {
+        for (unsigned int k = 0; k < subLength[i]; k++)
+            put_token(&p, tokens.tokens[subStart[i] + k]);
+        *p++ = 0xC6;
+    }
+    assert(p == bms + size);
+    
+    file = fopen(bmsFilename, "wb");
+    if (file == NULL)
+        fatal_error("failed to open output file '%s': %s\n", bmsFilename, strerror(errno));
+    fwrite(bms, 1, size, file);
+    fclose(file);
+    DEBUG_printf("Wrote %i tracks and %u subroutines, %u bytes\n", numTracks, numSubs, size);
+    
+    free(bms);
+    free(subOffset);
+    free(subStart);
+    free(subLength);
+    free(callTarget);
+    free(tokens.tokens);
+    free(meta.tokens);
+    free_midi_song(&song);
+}
+
+//------------------------------------------------------------------------------
+// Verification
+//------------------------------------------------------------------------------
+
+// Compares two songs by what they play rather than by their bytes. Events are
+// reduced to (time, channel, type, data) and sorted, so the track layout, running
+// status, the order of events within a tick, and note-on with velocity 0 versus
+// note-off make no difference. Either song may be a MIDI file or a BMS file,
+// which gets converted first.
+
+#define MAX_REPORTED_DIFFERENCES 20
+
+struct NormalizedEvent
+{
+    uint64_t time;  // Tick scaled by the other song's resolution, so the two can be compared
+    uint32_t tick;  // Original tick, for reporting
+    uint8_t type;  // Status byte without the channel
+    uint8_t channel;
+    uint8_t data1;
+    uint8_t data2;
+    uint32_t tempo;
+};
+
+static void load_song(const char *filename, struct MidiSong *song)
+{
+    unsigned long int size;
+    uint8_t *data = read_file(filename, &size);
+    
+    if (data == NULL)
+        fatal_error("failed to open input file '%s': %s\n", filename, strerror(errno));
+    if (size >= 4 && memcmp(data, "MThd", 4) == 0)
+    {
+        parse_midi(song, data, size, filename);
+        free(data);
+        return;
+    }
+    
+    // Not a MIDI file, so it must be BMS
+    reset_decoder();
+    bmsData = data;
+    bmsSize = size;
+    trackCacheEnabled = false;
+    numSinks = 0;
+    add_sink(&smfSink);
+    read_bms();
+    numSinks = 0;
+    memset(song, 0, sizeof(*song));
+    song->format = 1;
+    song->numTracks = numMidiTracks;
+    song->ticksPerQNote = (ticksPerQNote != 0) ? ticksPerQNote : 120;
+    for (unsigned int i = 0; i < numMidiTracks; i++)
+        parse_midi_track(song, i, midiTracks[i].buffer, midiTracks[i].buffer + midiTracks[i].length, filename);
+    reset_decoder();
+    bmsData = NULL;
+    free(data);
+}
+
+static int compare_normalized_events(const void *a, const void *b)
+{
+    const struct NormalizedEvent *ea = a;
+    const struct NormalizedEvent *eb = b;
+    
+    if (ea->time != eb->time)
+        return (ea->time < eb->time) ? -1 : 1;
+    if (ea->type != eb->type)
+        return (ea->type < eb->type) ? -1 : 1;
+    if (ea->channel != eb->channel)
+        return (ea->channel < eb->channel) ? -1 : 1;
+    if (ea->data1 != eb->data1)
+        return (ea->data1 < eb->data1) ? -1 : 1;
+    if (ea->data2 != eb->data2)
+        return (ea->data2 < eb->data2) ? -1 : 1;
+    return (ea->tempo < eb->tempo) ? -1 : (ea->tempo > eb->tempo);
+}
+
+static struct NormalizedEvent *normalize_song(const struct MidiSong *song, int otherTicksPerQNote)
+{
+    struct NormalizedEvent *events = malloc((song->numEvents + 1) * sizeof(*events));
+    
+    for (unsigned int i = 0; i < song->numEvents; i++)
+    {
+        const struct MidiEvent *event = &song->events[i];
+        struct NormalizedEvent *norm = &events[i];
+        
+        norm->time = (uint64_t)event->tick * otherTicksPerQNote;
+        norm->tick = event->tick;
+        norm->tempo = event->tempo;
+        norm->data1 = event->data1;
+        norm->data2 = event->data2;
+        if (event->status == 0xFF)
+        {
+            norm->type = 0xFF;
+            norm->channel = 0;
+            continue;
+        }
+        norm->type = event->status & 0xF0;
+        norm->channel = event->status & 0x0F;
+        if (norm->type == 0x90 && norm->data2 == 0)
+            norm->type = 0x80;
+        if (norm->type == 0x80)
+            norm->data2 = 0;  // Release velocity doesn't matter
+    }
+    qsort(events, song->numEvents, sizeof(*events), compare_normalized_events);
+    return events;
+}
+
+static void print_normalized_event(const char *filename, const struct NormalizedEvent *event)
+{
+    printf("only in %s: tick %u, ", filename, event->tick);
+    switch (event->type)
+    {
+    case 0x80: printf("channel %u note off %u\n", event->channel, event->data1); break;
+    case 0x90: printf("channel %u note on %u velocity %u\n", event->channel, event->data1, event->data2); break;
+    case 0xB0: printf("channel %u controller %u = %u\n", event->channel, event->data1, event->data2); break;
+    case 0xC0: printf("channel %u program %u\n", event->channel, event->data1); break;
+    case 0xE0: printf("channel %u pitch bend %u\n", event->channel, event->data1 | (event->data2 << 7)); break;
+    case 0xFF: printf("tempo %u\n", event->tempo); break;
+    default:   printf("channel %u event 0x%02X %u %u\n", event->channel, event->type, event->data1, event->data2);
+    }
+}
+
+// Returns true if the two songs are equivalent
+static bool verify_songs(const char *filename1, const char *filename2)
+{
+    struct MidiSong song1;
+    struct MidiSong song2;
+    struct NormalizedEvent *events1;
+    struct NormalizedEvent *events2;
+    unsigned int i = 0;
+    unsigned int j = 0;
+    unsigned long int numDifferences = 0;
+    
+    load_song(filename1, &song1);
+    load_song(filename2, &song2);
+    events1 = normalize_song(&song1, song2.ticksPerQNote);
+    events2 = normalize_song(&song2, song1.ticksPerQNote);
+    
+    // Both lists are sorted, so walk them together
+    while (i < song1.numEvents || j < song2.numEvents)
+    {
+        int cmp;
+        
+        if (i == song1.numEvents)
+            cmp = 1;
+        else if (j == song2.numEvents)
+            cmp = -1;
+        else
+            cmp = compare_normalized_events(&events1[i], &events2[j]);
+        if (cmp == 0)
+        {
+            i++;
+            j++;
+            continue;
+        }
+        if (numDifferences < MAX_REPORTED_DIFFERENCES)
+        {
+            if (cmp < 0)
+                print_normalized_event(filename1, &events1[i]);
+            else
+                print_normalized_event(filename2, &events2[j]);
+        }
+        numDifferences++;
+        if (cmp < 0)
+            i++;
+        else
+            j++;
+    }
+    if (numDifferences > MAX_REPORTED_DIFFERENCES)
+        printf("... and %lu more differences\n", numDifferences - MAX_REPORTED_DIFFERENCES);
+    if (numDifferences == 0)
+        printf("%s and %s are equivalent (%u events)\n", filename1, filename2, song1.numEvents);
+    
+    free(events1);
+    free(events2);
+    free_midi_song(&song1);
+    free_midi_song(&song2);
+    return numDifferences == 0;
+}
+
+//------------------------------------------------------------------------------
+// Instrument Banks
+//------------------------------------------------------------------------------
+
+// Loads the game's own instruments, so that --render can play the sequence with
+// the real samples. An instrument bank (IBNK) maps each BMS program to key and
+// velocity regions, and each region names a wave in a wave system (WSYS). The
+// WSYS says where in the .aw archives the wave's samples are and how they are
+// encoded, usually as AFC ADPCM. The IBNK and WSYS files are expected to have
+// been extracted already (from the game's .baa archive).
+//
+// The waves used by the banks are decoded once when they are loaded, before any
+// conversion runs, so that every sequence converted afterwards (including the
+// ones converted by child processes in watch mode) shares the decoded samples.
+
+#define BANK_INSTRUMENTS 240  // Number of instrument pointers in an IBNK's BANK chunk
+#define PERCUSSION_KEYS 100
+#define MAX_BANK_FILES 16
+#define MAX_DECODE_THREADS 64
+
+enum WaveFormat
+{
+    WAVE_FORMAT_ADPCM4,
+    WAVE_FORMAT_ADPCM2,
+    WAVE_FORMAT_PCM8,
+    WAVE_FORMAT_PCM16,
+};
+
+struct Wave
+{
+    uint16_t id;  // What the velocity regions call this wave
+    uint8_t format;
+    uint8_t key;  // Pitch the sample plays at when it isn't resampled
+    float sampleRate;
+    uint32_t awOffset;  // Location of the encoded samples in the .aw file
+    uint32_t awLength;
+    bool loop;
+    uint32_t loopStart;
+    uint32_t loopEnd;
+    uint32_t numSamples;
+    bool used;  // Whether any loaded instrument refers to this wave
+    const char *archive;  // Name of the .aw file the wave is in
+    float *samples;  // Decoded samples, plus a copy of the last one for interpolation
+    int sampleIndex;  // Index in the SoundFont being exported
+};
+
+struct WaveGroup
+{
+    char archiveName[0x71];  // Name of the .aw file
+    struct Wave *waves;
+    int numWaves;
+};
+
+struct WaveSystem
+{
+    uint32_t id;
+    char *awDir;  // Directory the .aw files are in
+    struct WaveGroup *groups;
+    int numGroups;
+};
+
+struct VelocityRegion
+{
+    uint8_t velocity;  // Highest velocity this region is used for
+    uint16_t wsysId;
+    uint16_t waveId;
+    float volume;
+    float pitch;
+    const struct Wave *wave;
+};
+
+struct KeyRegion
+{
+    uint8_t key;  // Highest key this region is used for, or the key of a percussion sound
+    float volume;
+    float pitch;
+    struct VelocityRegion *velRegions;
+    int numVelRegions;
+};
+
+struct BankInstrument
+{
+    bool percussion;
+    float volume;
+    float pitch;
+    struct KeyRegion *keyRegions;
+    int numKeyRegions;
+};
+
+struct InstrumentBank
+{
+    uint32_t id;
+    struct BankInstrument *instruments[BANK_INSTRUMENTS];
+};
+
+// Reads big-endian values from a bank or wave system file, with bounds checks
+struct BankReader
+{
+    const char *name;
+    const uint8_t *data;
+    unsigned long int size;
+};
+
+static const char *bankFilenames[MAX_BANK_FILES];
+static int numBankFilenames = 0;
+static const char *wsysFilenames[MAX_BANK_FILES];
+static int numWsysFilenames = 0;
+static const char *awDirName = NULL;  // Where the .aw files are, if not next to the WSYS file
+
+static struct InstrumentBank banks[MAX_BANK_FILES];
+static int numBanks = 0;
+static struct WaveSystem waveSystems[MAX_BANK_FILES];
+static int numWaveSystems = 0;
+
+static uint32_t bank_read(const struct BankReader *r, uint32_t offset, int len)
+{
+    uint32_t val = 0;
+    
+    if (offset > r->size || len > r->size - offset)
+        fatal_error("'%s' is truncated or corrupt (offset 0x%X)\n", r->name, (unsigned int)offset);
+    for (int i = 0; i < len; i++)
+        val = (val << 8) | r->data[offset + i];
+    return val;
+}
+
+static float bank_read_float(const struct BankReader *r, uint32_t offset)
+{
+    uint32_t bits = bank_read(r, offset, 4);
+    float val;
+    
+    memcpy(&val, &bits, sizeof(val));
+    return val;
+}
+
+static void bank_expect_magic(const struct BankReader *r, uint32_t offset, const char *magic)
+{
+    if (bank_read(r, offset, 4) != read_be((const uint8_t *)magic, 4))
+        fatal_error("'%s': expected a %s chunk at offset 0x%X\n", r->name, magic, (unsigned int)offset);
+}
+
+static void parse_velocity_regions(const struct BankReader *r, uint32_t countOffset, struct KeyRegion *keyRegion)
+{
+    keyRegion->numVelRegions = bank_read(r, countOffset, 4);
+    if (keyRegion->numVelRegions > 128)
+        fatal_error("'%s' is corrupt (%i velocity regions)\n", r->name, keyRegion->numVelRegions);
+    keyRegion->velRegions = calloc(keyRegion->numVelRegions, sizeof(*keyRegion->velRegions));
+    for (int i = 0; i < keyRegion->numVelRegions; i++)
+    {
+        uint32_t offset = bank_read(r, countOffset + 4 + i * 4, 4);
+        struct VelocityRegion *velRegion = &keyRegion->velRegions[i];
+        
+        velRegion->velocity = bank_read(r, offset, 1);
+        velRegion->wsysId = bank_read(r, offset + 4, 2);
+        velRegion->waveId = bank_read(r, offset + 6, 2);
+        velRegion->volume = bank_read_float(r, offset + 8);
+        velRegion->pitch = bank_read_float(r, offset + 12);
+    }
+}
+
+static struct BankInstrument *parse_instrument(const struct BankReader *r, uint32_t offset)
+{
+    struct BankInstrument *instr = calloc(1, sizeof(*instr));
+    uint32_t magic = bank_read(r, offset, 4);
+    
+    if (magic == read_be((const uint8_t *)"INST", 4))
+    {
+        instr->pitch = bank_read_float(r, offset + 0x08);
+        instr->volume = bank_read_float(r, offset + 0x0C);
+        instr->numKeyRegions = bank_read(r, offset + 0x28, 4);
+        if (instr->numKeyRegions > 128)
+            fatal_error("'%s' is corrupt (%i key regions)\n", r->name, instr->numKeyRegions);
+        instr->keyRegions = calloc(instr->numKeyRegions, sizeof(*instr->keyRegions));
+        for (int i = 0; i < instr->numKeyRegions; i++)
+        {
+            uint32_t regionOffset = bank_read(r, offset + 0x2C + i * 4, 4);
+            
+            instr->keyRegions[i].key = bank_read(r, regionOffset, 1);
+            instr->keyRegions[i].volume = 1;
+            instr->keyRegions[i].pitch = 1;
+            parse_velocity_regions(r, regionOffset + 4, &instr->keyRegions[i]);
+        }
+    }
+    else if (magic == read_be((const uint8_t *)"PER2", 4))
+    {
+        // A drum kit, with a separate sound for each key
+        instr->percussion = true;
+        instr->pitch = 1;
+        instr->volume = 1;
+        instr->keyRegions = calloc(PERCUSSION_KEYS, sizeof(*instr->keyRegions));
+        for (int key = 0; key < PERCUSSION_KEYS; key++)
+        {
+            uint32_t keyOffset = bank_read(r, offset + 0x88 + key * 4, 4);
+            struct KeyRegion *keyRegion;
+            
+            if (keyOffset == 0)
+                continue;
+            keyRegion = &instr->keyRegions[instr->numKeyRegions++];
+            keyRegion->key = key;
+            keyRegion->pitch = bank_read_float(r, keyOffset);
+            keyRegion->volume = bank_read_float(r, keyOffset + 4);
+            parse_velocity_regions(r, keyOffset + 0x10, keyRegion);
+        }
+    }
+    else
+    {
+        fatal_error("'%s': unknown instrument type at offset 0x%X\n", r->name, (unsigned int)offset);
+    }
+    return instr;
+}
+
+static void load_instrument_bank(const char *filename)
+{
+    struct BankReader r;
+    struct InstrumentBank *bank = &banks[numBanks];
+    uint8_t *data = read_file(filename, &r.size);
+    
+    if (data == NULL)
+        fatal_error("failed to open instrument bank '%s': %s\n", filename, strerror(errno));
+    r.name = filename;
+    r.data = data;
+    bank_expect_magic(&r, 0, "IBNK");
+    bank->id = bank_read(&r, 0x08, 4);
+    bank_expect_magic(&r, 0x20, "BANK");
+    for (int i = 0; i < BANK_INSTRUMENTS; i++)
+    {
+        uint32_t offset = bank_read(&r, 0x24 + i * 4, 4);
+        
+        bank->instruments[i] = (offset != 0) ? parse_instrument(&r, offset) : NULL;
+    }
+    numBanks++;
+    free(data);
+}
+
+static void load_wave_system(const char *filename)
+{
+    struct BankReader r;
+    struct WaveSystem *wsys = &waveSystems[numWaveSystems];
+    uint8_t *data = read_file(filename, &r.size);
+    uint32_t winf;
+    uint32_t wbct;
+    
+    if (data == NULL)
+        fatal_error("failed to open wave system '%s': %s\n", filename, strerror(errno));
+    r.name = filename;
+    r.data = data;
+    bank_expect_magic(&r, 0, "WSYS");
+    wsys->id = bank_read(&r, 0x08, 4);
+    winf = bank_read(&r, 0x10, 4);
+    wbct = bank_read(&r, 0x14, 4);
+    if (awDirName != NULL)
+    {
+        wsys->awDir = strdup(awDirName);
+    }
+    else
+    {
+        const char *slash = strrchr(filename, '/');
+        
+        wsys->awDir = (slash != NULL) ? strndup(filename, slash - filename) : strdup(".");
+    }
+    
+    bank_expect_magic(&r, winf, "WINF");
+    wsys->numGroups = bank_read(&r, winf + 4, 4);
+    if (wsys->numGroups > 4096)
+        fatal_error("'%s' is corrupt (%i wave groups)\n", filename, wsys->numGroups);
+    wsys->groups = calloc(wsys->numGroups, sizeof(*wsys->groups));
+    for (int g = 0; g < wsys->numGroups; g++)
+    {
+        struct WaveGroup *group = &wsys->groups[g];
+        uint32_t groupOffset = bank_read(&r, winf + 8 + g * 4, 4);
+        
+        bank_read(&r, groupOffset, 0x74);  // Make sure the name and count are there
+        memcpy(group->archiveName, r.data + groupOffset, 0x70);
+        group->numWaves = bank_read(&r, groupOffset + 0x70, 4);
+        if (group->numWaves > 65536)
+            fatal_error("'%s' is corrupt (%i waves)\n", filename, group->numWaves);
+        group->waves = calloc(group->numWaves, sizeof(*group->waves));
+        for (int i = 0; i < group->numWaves; i++)
+        {
+            struct Wave *wave = &group->waves[i];
+            uint32_t offset = bank_read(&r, groupOffset + 0x74 + i * 4, 4);
+            
+            wave->id = i;
+            wave->archive = group->archiveName;
+            wave->format = bank_read(&r, offset + 0x01, 1);
+            wave->key = bank_read(&r, offset + 0x02, 1);
+            wave->sampleRate = bank_read_float(&r, offset + 0x04);
+            wave->awOffset = bank_read(&r, offset + 0x08, 4);
+            wave->awLength = bank_read(&r, offset + 0x0C, 4);
+            wave->loop = bank_read(&r, offset + 0x10, 4) != 0;
+            wave->loopStart = bank_read(&r, offset + 0x14, 4);
+            wave->loopEnd = bank_read(&r, offset + 0x18, 4);
+            wave->numSamples = bank_read(&r, offset + 0x1C, 4);
+        }
+    }
+    
+    // The wave IDs used by the instruments are in the scene table, which lists
+    // the waves of each group in the same order.
+    if (wbct != 0)
+    {
+        int numScenes;
+        
+        bank_expect_magic(&r, wbct, "WBCT");
+        numScenes = bank_read(&r, wbct + 8, 4);
+        for (int g = 0; g < numScenes && g < wsys->numGroups; g++)
+        {
+            uint32_t scene = bank_read(&r, wbct + 12 + g * 4, 4);
+            uint32_t cdf;
+            int count;
+            
+            bank_expect_magic(&r, scene, "SCNE");
+            cdf = bank_read(&r, scene + 8, 4);
+            bank_expect_magic(&r, cdf, "C-DF");
+            count = bank_read(&r, cdf + 4, 4);
+            for (int i = 0; i < count && i < wsys->groups[g].numWaves; i++)
+            {
+                uint32_t entry = bank_read(&r, cdf + 8 + i * 4, 4);
+                
+                wsys->groups[g].waves[i].id = bank_read(&r, entry + 2, 2);
+            }
+        }
+    }
+    numWaveSystems++;
+    free(data);
+}
+
+static struct Wave *find_wave(uint16_t wsysId, uint16_t waveId)
+{
+    for (int s = 0; s < numWaveSystems; s++)
+    {
+        // If there's only one wave system, it must be the right one
+        if (waveSystems[s].id != wsysId && numWaveSystems > 1)
+            continue;
+        for (int g = 0; g < waveSystems[s].numGroups; g++)
+        {
+            for (int i = 0; i < waveSystems[s].groups[g].numWaves; i++)
+            {
+                if (waveSystems[s].groups[g].waves[i].id == waveId)
+                    return &waveSystems[s].groups[g].waves[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+// Coefficients of AFC's prediction filters, in 5.11 fixed point
+static const int16_t afcCoefs[16][2] =
+{
+    {0, 0}, {2048, 0}, {0, 2048}, {1024, 1024}, {4096, -2048}, {3584, -1536}, {3072, -1024}, {4608, -2560},
+    {4200, -2248}, {4800, -2300}, {5120, -3072}, {2048, -2048}, {1024, -1024}, {-1024, 1024}, {-1024, 0}, {-2048, 0},
+};
+
+// Decodes AFC ADPCM, which stores 16 samples per frame as a header byte (scale and
+// filter) followed by 4-bit or 2-bit deltas.
+static void decode_adpcm(const uint8_t *data, unsigned long int size, int bits, float *out, uint32_t numSamples)
+{
+    int frameSize = 1 + 16 * bits / 8;
+    int32_t hist1 = 0;
+    int32_t hist2 = 0;
+    
+    for (uint32_t i = 0; i < numSamples; i += 16)
+    {
+        const uint8_t *frame = data + (i / 16) * frameSize;
+        int32_t scale;
+        const int16_t *coef;
+        int32_t deltas[16];
+        
+        if ((i / 16 + 1) * (unsigned long int)frameSize > size)
+        {
+            // Truncated wave. Leave the rest silent.
+            memset(out + i, 0, (numSamples - i) * sizeof(*out));
+            break;
+        }
+        scale = (1 << (frame[0] >> 4)) * ((bits == 4) ? 1 << 11 : 1 << 13);
+        coef = afcCoefs[frame[0] & 0xF];
+        
+        // Unpacking the deltas doesn't depend on the previous samples, so this
+        // loop vectorizes. The prediction filter below has to run one sample at a time.
+        if (bits == 4)
+        {
+            for (int j = 0; j < 16; j++)
+            {
+                int nibble = (frame[1 + j / 2] >> ((j & 1) ? 0 : 4)) & 0xF;
+                
+                deltas[j] = ((nibble ^ 8) - 8) * scale;
+            }
+        }
+        else
+        {
+            for (int j = 0; j < 16; j++)
+            {
+                int crumb = (frame[1 + j / 4] >> (6 - 2 * (j & 3))) & 3;
+                
+                deltas[j] = ((crumb ^ 2) - 2) * scale;
+            }
+        }
+        for (int j = 0; j < 16 && i + j < numSamples; j++)
+        {
+            int32_t sample = (deltas[j] + coef[0] * hist1 + coef[1] * hist2) >> 11;
+            
+            sample = (sample > 32767) ? 32767 : (sample < -32768) ? -32768 : sample;
+            out[i + j] = sample / 32768.0f;
+            hist2 = hist1;
+            hist1 = sample;
+        }
+    }
+}
+
+static void decode_wave(struct Wave *wave, const uint8_t *aw, unsigned long int awSize, const char *awName)
+{
+    const uint8_t *data = aw + wave->awOffset;
+    unsigned long int size = wave->awLength;
+    
+    if (wave->awOffset > awSize || size > awSize - wave->awOffset)
+        fatal_error("'%s' is too short for wave %i\n", awName, wave->id);
+    if (wave->numSamples > 64 * 1024 * 1024)
+        fatal_error("wave %i in '%s' is too long\n", wave->id, awName);
+    wave->samples = malloc((wave->numSamples + 1) * sizeof(*wave->samples));
+    switch (wave->format)
+    {
+    case WAVE_FORMAT_ADPCM4:
+        decode_adpcm(data, size, 4, wave->samples, wave->numSamples);
+        break;
+    case WAVE_FORMAT_ADPCM2:
+        decode_adpcm(data, size, 2, wave->samples, wave->numSamples);
+        break;
+    case WAVE_FORMAT_PCM8:
+        for (uint32_t i = 0; i < wave->numSamples; i++)
+            wave->samples[i] = (i < size) ? (int8_t)data[i] / 128.0f : 0;
+        break;
+    case WAVE_FORMAT_PCM16:
+        for (uint32_t i = 0; i < wave->numSamples; i++)
+            wave->samples[i] = (i * 2 + 1 < size) ? (int16_t)((data[i * 2] << 8) | data[i * 2 + 1]) / 32768.0f : 0;
+        break;
+    default:
+        fatal_error("wave %i in '%s' has unknown format %i\n", wave->id, awName, wave->format);
+    }
+    wave->samples[wave->numSamples] = (wave->numSamples != 0) ? wave->samples[wave->numSamples - 1] : 0;
+    if (wave->loopEnd > wave->numSamples || wave->loopStart >= wave->loopEnd)
+        wave->loop = false;
+}
+
+// Decodes the used waves of one .aw archive. This runs on several threads at once,
+// so it may only touch the group it is given.
+static void decode_wave_group(const struct WaveSystem *wsys, struct WaveGroup *group)
+{
+    char *awPath = NULL;
+    uint8_t *aw = NULL;
+    unsigned long int awSize = 0;
+    
+    for (int i = 0; i < group->numWaves; i++)
+    {
+        if (!group->waves[i].used || group->waves[i].samples != NULL)
+            continue;
+        if (aw == NULL)
+        {
+            awPath = malloc(strlen(wsys->awDir) + strlen(group->archiveName) + 2);
+            sprintf(awPath, "%s/%s", wsys->awDir, group->archiveName);
+            aw = read_file(awPath, &awSize);
+            if (aw == NULL)
+                fatal_error("failed to open wave archive '%s': %s\n", awPath, strerror(errno));
+        }
+        decode_wave(&group->waves[i], aw, awSize, awPath);
+    }
+    free(aw);
+    free(awPath);
+}
+
+// Wave archives are decoded by a pool of threads, which take the next group
+// from a shared counter until there are none left.
+static pthread_mutex_t decodeMutex = PTHREAD_MUTEX_INITIALIZER;
+static int nextDecodeSystem;
+static int nextDecodeGroup;
+
+static void *decode_thread(void *arg)
+{
+    int tid = (int)(intptr_t)arg;
+    
+    while (true)
+    {
+        int s;
+        int g;
+        
+        pthread_mutex_lock(&decodeMutex);
+        while (nextDecodeSystem < numWaveSystems && nextDecodeGroup >= waveSystems[nextDecodeSystem].numGroups)
+        {
+            nextDecodeSystem++;
+            nextDecodeGroup = 0;
+        }
+        s = nextDecodeSystem;
+        g = nextDecodeGroup++;
+        pthread_mutex_unlock(&decodeMutex);
+        int span;
+        
+        if (s >= numWaveSystems)
+            return NULL;
+        span = trace_begin(tid, "wave", "%s", waveSystems[s].groups[g].archiveName);
+        decode_wave_group(&waveSystems[s], &waveSystems[s].groups[g]);
+        trace_end(span);
+    }
+}
+
+static void decode_all_wave_groups(void)
+{
+    pthread_t threads[MAX_DECODE_THREADS];
+    long int numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int numGroups = 0;
+    
+    for (int s = 0; s < numWaveSystems; s++)
+        numGroups += waveSystems[s].numGroups;
+    if (numThreads > numGroups)
+        numThreads = numGroups;
+    if (numThreads > MAX_DECODE_THREADS)
+        numThreads = MAX_DECODE_THREADS;
+    if (numThreads < 1)
+        numThreads = 1;
+    nextDecodeSystem = 0;
+    nextDecodeGroup = 0;
+    for (int i = 0; i < numThreads; i++)
+    {
+        if (pthread_create(&threads[i], NULL, decode_thread, (void *)(intptr_t)(i + 1)) != 0)
+            fatal_error("failed to start decoding thread\n");
+    }
+    for (int i = 0; i < numThreads; i++)
+        pthread_join(threads[i], NULL);
+}
+
+// Loads the banks and wave systems named on the command line, and finds the waves the banks use
+static void load_bank_files(void)
+{
+    for (int i = 0; i < numWsysFilenames; i++)
+        load_wave_system(wsysFilenames[i]);
+    for (int i = 0; i < numBankFilenames; i++)
+        load_instrument_bank(bankFilenames[i]);
+    
+    for (int b = 0; b < numBanks; b++)
+    {
+        for (int i = 0; i < BANK_INSTRUMENTS; i++)
+        {
+            struct BankInstrument *instr = banks[b].instruments[i];
+            
+            for (int k = 0; instr != NULL && k < instr->numKeyRegions; k++)
+            {
+                for (int v = 0; v < instr->keyRegions[k].numVelRegions; v++)
+                {
+                    struct VelocityRegion *velRegion = &instr->keyRegions[k].velRegions[v];
+                    struct Wave *wave = find_wave(velRegion->wsysId, velRegion->waveId);
+                    
+                    if (wave != NULL)
+                        wave->used = true;
+                    velRegion->wave = wave;
+                }
+            }
+        }
+    }
+}
+
+// Loads the banks and decodes every wave they use
+static void load_banks(void)
+{
+    load_bank_files();
+    decode_all_wave_groups();
+}
+
+// Finds the region of the bank that plays a note. Returns NULL if the bank has
+// no sample for it.
+static const struct VelocityRegion *find_bank_region(int bankId, int program, int key, int velocity,
+  const struct BankInstrument **instrOut, const struct KeyRegion **keyRegionOut)
+{
+    const struct InstrumentBank *bank = NULL;
+    const struct BankInstrument *instr;
+    
+    for (int i = 0; i < numBanks; i++)
+    {
+        if (banks[i].id == (uint32_t)bankId || bank == NULL)
+            bank = &banks[i];
+    }
+    if (bank == NULL || program < 0 || program >= BANK_INSTRUMENTS || bank->instruments[program] == NULL)
+        return NULL;
+    instr = bank->instruments[program];
+    for (int k = 0; k < instr->numKeyRegions; k++)
+    {
+        const struct KeyRegion *keyRegion = &instr->keyRegions[k];
+        
+        if (instr->percussion ? keyRegion->key != key : keyRegion->key < key)
+            continue;
+        for (int v = 0; v < keyRegion->numVelRegions; v++)
+        {
+            if (keyRegion->velRegions[v].velocity >= velocity && keyRegion->velRegions[v].wave != NULL)
+            {
+                *instrOut = instr;
+                *keyRegionOut = keyRegion;
+                return &keyRegion->velRegions[v];
+            }
+        }
+        return NULL;
+    }
+    return NULL;
+}
+
+//------------------------------------------------------------------------------
+// Audio Rendering
+//------------------------------------------------------------------------------
+
+// Plays the decoded events through a small wavetable synthesizer and writes the
+// result to a WAV file, so that a conversion can be listened to without a MIDI
+// player. If instrument banks were loaded, notes play the game's own samples.
+// Otherwise, each General MIDI instrument family gets a basic waveform and
+// envelope, which is only meant to make the notes, volumes and panning audible.
+//
+// The tracks are decoded one after another, so the events are collected first and
+// sorted by time. Voices are then rendered in blocks of up to RENDER_BLOCK samples,
+// split at events. The per-sample loops have no branches or calls, so that the
+// compiler can vectorize them when optimizing.
+
+#define RENDER_RATE 32000  // Output rate of the GameCube's audio DSP
+#define RENDER_BLOCK 256
+#define RENDER_TAIL_SECONDS 4  // Longest time to let notes ring out after the last event
+#define RENDER_GAIN 0.2f
+#define WAVE_TABLE_SIZE 2048  // Must be a power of two
+#define MAX_SYNTH_VOICES 64
+
+enum Waveform
+{
+    WAVE_SINE,
+    WAVE_TRIANGLE,
+    WAVE_SQUARE,
+    WAVE_SAW,
+    WAVE_NOISE,
+    NUM_WAVEFORMS
+};
+
+// Sound of each instrument family (program / 8), plus the drum kit
+static const struct
+{
+    enum Waveform wave;
+    float decaySeconds;  // Time for a held note to fade to 1%, or 0 to sustain
+} synthInstruments[17] =
+{
+    {WAVE_TRIANGLE, 1.5f},  // Piano
+    {WAVE_SINE, 0.8f},  // Chromatic Percussion
+    {WAVE_SQUARE, 0.0f},  // Organ
+    {WAVE_SAW, 1.0f},  // Guitar
+    {WAVE_TRIANGLE, 1.2f},  // Bass
+    {WAVE_SAW, 0.0f},  // Strings
+    {WAVE_SAW, 0.0f},  // Ensemble
+    {WAVE_SAW, 0.0f},  // Brass
+    {WAVE_SQUARE, 0.0f},  // Reed
+    {WAVE_SINE, 0.0f},  // Pipe
+    {WAVE_SQUARE, 0.0f},  // Synth Lead
+    {WAVE_TRIANGLE, 0.0f},  // Synth Pad
+    {WAVE_SINE, 2.0f},  // Synth Effects
+    {WAVE_SAW, 1.0f},  // Ethnic
+    {WAVE_SINE, 0.3f},  // Percussive
+    {WAVE_NOISE, 0.5f},  // Sound Effects
+    {WAVE_NOISE, 0.15f},  // Drum Kit (channel 9)
+};
+
+struct RenderEvent
+{
+    uint32_t tick;
+    uint32_t sample;  // Filled in once the events are sorted
+    uint32_t order;  // Keeps events at the same tick in the order they were decoded
+    uint8_t type;
+    uint8_t channel;
+    uint16_t key;  // Track and BMS voice, to match note offs with note ons
+    uint32_t value;  // Pitch, program, bank, volume, pan or microseconds per quarter note
+    uint32_t value2;  // Velocity of a note, or BMS instrument of a program change
+};
+
+struct SynthVoice
+{
+    bool active;
+    bool attacking;
+    bool released;
+    uint8_t channel;
+    uint16_t key;
+    const float *table;
+    float phase;  // Position in the wave table
+    float step;  // Wave table samples per output sample
+    const struct Wave *wave;  // Bank sample to play instead of the wave table, or NULL
+    uint32_t position;  // Whole part of the position in the sample (phase is the fraction)
+    float velocity;
+    float level;  // Envelope level
+    float decay;  // Envelope multiplier per sample while held
+};
+
+// One extra entry at the end of each table, so interpolation never needs to wrap
+static float waveTables[NUM_WAVEFORMS][WAVE_TABLE_SIZE + 1];
+static bool waveTablesBuilt = false;
+
+static struct RenderEvent *renderEvents = NULL;
+static unsigned long int numRenderEvents = 0;
+static unsigned long int renderEventCapacity = 0;
+
+static struct SynthVoice synthVoices[MAX_SYNTH_VOICES];
+static uint8_t channelPrograms[MAX_CHANNELS];
+static uint8_t channelBmsPrograms[MAX_CHANNELS];
+static uint8_t channelBanks[MAX_CHANNELS];
+static uint8_t channelVolumes[MAX_CHANNELS];
+static uint8_t channelPans[MAX_CHANNELS];
+
+static void build_wave_tables(void)
+{
+    const float pi = 3.14159265f;
+    uint32_t noise = 1;
+    
+    for (int i = 0; i < WAVE_TABLE_SIZE; i++)
+    {
+        float x = 2 * pi * i / WAVE_TABLE_SIZE;
+        float square = 0;
+        float saw = 0;
+        
+        // Square and sawtooth are built from their first few harmonics, to keep aliasing down
+        for (int k = 1; k <= 15; k++)
+        {
+            if (k % 2 == 1)
+                square += sinf(k * x) / k;
+            saw += sinf(k * x) / k;
+        }
+        noise ^= noise << 13;
+        noise ^= noise >> 17;
+        noise ^= noise << 5;
+        waveTables[WAVE_SINE][i] = sinf(x);
+        waveTables[WAVE_TRIANGLE][i] = (i < WAVE_TABLE_SIZE / 2) ? 4.0f * i / WAVE_TABLE_SIZE - 1 : 3 - 4.0f * i / WAVE_TABLE_SIZE;
+        waveTables[WAVE_SQUARE][i] = square * 0.8f;
+        waveTables[WAVE_SAW][i] = saw * 0.5f;
+        waveTables[WAVE_NOISE][i] = (float)(noise >> 8) / (1 << 23) - 1;
+    }
+    for (int w = 0; w < NUM_WAVEFORMS; w++)
+        waveTables[w][WAVE_TABLE_SIZE] = waveTables[w][0];
+    waveTablesBuilt = true;
+}
+
+static void render_handle_event(struct EventSink *sink, const struct Event *event)
+{
+    struct RenderEvent *r;
+    
+    (void)sink;
+    switch (event->type)
+    {
+    case EVENT_NOTE_ON:
+    case EVENT_NOTE_OFF:
+    case EVENT_BANK:
+    case EVENT_PROGRAM:
+    case EVENT_VOLUME:
+    case EVENT_PAN:
+        if (event->channel < 0 || event->channel >= MAX_CHANNELS)
+            return;
+        break;
+    case EVENT_TEMPO:
+        break;
+    default:
+        return;
+    }
+    if (numRenderEvents == renderEventCapacity)
+    {
+        unsigned long int capacity = (renderEventCapacity != 0) ? renderEventCapacity * 2 : 1024;
+        
+        renderEvents = budget_realloc(renderEvents, renderEventCapacity * sizeof(*renderEvents), capacity * sizeof(*renderEvents));
+        renderEventCapacity = capacity;
+    }
+    r = &renderEvents[numRenderEvents];
+    r->tick = event->tick;
+    r->sample = 0;
+    r->order = numRenderEvents;
+    r->type = event->type;
+    r->channel = (event->channel >= 0) ? event->channel : 0;
+    r->key = event->track * 8 + ((event->type == EVENT_NOTE_ON || event->type == EVENT_NOTE_OFF) ? event->operands[2] & 7 : 0);
+    r->value = (event->type == EVENT_TEMPO) ? event->operands[1] : event->operands[0];
+    r->value2 = (event->type == EVENT_NOTE_ON || event->type == EVENT_PROGRAM) ? event->operands[1] : 0;
+    numRenderEvents++;
+}
+
+static int compare_render_events(const void *a, const void *b)
+{
+    const struct RenderEvent *e1 = a;
+    const struct RenderEvent *e2 = b;
+    
+    if (e1->tick != e2->tick)
+        return (e1->tick < e2->tick) ? -1 : 1;
+    return (e1->order < e2->order) ? -1 : (e1->order > e2->order);
+}
+
+static void synth_note_on(const struct RenderEvent *event)
+{
+    struct SynthVoice *voice = &synthVoices[0];
+    int family = (event->channel == 9) ? 16 : channelPrograms[event->channel] / 8;
+    
+    const struct BankInstrument *instr = NULL;
+    const struct KeyRegion *keyRegion = NULL;
+    const struct VelocityRegion *velRegion = NULL;
+    
+    if (event->value2 == 0)
+        return;
+    if (numBanks != 0)
+    {
+        // Undo the drum pitch adjustment made by event_note_on
+        int key = event->value + (event->channel == 9);
+        
+        velRegion = find_bank_region(channelBanks[event->channel], channelBmsPrograms[event->channel],
+          key, event->value2, &instr, &keyRegion);
+    }
+    // Use a free voice, or take over the quietest one
+    for (int i = 0; i < MAX_SYNTH_VOICES; i++)
+    {
+        if (!synthVoices[i].active)
+        {
+            voice = &synthVoices[i];
+            break;
+        }
+        if (synthVoices[i].level < voice->level)
+            voice = &synthVoices[i];
+    }
+    voice->active = true;
+    voice->attacking = true;
+    voice->released = false;
+    voice->channel = event->channel;
+    voice->key = event->key;
+    voice->table = waveTables[synthInstruments[family].wave];
+    voice->phase = 0;
+    voice->step = 440.0f * powf(2.0f, (event->value - 69.0f) / 12) * WAVE_TABLE_SIZE / RENDER_RATE;
+    voice->velocity = event->value2 / 127.0f;
+    voice->level = 0;
+    if (synthInstruments[family].decaySeconds > 0)
+        voice->decay = powf(0.01f, 1.0f / (synthInstruments[family].decaySeconds * RENDER_RATE));
+    else
+        voice->decay = 1;
+    voice->wave = NULL;
+    if (velRegion != NULL)
+    {
+        const struct Wave *wave = velRegion->wave;
+        float pitch = instr->pitch * keyRegion->pitch * velRegion->pitch;
+        
+        // Drum sounds play at their recorded pitch
+        if (!instr->percussion)
+            pitch *= powf(2.0f, ((int)event->value - wave->key) / 12.0f);
+        if (!(wave->sampleRate / RENDER_RATE * pitch > 0 && wave->sampleRate / RENDER_RATE * pitch < 64))
+            return;  // Bad pitch or sample rate. Play the wave table instead.
+        voice->wave = wave;
+        voice->position = 0;
+        voice->step = wave->sampleRate / RENDER_RATE * pitch;
+        voice->velocity *= instr->volume * keyRegion->volume * velRegion->volume;
+        voice->decay = 1;  // The sample itself fades out, unless it loops
+    }
+}
+
+static void synth_note_off(const struct RenderEvent *event)
+{
+    for (int i = 0; i < MAX_SYNTH_VOICES; i++)
+    {
+        if (synthVoices[i].active && !synthVoices[i].released && synthVoices[i].key == event->key)
+        {
+            synthVoices[i].released = true;
+            synthVoices[i].attacking = false;
+            synthVoices[i].decay = powf(0.01f, 1.0f / (0.1f * RENDER_RATE));  // 100 ms release
+            return;
+        }
+    }
+}
+
+// Adds count samples of a bank sample to the left and right mix buffers. The
+// envelope goes from start in steps of slope.
+static void render_sample(struct SynthVoice *voice, float *restrict left, float *restrict right, int count,
+  float start, float slope, float gainL, float gainR)
+{
+    const struct Wave *wave = voice->wave;
+    uint32_t end = wave->loop ? wave->loopEnd : wave->numSamples;
+    int done = 0;
+    
+    while (done < count)
+    {
+        const float *restrict samples;
+        float phase = voice->phase;
+        float step = voice->step;
+        int run;
+        int advance;
+        
+        // Play up to the end of the sample or loop without checking for it in the loop below
+        if (voice->position >= end)
+        {
+            if (!wave->loop)
+            {
+                voice->active = false;
+                return;
+            }
+            voice->position -= wave->loopEnd - wave->loopStart;
+            continue;
+        }
+        run = ceilf((end - voice->position - phase) / step);
+        if (run > count - done)
+            run = count - done;
+        if (run < 1)
+            run = 1;
+        samples = wave->samples + voice->position;
+        for (int i = 0; i < run; i++)
+        {
+            float pos = phase + step * i;
+            int index = (int)pos;
+            float frac = pos - index;
+            float sample = samples[index] + (samples[index + 1] - samples[index]) * frac;
+            float level = start + slope * (done + i);
+            
+            left[done + i] += sample * level * gainL;
+            right[done + i] += sample * level * gainR;
+        }
+        phase += step * run;
+        advance = (int)phase;
+        voice->position += advance;
+        voice->phase = phase - advance;
+        done += run;
+    }
+}
+
+// Adds count samples of a voice to the left and right mix buffers
+static void render_voice(struct SynthVoice *voice, float *restrict left, float *restrict right, int count)
+{
+    const float *restrict table = voice->table;
+    float volume = channelVolumes[voice->channel] / 127.0f;
+    float pan = channelPans[voice->channel] / 127.0f;
+    float gain = voice->velocity * volume * volume * RENDER_GAIN;
+    float gainL = gain * sqrtf(1 - pan);
+    float gainR = gain * sqrtf(pan);
+    float start = voice->level;
+    float end;
+    float slope;
+    float phase = voice->phase;
+    float step = voice->step;
+    
+    // The envelope is a straight line across the block, from its level at the
+    // start to its level at the end. Attacks take 5 ms.
+    if (voice->attacking)
+    {
+        end = start + count / (0.005f * RENDER_RATE);
+        if (end >= 1)
+        {
+            end = 1;
+            voice->attacking = false;
+        }
+    }
+    else
+    {
+        end = start * powf(voice->decay, count);
+    }
+    slope = (end - start) / count;
+    
+    if (voice->wave != NULL)
+    {
+        voice->level = end;
+        render_sample(voice, left, right, count, start, slope, gainL, gainR);
+        if (end < 0.0001f && !voice->attacking)
+            voice->active = false;
+        return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        float pos = phase + step * i;
+        int index = (int)pos;
+        float frac = pos - index;
+        float sample;
+        float level = start + slope * i;
+        
+        index &= WAVE_TABLE_SIZE - 1;
+        sample = table[index] + (table[index + 1] - table[index]) * frac;
+        left[i] += sample * level * gainL;
+        right[i] += sample * level * gainR;
+    }
+    
+    voice->phase = fmodf(phase + step * count, WAVE_TABLE_SIZE);
+    voice->level = end;
+    if (end < 0.0001f && !voice->attacking)
+        voice->active = false;
+}
+
+static void write_le(FILE *file, uint32_t val, int len)
+{
+    for (int i = 0; i < len; i++)
+        fputc((val >> (8 * i)) & 0xFF, file);
+}
+
+// RIFF header for 16-bit stereo PCM
+static void write_wav_header(FILE *file, unsigned long int numSamples)
+{
+    fputs("RIFF", file);
+    write_le(file, 36 + numSamples * 4, 4);
+    fputs("WAVEfmt ", file);
+    write_le(file, 16, 4);  // chunk length
+    write_le(file, 1, 2);  // PCM
+    write_le(file, 2, 2);  // channels
+    write_le(file, RENDER_RATE, 4);
+    write_le(file, RENDER_RATE * 4, 4);  // bytes per second
+    write_le(file, 4, 2);  // bytes per frame
+    write_le(file, 16, 2);  // bits per sample
+    fputs("data", file);
+    write_le(file, numSamples * 4, 4);
+}
+
+static void render_finish(struct EventSink *sink)
+{
+    FILE *file = sink->file;
+    double samplesPerTick;
+    double baseSample = 0;
+    uint32_t baseTick = 0;
+    unsigned long int next = 0;
+    unsigned long int endSample;
+    unsigned long int numSamples = 0;
+    long int headerPos = ftell(file);
+    uint8_t *pending = NULL;
+    unsigned long int pendingCapacity = 0;
+    
+    if (!waveTablesBuilt)
+        build_wave_tables();
+    memset(synthVoices, 0, sizeof(synthVoices));
+    for (int i = 0; i < MAX_CHANNELS; i++)
+    {
+        channelPrograms[i] = 0;
+        channelBmsPrograms[i] = 0;
+        channelBanks[i] = 0;
+        channelVolumes[i] = 100;
+        channelPans[i] = 64;
+    }
+    
+    // Work out when each event happens, following the tempo changes
+    qsort(renderEvents, numRenderEvents, sizeof(*renderEvents), compare_render_events);
+    samplesPerTick = RENDER_RATE * 0.5 / ((ticksPerQNote != 0) ? ticksPerQNote : 120);  // 120 bpm until the first tempo event
+    for (unsigned long int i = 0; i < numRenderEvents; i++)
+    {
+        struct RenderEvent *event = &renderEvents[i];
+        
+        event->sample = baseSample + (event->tick - baseTick) * samplesPerTick;
+        if (event->type == EVENT_TEMPO)
+        {
+            baseSample = event->sample;
+            baseTick = event->tick;
+            samplesPerTick = RENDER_RATE * (event->value / 1000000.0) / ((ticksPerQNote != 0) ? ticksPerQNote : 120);
+        }
+    }
+    endSample = (numRenderEvents != 0) ? renderEvents[numRenderEvents - 1].sample : 0;
+    endSample += RENDER_TAIL_SECONDS * RENDER_RATE;
+    
+    // Each block goes straight to the file, and the sizes in the header are filled
+    // in at the end. Output that can't seek back to the header (a pipe) is kept
+    // until then instead.
+    if (headerPos >= 0)
+        write_wav_header(file, 0);
+    while (numSamples < endSample)
+    {
+        float left[RENDER_BLOCK] = {0};
+        float right[RENDER_BLOCK] = {0};
+        uint8_t block[RENDER_BLOCK * 4];
+        int count = RENDER_BLOCK;
+        bool anyActive = false;
+        
+        while (next < numRenderEvents && renderEvents[next].sample <= numSamples)
+        {
+            const struct RenderEvent *event = &renderEvents[next++];
+            
+            switch (event->type)
+            {
+            case EVENT_NOTE_ON:
+                synth_note_on(event);
+                break;
+            case EVENT_NOTE_OFF:
+                synth_note_off(event);
+                break;
+            case EVENT_BANK:
+                channelBanks[event->channel] = event->value;
+                break;
+            case EVENT_PROGRAM:
+                channelPrograms[event->channel] = event->value & 0x7F;
+                channelBmsPrograms[event->channel] = event->value2;
+                break;
+            case EVENT_VOLUME:
+                channelVolumes[event->channel] = event->value & 0x7F;
+                break;
+            case EVENT_PAN:
+                channelPans[event->channel] = event->value & 0x7F;
+                break;
+            default:
+                break;
+            }
+        }
+        if (next < numRenderEvents && renderEvents[next].sample - numSamples < (unsigned long int)count)
+            count = renderEvents[next].sample - numSamples;
+        
+        for (int i = 0; i < MAX_SYNTH_VOICES; i++)
+        {
+            if (synthVoices[i].active)
+            {
+                render_voice(&synthVoices[i], left, right, count);
+                anyActive = true;
+            }
+        }
+        // Stop once everything has finished ringing out
+        if (!anyActive && next == numRenderEvents)
+            break;
+        
+        for (int i = 0; i < count; i++)
+        {
+            float l = left[i] * 32767;
+            float r = right[i] * 32767;
+            
+            l = (l > 32767) ? 32767 : l;
+            l = (l < -32768) ? -32768 : l;
+            r = (r > 32767) ? 32767 : r;
+            r = (r < -32768) ? -32768 : r;
+            block[i * 4] = (uint16_t)(int16_t)l & 0xFF;
+            block[i * 4 + 1] = (uint16_t)(int16_t)l >> 8;
+            block[i * 4 + 2] = (uint16_t)(int16_t)r & 0xFF;
+            block[i * 4 + 3] = (uint16_t)(int16_t)r >> 8;
+        }
+        if (headerPos >= 0)
+        {
+            fwrite(block, 4, count, file);
+        }
+        else
+        {
+            if ((numSamples + count) * 4 > pendingCapacity)
+            {
+                unsigned long int newCapacity = pendingCapacity * 2 + sizeof(block) * 64;
+                
+                pending = budget_realloc(pending, pendingCapacity, newCapacity);
+                pendingCapacity = newCapacity;
+            }
+            memcpy(pending + numSamples * 4, block, count * 4);
+        }
+        numSamples += count;
+    }
+    
+    if (headerPos >= 0)
+    {
+        fseek(file, headerPos, SEEK_SET);
+        write_wav_header(file, numSamples);
+        fseek(file, 0, SEEK_END);
+    }
+    else
+    {
+        write_wav_header(file, numSamples);
+        fwrite(pending, 4, numSamples, file);
+        budget_free(pending, pendingCapacity);
+    }
+    
+    budget_free(renderEvents, renderEventCapacity * sizeof(*renderEvents));
+    renderEvents = NULL;
+    numRenderEvents = 0;
+    renderEventCapacity = 0;
+}
+
+static struct EventSink renderSink = {render_handle_event, render_finish, NULL, 0};
+
+//------------------------------------------------------------------------------
+// Fixture Generation
+//------------------------------------------------------------------------------
+
+// Generates synthetic BMS files that use most of the events the decoder knows
+// about, for the regression check. The same seed always gives the same file.
+
+#define FIXTURE_MAX_TRACKS 8
+#define FIXTURE_SUBROUTINES 4
+#define FIXTURE_SUB_VOICE 7  // Subroutines only use this voice, so they never disturb the track's notes
+
+struct ByteBuffer
+{
+    uint8_t *data;
+    unsigned long int length;
+    unsigned long int capacity;
+};
+
+static uint32_t fixtureRandState;
+
+static uint32_t fixture_rand(uint32_t n)
+{
+    // xorshift32
+    fixtureRandState ^= fixtureRandState << 13;
+    fixtureRandState ^= fixtureRandState >> 17;
+    fixtureRandState ^= fixtureRandState << 5;
+    return fixtureRandState % n;
+}
+
+static void buf_put(struct ByteBuffer *buf, int len, ...)
+{
+    va_list args;
+    
+    if (buf->length + len > buf->capacity)
+    {
+        buf->capacity = (buf->capacity != 0) ? buf->capacity * 2 + len : 256;
+        buf->data = realloc(buf->data, buf->capacity);
+    }
+    va_start(args, len);
+    for (int i = 0; i < len; i++)
+        buf->data[buf->length++] = va_arg(args, int);
+    va_end(args);
+}
+
+static void buf_put_u32(struct ByteBuffer *buf, uint32_t val)
+{
+    buf_put(buf, 4, val >> 24, (val >> 16) & 0xFF, (val >> 8) & 0xFF, val & 0xFF);
+}
+
+// Events that the decoder doesn't understand, but knows the length of
+static void fixture_unknown_event(struct ByteBuffer *buf)
+{
+    static const struct { uint8_t opcode; uint8_t length; } unknownEvents[] =
+    {
+        {0x9E, 2}, {0xCC, 2}, {0xAD, 3}, {0xD6, 1}, {0xF4, 1}, {0x98, 2}, {0xE6, 2}, {0xE7, 2}, {0xCB, 7},
+    };
+    int i = fixture_rand(ARRAY_LENGTH(unknownEvents));
+    
+    buf_put(buf, 1, unknownEvents[i].opcode);
+    for (int j = 0; j < unknownEvents[i].length; j++)
+        buf_put(buf, 1, fixture_rand(128));
+}
+
+static void generate_fixture(uint32_t seed, const char *filename)
+{
+    struct ByteBuffer bms = {NULL, 0, 0};
+    int numTracks;
+    int drumTrack;
+    uint32_t subOffsets[FIXTURE_SUBROUTINES];
+    unsigned long int trackOffsetPos;
+    FILE *file;
+    
+    fixtureRandState = seed * 2654435761u + 1;
+    numTracks = 1 + fixture_rand(FIXTURE_MAX_TRACKS);
+    drumTrack = (fixture_rand(2) == 0) ? (int)fixture_rand(numTracks) : -1;
+    
+    // Meta track. The tracks are started before any delays, so none of the delay carries over into them.
+    buf_put(&bms, 3, 0xFE, 0, 48 * (1 + fixture_rand(4)));
+    buf_put(&bms, 3, 0xFD, 0, 60 + fixture_rand(120));
+    trackOffsetPos = bms.length;
+    for (int i = 0; i < numTracks; i++)
+        buf_put(&bms, 5, 0xC1, i, 0, 0, 0);  // Offsets are filled in below
+    buf_put(&bms, 2, 0x80, 1 + fixture_rand(255));
+    buf_put(&bms, 3, 0xFD, 0, 60 + fixture_rand(120));
+    buf_put(&bms, 1, 0xFF);
+    
+    // Subroutines. Each one may call one of the earlier ones.
+    for (int i = 0; i < FIXTURE_SUBROUTINES; i++)
+    {
+        int numNotes = 1 + fixture_rand(4);
+        
+        subOffsets[i] = bms.length;
+        for (int j = 0; j < numNotes; j++)
+        {
+            buf_put(&bms, 3, fixture_rand(128), FIXTURE_SUB_VOICE, 1 + fixture_rand(127));
+            buf_put(&bms, 2, 0x80, 1 + fixture_rand(96));
+            buf_put(&bms, 1, 0x80 + FIXTURE_SUB_VOICE);
+        }
+        if (i > 0 && fixture_rand(2) == 0)
+        {
+            buf_put(&bms, 1, 0xC4);
+            buf_put_u32(&bms, subOffsets[fixture_rand(i)]);
+        }
+        buf_put(&bms, 1, 0xC6);
+    }
+    
+    // Tracks
+    for (int i = 0; i < numTracks; i++)
+    {
+        int numEvents = 16 + fixture_rand(512);
+        int heldPitch[FIXTURE_SUB_VOICE];
+        unsigned long int offset = bms.length;
+        
+        bms.data[trackOffsetPos + i * 5 + 2] = offset >> 16;
+        bms.data[trackOffsetPos + i * 5 + 3] = offset >> 8;
+        bms.data[trackOffsetPos + i * 5 + 4] = offset;
+        for (int v = 0; v < FIXTURE_SUB_VOICE; v++)
+            heldPitch[v] = -1;
+        
+        buf_put(&bms, 3, 0xA4, 0x20, fixture_rand(4));
+        buf_put(&bms, 3, 0xA4, 0x21, (i == drumTrack) ? 128 : fixture_rand(128));
+        buf_put(&bms, 4, 0x9C, 0x00, fixture_rand(128), fixture_rand(256));
+        buf_put(&bms, 4, 0x9A, 0x03, fixture_rand(128), fixture_rand(256));
+        for (int j = 0; j < numEvents; j++)
+        {
+            int voice = 1 + fixture_rand(FIXTURE_SUB_VOICE - 1);
+            
+            switch (fixture_rand(16))
+            {
+            case 0: case 1: case 2: case 3: case 4:
+                if (heldPitch[voice] == -1)
+                {
+                    heldPitch[voice] = fixture_rand(128);
+                    buf_put(&bms, 3, heldPitch[voice], voice, 1 + fixture_rand(127));
+                }
+                else
+                {
+                    buf_put(&bms, 1, 0x80 + voice);
+                    heldPitch[voice] = -1;
+                }
+                break;
+            case 5: case 6: case 7:
+                buf_put(&bms, 2, 0x80, fixture_rand(256));
+                break;
+            case 8:
+                buf_put(&bms, 3, 0x88, fixture_rand(4), fixture_rand(256));
+                break;
+            case 9:
+                buf_put(&bms, 1, 0xC4);
+                buf_put_u32(&bms, subOffsets[fixture_rand(FIXTURE_SUBROUTINES)]);
+                break;
+            case 10:
+                buf_put(&bms, 4, 0x9C, 0x00, fixture_rand(128), fixture_rand(256));
+                break;
+            case 11:
+                buf_put(&bms, 4, 0x9A, 0x03, fixture_rand(128), fixture_rand(256));
+                break;
+            case 12:
+                buf_put(&bms, 4, 0x9C, 0x09, fixture_rand(256), fixture_rand(256));
+                break;
+            case 13:
+                buf_put(&bms, 5, 0xC8, 0, 0, 0, 0);  // Goto, which the decoder ignores
+                break;
+            default:
+                fixture_unknown_event(&bms);
+            }
+        }
+        for (int v = 1; v < FIXTURE_SUB_VOICE; v++)
+        {
+            if (heldPitch[v] != -1)
+                buf_put(&bms, 1, 0x80 + v);
+        }
+        buf_put(&bms, 1, 0xFF);
+    }
+    
+    file = fopen(filename, "wb");
+    if (file == NULL)
+        fatal_error("failed to open output file '%s': %s\n", filename, strerror(errno));
+    fwrite(bms.data, 1, bms.length, file);
+    fclose(file);
+    free(bms.data);
+}
+
+//------------------------------------------------------------------------------
+// SoundFont Export
+//------------------------------------------------------------------------------
+
+// Writes the instruments of the first loaded bank as a SoundFont 2 file, so that
+// the MIDI files bms2mid writes can be played with the game's own sounds. Each
+// BMS program becomes the preset that event_instrument turns it into (through the
+// instrument list, if there is one), and the drum kit becomes bank 128, preset 0.
+
+#define SF2_SAMPLE_PADDING 46  // Silent samples required after each sample
+
+// SoundFont generator numbers
+enum
+{
+    SF2_GEN_COARSE_TUNE = 51,
+    SF2_GEN_FINE_TUNE = 52,
+    SF2_GEN_INSTRUMENT = 41,
+    SF2_GEN_KEY_RANGE = 43,
+    SF2_GEN_VEL_RANGE = 44,
+    SF2_GEN_ATTENUATION = 48,
+    SF2_GEN_SAMPLE_ID = 53,
+    SF2_GEN_SAMPLE_MODES = 54,
+    SF2_GEN_SCALE_TUNING = 56,
+    SF2_GEN_ROOT_KEY = 58,
+};
+
+static void buf_put_le(struct ByteBuffer *buf, uint32_t val, int len)
+{
+    for (int i = 0; i < len; i++)
+        buf_put(buf, 1, (val >> (8 * i)) & 0xFF);
+}
+
+static void buf_put_name(struct ByteBuffer *buf, const char *name)
+{
+    char padded[20] = {0};
+    
+    strncpy(padded, name, sizeof(padded) - 1);
+    for (int i = 0; i < (int)sizeof(padded); i++)
+        buf_put(buf, 1, padded[i]);
+}
+
+static void buf_put_gen(struct ByteBuffer *buf, int oper, int amount)
+{
+    buf_put_le(buf, oper, 2);
+    buf_put_le(buf, (uint16_t)amount, 2);
+}
+
+static void buf_put_range_gen(struct ByteBuffer *buf, int oper, int lo, int hi)
+{
+    buf_put_le(buf, oper, 2);
+    buf_put(buf, 2, lo, hi);
+}
+
+static void write_chunk(FILE *file, const char *id, const struct ByteBuffer *buf)
+{
+    fputs(id, file);
+    write_le(file, buf->length, 4);
+    fwrite(buf->data, 1, buf->length, file);
+}
+
+// Adds the generators of one zone of an SF2 instrument
+static void add_sf2_zone(struct ByteBuffer *igen, const struct BankInstrument *instr, const struct KeyRegion *keyRegion,
+  const struct VelocityRegion *velRegion, int loKey, int hiKey, int loVel, int hiVel)
+{
+    const struct Wave *wave = velRegion->wave;
+    float volume = instr->volume * keyRegion->volume * velRegion->volume;
+    int cents = lroundf(1200 * log2f(instr->pitch * keyRegion->pitch * velRegion->pitch));
+    int attenuation = (volume > 0) ? lroundf(-200 * log10f(volume)) : 1440;  // in centibels
+    
+    attenuation = (attenuation < 0) ? 0 : (attenuation > 1440) ? 1440 : attenuation;
+    cents = (cents < -12000) ? -12000 : (cents > 12000) ? 12000 : cents;
+    // Key and velocity ranges have to come first, and the sample last
+    buf_put_range_gen(igen, SF2_GEN_KEY_RANGE, loKey, hiKey);
+    buf_put_range_gen(igen, SF2_GEN_VEL_RANGE, loVel, hiVel);
+    buf_put_gen(igen, SF2_GEN_ATTENUATION, attenuation);
+    buf_put_gen(igen, SF2_GEN_COARSE_TUNE, cents / 100);
+    buf_put_gen(igen, SF2_GEN_FINE_TUNE, cents % 100);
+    if (instr->percussion)
+        buf_put_gen(igen, SF2_GEN_SCALE_TUNING, 0);  // Drum sounds play at their recorded pitch
+    else
+        buf_put_gen(igen, SF2_GEN_ROOT_KEY, wave->key);
+    buf_put_gen(igen, SF2_GEN_SAMPLE_MODES, wave->loop ? 1 : 0);
+    buf_put_gen(igen, SF2_GEN_SAMPLE_ID, wave->sampleIndex);
+}
+
+static void write_sf2(const char *filename)
+{
+    const struct InstrumentBank *bank = &banks[0];
+    struct ByteBuffer smpl = {NULL, 0, 0};
+    struct ByteBuffer shdr = {NULL, 0, 0};
+    struct ByteBuffer inst = {NULL, 0, 0};
+    struct ByteBuffer ibag = {NULL, 0, 0};
+    struct ByteBuffer igen = {NULL, 0, 0};
+    struct ByteBuffer phdr = {NULL, 0, 0};
+    struct ByteBuffer pbag = {NULL, 0, 0};
+    struct ByteBuffer pgen = {NULL, 0, 0};
+    struct ByteBuffer mod = {NULL, 0, 0};
+    bool presetUsed[129] = {false};
+    int numSamples = 0;
+    int numInstruments = 0;
+    int numPresets = 0;
+    char name[32];
+    unsigned long int infoSize = 4 + 12 + 16 + 16;
+    unsigned long int sdtaSize;
+    unsigned long int pdtaSize;
+    FILE *file;
+    
+    if (numBanks == 0)
+        fatal_error("--sf2 needs an instrument bank (--bank)\n");
+    
+    // Samples
+    for (int s = 0; s < numWaveSystems; s++)
+    {
+        for (int g = 0; g < waveSystems[s].numGroups; g++)
+        {
+            for (int i = 0; i < waveSystems[s].groups[g].numWaves; i++)
+            {
+                struct Wave *wave = &waveSystems[s].groups[g].waves[i];
+                uint32_t start = smpl.length / 2;
+                
+                if (wave->samples == NULL)
+                    continue;
+                for (uint32_t j = 0; j < wave->numSamples; j++)
+                {
+                    float val = wave->samples[j] * 32768;
+                    
+                    val = (val > 32767) ? 32767 : (val < -32768) ? -32768 : val;
+                    buf_put_le(&smpl, (uint16_t)(int16_t)val, 2);
+                }
+                for (int j = 0; j < SF2_SAMPLE_PADDING; j++)
+                    buf_put_le(&smpl, 0, 2);
+                snprintf(name, sizeof(name), "wave %u-%u", (unsigned int)waveSystems[s].id, wave->id);
+                buf_put_name(&shdr, name);
+                buf_put_le(&shdr, start, 4);
+                buf_put_le(&shdr, start + wave->numSamples, 4);
+                buf_put_le(&shdr, start + (wave->loop ? wave->loopStart : 0), 4);
+                buf_put_le(&shdr, start + (wave->loop ? wave->loopEnd : wave->numSamples), 4);
+                buf_put_le(&shdr, lroundf(wave->sampleRate), 4);
+                buf_put(&shdr, 2, wave->key, 0);  // original pitch, pitch correction
+                buf_put_le(&shdr, 0, 2);  // sample link
+                buf_put_le(&shdr, 1, 2);  // mono sample
+                wave->sampleIndex = numSamples++;
+            }
+        }
+    }
+    buf_put_name(&shdr, "EOS");
+    for (int i = 0; i < 46 - 20; i++)
+        buf_put(&shdr, 1, 0);
+    
+    // Instruments and the presets that play them
+    for (int p = 0; p < BANK_INSTRUMENTS; p++)
+    {
+        const struct BankInstrument *instr = bank->instruments[p];
+        int preset = convert_instrument(p);
+        int numZones = 0;
+        
+        if (instr == NULL)
+            continue;
+        if (preset > 128)
+        {
+            fprintf(stderr, "Warning: program %i isn't a MIDI program. Add it to the instrument list to export it.\n", p);
+            continue;
+        }
+        if (presetUsed[preset])
+        {
+            fprintf(stderr, "Warning: program %i uses the same MIDI program as an earlier one, so it isn't exported.\n", p);
+            continue;
+        }
+        
+        snprintf(name, sizeof(name), "program %i", p);
+        buf_put_name(&inst, name);
+        buf_put_le(&inst, ibag.length / 4, 2);
+        for (int k = 0; k < instr->numKeyRegions; k++)
+        {
+            const struct KeyRegion *keyRegion = &instr->keyRegions[k];
+            int loKey;
+            int hiKey;
+            int loVel = 0;
+            
+            if (instr->percussion)
+            {
+                // event_note_on lowers drum notes by one
+                if (keyRegion->key == 0)
+                    continue;
+                loKey = hiKey = keyRegion->key - 1;
+            }
+            else
+            {
+                loKey = (k > 0) ? instr->keyRegions[k - 1].key + 1 : 0;
+                hiKey = (keyRegion->key < 127) ? keyRegion->key : 127;
+                if (loKey > hiKey)
+                    continue;
+            }
+            for (int v = 0; v < keyRegion->numVelRegions; v++)
+            {
+                const struct VelocityRegion *velRegion = &keyRegion->velRegions[v];
+                int hiVel = (velRegion->velocity < 127) ? velRegion->velocity : 127;
+                
+                if (velRegion->wave != NULL && velRegion->wave->samples != NULL && loVel <= hiVel)
+                {
+                    buf_put_le(&ibag, igen.length / 4, 2);
+                    buf_put_le(&ibag, 0, 2);
+                    add_sf2_zone(&igen, instr, keyRegion, velRegion, loKey, hiKey, loVel, hiVel);
+                    numZones++;
+                }
+                loVel = hiVel + 1;
+            }
+        }
+        if (numZones == 0)
+        {
+            // Nothing playable. Take the instrument back out.
+            inst.length -= 22;
+            continue;
+        }
+        
+        presetUsed[preset] = true;
+        snprintf(name, sizeof(name), (preset == 128) ? "drum kit %i" : "program %i", p);
+        buf_put_name(&phdr, name);
+        buf_put_le(&phdr, (preset == 128) ? 0 : preset, 2);
+        buf_put_le(&phdr, (preset == 128) ? 128 : 0, 2);
+        buf_put_le(&phdr, pbag.length / 4, 2);
+        buf_put_le(&phdr, 0, 4);  // library
+        buf_put_le(&phdr, 0, 4);  // genre
+        buf_put_le(&phdr, 0, 4);  // morphology
+        buf_put_le(&pbag, pgen.length / 4, 2);
+        buf_put_le(&pbag, 0, 2);
+        buf_put_gen(&pgen, SF2_GEN_INSTRUMENT, numInstruments);
+        numInstruments++;
+        numPresets++;
+    }
+    
+    // Terminal records
+    buf_put_name(&inst, "EOI");
+    buf_put_le(&inst, ibag.length / 4, 2);
+    buf_put_le(&ibag, igen.length / 4, 2);
+    buf_put_le(&ibag, 0, 2);
+    buf_put_gen(&igen, 0, 0);
+    buf_put_name(&phdr, "EOP");
+    buf_put_le(&phdr, 0, 2);
+    buf_put_le(&phdr, 0, 2);
+    buf_put_le(&phdr, pbag.length / 4, 2);
+    buf_put_le(&phdr, 0, 4);
+    buf_put_le(&phdr, 0, 4);
+    buf_put_le(&phdr, 0, 4);
+    buf_put_le(&pbag, pgen.length / 4, 2);
+    buf_put_le(&pbag, 0, 2);
+    buf_put_gen(&pgen, 0, 0);
+    for (int i = 0; i < 10; i++)
+        buf_put(&mod, 1, 0);  // Empty modulator lists
+    
+    file = fopen(filename, "wb");
+    if (file == NULL)
+        fatal_error("failed to open output file '%s': %s\n", filename, strerror(errno));
+    sdtaSize = 4 + 8 + smpl.length;
+    pdtaSize = 4 + 8 * 9 + phdr.length + pbag.length + mod.length + pgen.length
+      + inst.length + ibag.length + mod.length + igen.length + shdr.length;
+    fputs("RIFF", file);
+    write_le(file, 4 + 8 + infoSize + 8 + sdtaSize + 8 + pdtaSize, 4);
+    fputs("sfbk", file);
+    
+    // INFO list: version 2.01, sound engine and name
+    fputs("LIST", file);
+    write_le(file, infoSize, 4);
+    fputs("INFOifil", file);
+    write_le(file, 4, 4);
+    write_le(file, 2, 2);
+    write_le(file, 1, 2);
+    fputs("isng", file);
+    write_le(file, 8, 4);
+    fwrite("EMU8000\0", 1, 8, file);
+    fputs("INAM", file);
+    write_le(file, 8, 4);
+    fwrite("bms2mid\0", 1, 8, file);
+    
+    fputs("LIST", file);
+    write_le(file, sdtaSize, 4);
+    fputs("sdta", file);
+    write_chunk(file, "smpl", &smpl);
+    
+    fputs("LIST", file);
+    write_le(file, pdtaSize, 4);
+    fputs("pdta", file);
+    write_chunk(file, "phdr", &phdr);
+    write_chunk(file, "pbag", &pbag);
+    write_chunk(file, "pmod", &mod);
+    write_chunk(file, "pgen", &pgen);
+    write_chunk(file, "inst", &inst);
+    write_chunk(file, "ibag", &ibag);
+    write_chunk(file, "imod", &mod);
+    write_chunk(file, "igen", &igen);
+    write_chunk(file, "shdr", &shdr);
+    fclose(file);
+    printf("%i presets, %i samples\n", numPresets, numSamples);
+    
+    free(smpl.data);
+    free(shdr.data);
+    free(inst.data);
+    free(ibag.data);
+    free(igen.data);
+    free(phdr.data);
+    free(pbag.data);
+    free(pgen.data);
+    free(mod.data);
+}
+
+//------------------------------------------------------------------------------
+// In-Memory Conversion
+//------------------------------------------------------------------------------
+
+static void write_midi(FILE *midiFile)
+{
+    // Write header chunk
+    fputs("MThd", midiFile);             // chunk type
+    write_u32(midiFile, 6);              // chunk length
+    write_u16(midiFile, 1);              // format type
+    write_u16(midiFile, numMidiTracks);  // number of tracks
+    write_u16(midiFile, (ticksPerQNote != 0) ? ticksPerQNote : 120);  // ticks per quarter note (default to 120 if not set)
+    
+    // Write tracks
+    for (unsigned int i = 0; i < numMidiTracks; i++)
+    {
+        DEBUG_printf("Track %u: channel %i\n", i, midiTracks[i].channel);
+        fputs("MTrk", midiFile);
+        write_u32(midiFile, midiTracks[i].length);
+        if (midiTracks[i].length != 0)  // An empty track has no buffer
+            fwrite(midiTracks[i].buffer, 1, midiTracks[i].length, midiFile);
+    }
+    DEBUG_printf("%i midi tracks\n", numMidiTracks);
+}
+
+bool bms_convert(const uint8_t *data, unsigned long int size, uint8_t **midiData, unsigned long int *midiSize)
+{
+    jmp_buf handler;
+    char *buffer;
+    size_t length;
+    FILE *midiFile;
+    
+    reset_decoder();
+    budget_start_job();
+    bmsData = data;
+    bmsSize = size;
+    trackCacheEnabled = false;
+    errorMessage[0] = '\0';
+    numSinks = 0;
+    add_sink(&smfSink);
+    if (setjmp(handler) != 0)
+    {
+        errorHandler = NULL;
+        reset_decoder();
+        numSinks = 0;
+        bmsData = NULL;
+        bmsSize = 0;
+        return false;
+    }
+    errorHandler = &handler;
+    read_bms();
+    errorHandler = NULL;
+    
+    midiFile = open_memstream(&buffer, &length);
+    if (midiFile == NULL)
+        fatal_error("open_memstream failed: %s\n", strerror(errno));
+    write_midi(midiFile);
+    fclose(midiFile);
+    *midiData = (uint8_t *)buffer;
+    *midiSize = length;
+    
+    reset_decoder();
+    numSinks = 0;
+    bmsData = NULL;
+    bmsSize = 0;
+    return true;
+}
+
+#ifdef BMS2MID_FUZZ
+// Entry point for libFuzzer (see the bms2mid_fuzz target in the Makefile)
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    uint8_t *midiData;
+    unsigned long int midiSize;
+    
+    if (bms_convert(data, size, &midiData, &midiSize))
+        free(midiData);
+    return 0;
+}
+#endif
+
+//------------------------------------------------------------------------------
+// Command Line Interface
+//------------------------------------------------------------------------------
+
+// Replaces the instrument list with the one in filename. If that fails, the
+// previous list is kept, so that --watch can carry on with it.
+static void load_instrument_list(const char *filename)
+{
+    FILE *convTblFile = fopen(filename, "r");
+    int span = trace_begin(0, "phase", "load instrument list");
+    int *oldList = instrList;
+    int oldCount = instrListCount;
+    char *unknownName;
+    char name[128];
+    
+    if (convTblFile == NULL)
+    {
+        trace_end(span);
+        fatal_error("failed to open instrument conversion file '%s': %s\n", filename, strerror(errno));
+    }
+    instrList = NULL;
+    instrListCount = 0;
+    unknownName = create_instrument_conversion_table(convTblFile);
+    fclose(convTblFile);
+    trace_end(span);
+    if (unknownName != NULL)
+    {
+        snprintf(name, sizeof(name), "%s", unknownName);
+        free(unknownName);
+        free(instrList);
+        instrList = oldList;
+        instrListCount = oldCount;
+        fatal_error("Unknown instrument '%s'\n", name);
+    }
+    free(oldList);
+}
+
+static FILE *open_output(const char *filename)
+{
+    FILE *file;
+    
+    if (strcmp(filename, "-") == 0)
+        return stdout;
+    file = fopen(filename, "wb");
+    if (file == NULL)
+        fatal_error("failed to open output file '%s': %s\n", filename, strerror(errno));
+    return file;
+}
+
+static void close_output(FILE *file)
+{
+    if (file != stdout)
+        fclose(file);
+    else
+        fflush(stdout);
+}
+
+static void add_output_sink(struct EventSink *sink, const char *filename)
+{
+    sink->file = open_output(filename);
+    add_sink(sink);
+}
+
+// Suggests an instrument list for a bank, so that a new game can be converted
+// without mapping all of its instruments by hand. Drum kits become the Drum Kit.
+// Melodic instruments are matched on the name of their wave archive if it says
+// what they are, and otherwise guessed from the pitches their samples were
+// recorded at, whether the samples loop (sustain) and how long they are.
+//
+// This only needs the bank and WSYS files, not the samples. The result is kept
+// in the --cache directory under the hash of those files, so that each game's
+// banks are only classified once.
+
+static const struct
+{
+    const char *keyword;
+    int program;
+} archiveKeywords[] =
+{
+    {"piano", 0}, {"bell", 14}, {"marimba", 12}, {"xylo", 13}, {"vibra", 11}, {"organ", 19},
+    {"guitar", 24}, {"bass", 33}, {"violin", 40}, {"cello", 42}, {"harp", 46}, {"timp", 47},
+    {"string", 48}, {"choir", 52}, {"voice", 52}, {"trumpet", 56}, {"trombone", 57}, {"tuba", 58},
+    {"horn", 60}, {"brass", 61}, {"sax", 65}, {"oboe", 68}, {"clarinet", 71}, {"flute", 73},
+    {"whistle", 78}, {"synth", 80}, {"pad", 88},
+};
+
+// Picks a General MIDI program for an instrument, and describes why
+static int classify_instrument(const struct BankInstrument *instr, char *reason, size_t reasonSize)
+{
+    int numWaves = 0;
+    int keySum = 0;
+    int lowKey = 127;
+    int highKey = 0;
+    bool loops = false;
+    float longest = 0;
+    const char *archive = NULL;
+    int center;
+    
+    if (instr->percussion)
+    {
+        snprintf(reason, reasonSize, "drum kit with %i sounds", instr->numKeyRegions);
+        return 128;
+    }
+    for (int k = 0; k < instr->numKeyRegions; k++)
+    {
+        for (int v = 0; v < instr->keyRegions[k].numVelRegions; v++)
+        {
+            const struct Wave *wave = instr->keyRegions[k].velRegions[v].wave;
+            
+            if (wave == NULL)
+                continue;
+            numWaves++;
+            keySum += wave->key;
+            lowKey = (wave->key < lowKey) ? wave->key : lowKey;
+            highKey = (wave->key > highKey) ? wave->key : highKey;
+            loops |= wave->loop;
+            if (wave->sampleRate > 0 && wave->numSamples / wave->sampleRate > longest)
+                longest = wave->numSamples / wave->sampleRate;
+            archive = wave->archive;
+        }
+    }
+    if (numWaves == 0)
+    {
+        snprintf(reason, reasonSize, "%i key regions, no waves found", instr->numKeyRegions);
+        return 0;
+    }
+    center = keySum / numWaves;
+    snprintf(reason, reasonSize, "recorded at keys %i-%i, %s, up to %.2fs, in '%s'",
+      lowKey, highKey, loops ? "looped" : "one-shot", longest, archive);
+    
+    for (int i = 0; i < (int)ARRAY_LENGTH(archiveKeywords); i++)
+    {
+        char lower[sizeof(((struct WaveGroup *)NULL)->archiveName)];
+        int j;
+        
+        for (j = 0; archive[j] != '\0' && j < (int)sizeof(lower) - 1; j++)
+            lower[j] = tolower((unsigned char)archive[j]);
+        lower[j] = '\0';
+        if (strstr(lower, archiveKeywords[i].keyword) != NULL)
+            return archiveKeywords[i].program;
+    }
+    if (center < 48)
+        return loops ? 38 : 33;  // Synth Bass 1, Fingered Bass
+    if (loops)
+        return (center >= 72) ? 73 : 48;  // Flute, String Ensemble 1
+    if (longest < 0.5f)
+        return (center >= 72) ? 13 : 45;  // Xylophone, Pizzicato Strings
+    return (center >= 72) ? 9 : 0;  // Glockenspiel, Acoustic Grand Piano
+}
+
+// Hash of the bank and WSYS files, which names the cached instrument list
+static uint64_t bank_files_hash(void)
+{
+    uint64_t hash = HASH_INIT;
+    
+    for (int i = 0; i < numBankFilenames + numWsysFilenames; i++)
+    {
+        const char *filename = (i < numBankFilenames) ? bankFilenames[i] : wsysFilenames[i - numBankFilenames];
+        unsigned long int size;
+        uint8_t *data = read_file(filename, &size);
+        
+        if (data == NULL)
+            fatal_error("failed to open '%s': %s\n", filename, strerror(errno));
+        hash = hash_bytes(hash, data, size);
+        free(data);
+    }
+    return hash;
+}
+
+static void generate_instrument_list(const char *filename)
+{
+    char *cachePath = NULL;
+    FILE *file;
+    int lastProgram = -1;
+    
+    if (numBankFilenames == 0)
+        fatal_error("--gen-instrument-list needs an instrument bank (--bank)\n");
+    if (cacheDir != NULL)
+    {
+        unsigned long int size;
+        uint8_t *cached;
+        
+        cachePath = malloc(strlen(cacheDir) + 32);
+        sprintf(cachePath, "%s/%016llx.ins", cacheDir, (unsigned long long)bank_files_hash());
+        cached = read_file(cachePath, &size);
+        if (cached != NULL)
+        {
+            file = open_output(filename);
+            fwrite(cached, 1, size, file);
+            close_output(file);
+            fprintf(stderr, "Using the instrument list cached in '%s'\n", cachePath);
+            free(cached);
+            free(cachePath);
+            return;
+        }
+    }
+    
+    load_bank_files();
+    for (int p = 0; p < BANK_INSTRUMENTS; p++)
+    {
+        if (banks[0].instruments[p] != NULL)
+            lastProgram = p;
+    }
+    file = open_output(filename);
+    for (int p = 0; p <= lastProgram; p++)
+    {
+        const struct BankInstrument *instr = banks[0].instruments[p];
+        char reason[256];
+        int program;
+        
+        if (instr == NULL)
+        {
+            // Unused program. Keep its number, so the lines stay in order.
+            fprintf(file, "%i\n", (p < 128) ? p : 0);
+            continue;
+        }
+        program = classify_instrument(instr, reason, sizeof(reason));
+        fprintf(file, "%s\n", instrNames[program]);
+        fprintf(stderr, "program %3i: %-22s %s\n", p, instrNames[program], reason);
+    }
+    close_output(file);
+    
+    // Cache a copy of what was written
+    if (cachePath != NULL && strcmp(filename, "-") != 0)
+    {
+        unsigned long int size;
+        uint8_t *data = read_file(filename, &size);
+        FILE *cacheFile = fopen(cachePath, "wb");
+        
+        if (data != NULL && cacheFile != NULL)
+            fwrite(data, 1, size, cacheFile);
+        if (cacheFile != NULL)
+            fclose(cacheFile);
+        free(data);
+    }
+    free(cachePath);
+}
+
+// Prints a disassembly of the first count events in a file
+static void print_first_events(const char *bmsFilename, unsigned long int count)
+{
+    unsigned long int size;
+    uint8_t *data = read_file(bmsFilename, &size);
+    struct EventSink printer = {disasm_handle_event, NULL, stdout, 0};
+    struct Event event;
+    
+    if (data == NULL)
+        fatal_error("failed to open input file '%s': %s\n", bmsFilename, strerror(errno));
+    bms_iter_open(data, size);
+    while (printer.count < count && bms_iter_next(&event))
+    {
+        printer.handle_event(&printer, &event);
+        printer.count++;
+    }
+    if (bms_error() != NULL)
+        fatal_error("%s", bms_error());
+    bms_iter_close();
+    free(data);
+}
+
+static void convert_file(const char *bmsFilename, const char *midiFilename)
+{
+    FILE *midiFile;
+    bool cached = false;
+    int span;
+#ifdef __linux__
+    uint64_t eventCacheKey = 0;
+#endif
+    
+    budget_start_job();
+    // Read bms file
+    span = trace_begin(0, "phase", "read input");
+    bmsData = read_file(bmsFilename, &bmsSize);
+    if (bmsData == NULL)
+        fatal_error("failed to open input file '%s': %s\n", bmsFilename, strerror(errno));
+    trace_end(span);
+    
+    // Open midi file
+    midiFile = open_output(midiFilename);
+    
+    if (writeFormat0)
+    {
+        format0Sink.file = midiFile;
+        add_sink(&format0Sink);
+    }
+    else
+    {
+        add_sink(&smfSink);
+    }
+    if (eventsFilename != NULL)
+    {
+        size_t len = strlen(eventsFilename);
+        
+        if (len > 4 && strcmp(eventsFilename + len - 4, ".csv") == 0)
+            add_output_sink(&csvSink, eventsFilename);
+        else
+            add_output_sink(&jsonSink, eventsFilename);
+    }
+    if (statsFilename != NULL)
+    {
+        stats_reset();
+        add_output_sink(&statsSink, statsFilename);
+    }
+    if (disasmFilename != NULL)
+        add_output_sink(&disasmSink, disasmFilename);
+    if (renderFilename != NULL)
+        add_output_sink(&renderSink, renderFilename);
+    
+    span = trace_begin(0, "phase", "decode");
+#ifdef __linux__
+    if (eventCacheDir != NULL)
+    {
+        eventCacheKey = event_cache_key();
+        cached = event_cache_replay(eventCacheKey);
+        // Recording the events also turns the track cache off, since it only works with one sink
+        if (!cached)
+            add_sink(&eventCacheSink);
+    }
+#endif
+    
+    if (cached)
+    {
+        // The events have already been sent to the sinks
+    }
+    else if (writeFormat0)
+    {
+        // Tracks aren't kept, so there's nothing to cache
+        interleaveTracks = true;
+        begin_interleaved_decode();
+        while (interleave_step())
+            ;
+        interleaveTracks = false;
+    }
+    else
+    {
+        track_cache_load(bmsFilename);
+        read_bms();
+        track_cache_save(bmsFilename);
+    }
+#ifdef __linux__
+    if (eventCacheDir != NULL && !cached)
+    {
+        write_event_cache(eventCacheKey);
+        numSinks--;  // eventCacheSink was added last
+    }
+#endif
+    trace_end(span);
+    span = trace_begin(0, "phase", "finish outputs");
+    for (int i = 0; i < numSinks; i++)
+    {
+        if (sinks[i]->finish != NULL)
+            sinks[i]->finish(sinks[i]);
+        if (i != 0)
+            close_output(sinks[i]->file);
+    }
+    numSinks = 0;
+    trace_end(span);
+    
+    // Now, actually write the MIDI file
+    span = trace_begin(0, "phase", "write MIDI");
+    if (!writeFormat0)
+        write_midi(midiFile);
+    close_output(midiFile);
+    trace_end(span);
+    DEBUG_printf("Peak memory: %lu bytes\n", memoryPeak);
+    free((void *)bmsData);
+    bmsData = NULL;
+}
+
+//------------------------------------------------------------------------------
+// Play Mode
+//------------------------------------------------------------------------------
+
+// Plays a sequence in real time by writing raw MIDI messages to a FIFO, a Unix
+// socket or a MIDI device, so it can be heard without converting it first. The
+// tracks are decoded interleaved, and each event is only decoded shortly before
+// it is due, so playback starts right away no matter how long the song is. Each
+// message is sent at an absolute time on the monotonic clock, worked out from the
+// tempo events, so timing errors don't add up over the song.
+
+#ifdef __linux__
+
+#define PLAY_DEFAULT_USEC_PER_QNOTE 500000  // MIDI's default tempo of 120 bpm
+#define PLAY_LATE_NSEC 1000000  // Messages sent later than this are counted as late
+
+static int playFd = -1;
+static struct timespec playStartTime;
+static uint64_t playAnchorNsec;  // Time of playAnchorTick since playStartTime
+static uint32_t playAnchorTick;
+static uint32_t playUsecPerQNote;
+static uint32_t playTicksPerQNote;
+static volatile sig_atomic_t playStopped = 0;
+
+// Scheduling statistics
+static unsigned long int playMessageCount;
+static unsigned long int playLateCount;
+static uint64_t playStartupNsec;  // Time it took to decode the first message
+static uint64_t playTotalJitterNsec;
+static uint64_t playMaxJitterNsec;
+
+static uint64_t timespec_nsec(const struct timespec *ts)
+{
+    return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static uint64_t play_tick_nsec(uint32_t tick)
+{
+    uint32_t ticksPerQNote = (playTicksPerQNote != 0) ? playTicksPerQNote : 1;
+    
+    return playAnchorNsec + (uint64_t)((double)(tick - playAnchorTick) * playUsecPerQNote * 1000 / ticksPerQNote);
+}
+
+// Tempo changes only apply from the tick they happen at
+static void play_set_anchor(uint32_t tick)
+{
+    playAnchorNsec = play_tick_nsec(tick);
+    playAnchorTick = tick;
+}
+
+static void play_write(const uint8_t *msg, int len)
+{
+    if (write(playFd, msg, len) != len)
+        fatal_error("failed to send MIDI data: %s\n", strerror(errno));
+}
+
+static void play_handle_event(struct EventSink *sink, const struct Event *event)
+{
+    uint8_t msg[3];
+    int len;
+    struct timespec deadline;
+    struct timespec now;
+    uint64_t deadlineNsec;
+    uint64_t nowNsec;
+    
+    (void)sink;
+    if (event->type == EVENT_TEMPO)
+    {
+        play_set_anchor(event->tick);
+        playUsecPerQNote = event->operands[1];
+        return;
+    }
+    if (event->type == EVENT_TICKS_PER_QNOTE && playTicksPerQNote == 0)
+    {
+        play_set_anchor(event->tick);
+        playTicksPerQNote = event->operands[0];
+        return;
+    }
+    len = get_channel_message(event, msg);
+    if (len == 0 || event->channel < 0)
+        return;
+    
+    if (playMessageCount == 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        playStartupNsec = timespec_nsec(&now) - timespec_nsec(&playStartTime);
+    }
+    deadlineNsec = timespec_nsec(&playStartTime) + play_tick_nsec(event->tick);
+    deadline.tv_sec = deadlineNsec / 1000000000;
+    deadline.tv_nsec = deadlineNsec % 1000000000;
+    while (!playStopped && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+        ;
+    if (playStopped)
+        return;
+    play_write(msg, len);
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    nowNsec = timespec_nsec(&now);
+    if (nowNsec > deadlineNsec)
+    {
+        playTotalJitterNsec += nowNsec - deadlineNsec;
+        if (nowNsec - deadlineNsec > playMaxJitterNsec)
+            playMaxJitterNsec = nowNsec - deadlineNsec;
+        if (nowNsec - deadlineNsec > PLAY_LATE_NSEC)
+            playLateCount++;
+    }
+    playMessageCount++;
+}
+
+static struct EventSink playSink = {play_handle_event, NULL, NULL, 0};
+
+static void play_stop_handler(int sig)
+{
+    (void)sig;
+    playStopped = 1;
+}
+
+// Opens the file, FIFO or device named by target, or connects to it if it's a Unix socket
+static int open_play_target(const char *target)
+{
+    static const int socketTypes[] = {SOCK_STREAM, SOCK_SEQPACKET, SOCK_DGRAM};
+    struct stat st;
+    struct sockaddr_un addr;
+    int fd;
+    
+    if (strcmp(target, "-") == 0)
+        return STDOUT_FILENO;
+    if (stat(target, &st) != 0 || !S_ISSOCK(st.st_mode))
+    {
+        // Opening a FIFO waits until something opens it for reading
+        fd = open(target, O_WRONLY | O_CREAT, 0666);
+        if (fd < 0)
+            fatal_error("failed to open '%s': %s\n", target, strerror(errno));
+        return fd;
+    }
+    if (strlen(target) >= sizeof(addr.sun_path))
+        fatal_error("socket path '%s' is too long\n", target);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, target);
+    // Try each type of socket until one matches the listener's
+    for (unsigned int i = 0; i < ARRAY_LENGTH(socketTypes); i++)
+    {
+        fd = socket(AF_UNIX, socketTypes[i], 0);
+        if (fd < 0)
+            break;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            return fd;
+        close(fd);
+        if (errno != EPROTOTYPE)
+            break;
+    }
+    fatal_error("failed to connect to '%s': %s\n", target, strerror(errno));
+    return -1;
+}
+
+static void play_file(const char *bmsFilename, const char *target)
+{
+    struct timespec endTime;
+    struct sigaction action;
+    
+    bmsData = read_file(bmsFilename, &bmsSize);
+    if (bmsData == NULL)
+        fatal_error("failed to open input file '%s': %s\n", bmsFilename, strerror(errno));
+    playFd = open_play_target(target);
+    
+    // Stop cleanly on Ctrl-C, and report a reader going away as an error
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = play_stop_handler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    
+    playAnchorNsec = 0;
+    playAnchorTick = 0;
+    playUsecPerQNote = PLAY_DEFAULT_USEC_PER_QNOTE;
+    playTicksPerQNote = 0;
+    playMessageCount = 0;
+    playLateCount = 0;
+    playStartupNsec = 0;
+    playTotalJitterNsec = 0;
+    playMaxJitterNsec = 0;
+    
+    interleaveTracks = true;
+    add_sink(&playSink);
+    clock_gettime(CLOCK_MONOTONIC, &playStartTime);
+    begin_interleaved_decode();
+    while (!playStopped && interleave_step())
+        ;
+    clock_gettime(CLOCK_MONOTONIC, &endTime);
+    numSinks = 0;
+    
+    // Silence any notes that are still on
+    for (int i = 0; i < MAX_CHANNELS; i++)
+    {
+        if (usedChannelMask & (1 << i))
+        {
+            uint8_t msg[3] = {0xB0 + i, 0x7B, 0};  // All Notes Off
+            
+            play_write(msg, sizeof(msg));
+        }
+    }
+    
+    fprintf(stderr, "Played %lu messages in %.1f s (the first was ready after %.0f us)\n",
+      playMessageCount, (timespec_nsec(&endTime) - timespec_nsec(&playStartTime)) / 1e9,
+      playStartupNsec / 1e3);
+    fprintf(stderr, "Scheduling jitter: mean %.0f us, max %.0f us, %lu messages late by more than %i ms\n",
+      (playMessageCount != 0) ? playTotalJitterNsec / 1e3 / playMessageCount : 0.0,
+      playMaxJitterNsec / 1e3, playLateCount, PLAY_LATE_NSEC / 1000000);
+    
+    if (playFd != STDOUT_FILENO)
+        close(playFd);
+    interleaveTracks = false;
+    reset_decoder();
+    free((void *)bmsData);
+    bmsData = NULL;
+}
+
+#endif
+
+//------------------------------------------------------------------------------
+// Metrics
+//------------------------------------------------------------------------------
+
+// With --metrics file, batch and watch mode keep counters and a histogram of
+// the conversions they've run, and write them to file in the Prometheus text
+// format every few seconds, for node_exporter's textfile collector to pick up.
+// The conversions run in forked children, so each child sends the result of
+// each file to the parent through a pipe. The records are smaller than PIPE_BUF,
+// so those from different children never get mixed up. The file is written to a
+// temporary file and renamed over the old one, so it's never seen half written.
+
+#ifdef __linux__
+
+#define METRICS_INTERVAL_MS 5000
+
+enum ErrorKind
+{
+    ERROR_NONE,
+    ERROR_READ,
+    ERROR_WRITE,
+    ERROR_UNHANDLED_OPCODE,
+    ERROR_STACK_LIMIT,
+    ERROR_BAD_RETURN,
+    ERROR_VOICE,
+    ERROR_CHANNELS,
+    ERROR_DRUM_KIT,
+    ERROR_INVALID_VALUE,
+    ERROR_MEMORY,
+    ERROR_CRASH,  // The child died without sending a result
+    ERROR_OTHER,
+    NUM_ERROR_KINDS
+};
+
+static const char *const errorKindNames[] =
+{
+    [ERROR_NONE]             = "none",
+    [ERROR_READ]             = "read",
+    [ERROR_WRITE]            = "write",
+    [ERROR_UNHANDLED_OPCODE] = "unhandled_opcode",
+    [ERROR_STACK_LIMIT]      = "stack_limit",
+    [ERROR_BAD_RETURN]       = "bad_return",
+    [ERROR_VOICE]            = "voice",
+    [ERROR_CHANNELS]         = "channels",
+    [ERROR_DRUM_KIT]         = "drum_kit",
+    [ERROR_INVALID_VALUE]    = "invalid_value",
+    [ERROR_MEMORY]           = "memory",
+    [ERROR_CRASH]            = "crash",
+    [ERROR_OTHER]            = "other",
+};
+
+// Errors are told apart by how their messages start
+static const struct
+{
+    const char *prefix;
+    enum ErrorKind kind;
+} errorKindPrefixes[] =
+{
+    {"failed to open input file", ERROR_READ},
+    {"failed to open output file", ERROR_WRITE},
+    {"Unhandled BMS event",       ERROR_UNHANDLED_OPCODE},
+    {"Call stack limit",          ERROR_STACK_LIMIT},
+    {"Attempted to return",       ERROR_BAD_RETURN},
+    {"Invalid voice",             ERROR_VOICE},
+    {"Voice ",                    ERROR_VOICE},
+    {"Cannot use more than 16",   ERROR_CHANNELS},
+    {"Drum kit",                  ERROR_DRUM_KIT},
+    {"More than one track uses the drum kit", ERROR_DRUM_KIT},
+    {"Invalid tempo",             ERROR_INVALID_VALUE},
+    {"Invalid volume",            ERROR_INVALID_VALUE},
+    {"Invalid pan",               ERROR_INVALID_VALUE},
+    {"Memory limit",              ERROR_MEMORY},
+    {"Out of memory",             ERROR_MEMORY},
+};
+
+// Upper bounds of the conversion time histogram's buckets, in seconds
+static const double durationBuckets[] = {0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+
+// Upper bounds of the peak memory histogram's buckets, in bytes
+static const double memoryBuckets[] = {65536, 262144, 1048576, 4194304, 16777216, 67108864, 268435456, 1073741824};
+
+// What a child sends for each file it converts
+struct ConversionResult
+{
+    uint8_t ok;
+    uint8_t errorKind;
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+    uint64_t events;
+    uint64_t durationNsec;
+    uint64_t peakMemory;  // Most memory the conversion's tracks and tables used, in bytes
+};
+
+static const char *metricsFilename = NULL;
+static int metricsPipe[2] = {-1, -1};
+static unsigned long int metricsConverted = 0;
+static unsigned long int metricsFailures[NUM_ERROR_KINDS];
+static uint64_t metricsBytesIn = 0;
+static uint64_t metricsBytesOut = 0;
+static uint64_t metricsEvents = 0;
+static unsigned long int metricsDurationCounts[ARRAY_LENGTH(durationBuckets) + 1];  // The last one is +Inf
+static double metricsDurationSum = 0;
+static unsigned long int metricsMemoryCounts[ARRAY_LENGTH(memoryBuckets) + 1];
+static double metricsMemorySum = 0;
+static uint64_t metricsMaxPeakMemory = 0;
+static int metricsQueuedFiles = 0;  // Gauges, kept up to date by the mode that's running
+static int metricsRunningJobs = 0;
+static struct timespec metricsLastWrite;
+
+static enum ErrorKind classify_error(const char *message)
+{
+    for (unsigned int i = 0; i < ARRAY_LENGTH(errorKindPrefixes); i++)
+    {
+        if (strncmp(message, errorKindPrefixes[i].prefix, strlen(errorKindPrefixes[i].prefix)) == 0)
+            return errorKindPrefixes[i].kind;
+    }
+    return ERROR_OTHER;
+}
+
+static void write_metrics(void)
+{
+    char *tmpPath = malloc(strlen(metricsFilename) + 32);
+    FILE *file;
+    unsigned long int count = 0;
+    
+    clock_gettime(CLOCK_MONOTONIC, &metricsLastWrite);
+    sprintf(tmpPath, "%s.%lu.tmp", metricsFilename, (unsigned long int)getpid());
+    file = fopen(tmpPath, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Warning: failed to write metrics '%s': %s\n", tmpPath, strerror(errno));
+        free(tmpPath);
+        return;
+    }
+    fputs("# HELP bms2mid_files_converted_total Files converted successfully.\n"
+      "# TYPE bms2mid_files_converted_total counter\n", file);
+    fprintf(file, "bms2mid_files_converted_total %lu\n", metricsConverted);
+    fputs("# HELP bms2mid_conversion_failures_total Files that failed to convert, by kind of error.\n"
+      "# TYPE bms2mid_conversion_failures_total counter\n", file);
+    for (int i = ERROR_NONE + 1; i < NUM_ERROR_KINDS; i++)
+        fprintf(file, "bms2mid_conversion_failures_total{kind=\"%s\"} %lu\n", errorKindNames[i], metricsFailures[i]);
+    fputs("# HELP bms2mid_input_bytes_total Bytes of BMS data read.\n"
+      "# TYPE bms2mid_input_bytes_total counter\n", file);
+    fprintf(file, "bms2mid_input_bytes_total %llu\n", (unsigned long long)metricsBytesIn);
+    fputs("# HELP bms2mid_output_bytes_total Bytes of MIDI data written.\n"
+      "# TYPE bms2mid_output_bytes_total counter\n", file);
+    fprintf(file, "bms2mid_output_bytes_total %llu\n", (unsigned long long)metricsBytesOut);
+    fputs("# HELP bms2mid_events_total Events decoded from the files that were converted.\n"
+      "# TYPE bms2mid_events_total counter\n", file);
+    fprintf(file, "bms2mid_events_total %llu\n", (unsigned long long)metricsEvents);
+    fputs("# HELP bms2mid_events_per_second Events decoded per second of conversion time, over all files so far.\n"
+      "# TYPE bms2mid_events_per_second gauge\n", file);
+    fprintf(file, "bms2mid_events_per_second %.0f\n", (metricsDurationSum > 0) ? metricsEvents / metricsDurationSum : 0.0);
+    fputs("# HELP bms2mid_conversion_duration_seconds Time taken to convert each file.\n"
+      "# TYPE bms2mid_conversion_duration_seconds histogram\n", file);
+    for (unsigned int i = 0; i < ARRAY_LENGTH(durationBuckets); i++)
+    {
+        count += metricsDurationCounts[i];
+        fprintf(file, "bms2mid_conversion_duration_seconds_bucket{le=\"%g\"} %lu\n", durationBuckets[i], count);
+    }
+    count += metricsDurationCounts[ARRAY_LENGTH(durationBuckets)];
+    fprintf(file, "bms2mid_conversion_duration_seconds_bucket{le=\"+Inf\"} %lu\n", count);
+    fprintf(file, "bms2mid_conversion_duration_seconds_sum %.6f\n", metricsDurationSum);
+    fprintf(file, "bms2mid_conversion_duration_seconds_count %lu\n", count);
+    fputs("# HELP bms2mid_conversion_peak_memory_bytes Most memory each conversion's MIDI tracks and decoder tables used.\n"
+      "# TYPE bms2mid_conversion_peak_memory_bytes histogram\n", file);
+    count = 0;
+    for (unsigned int i = 0; i < ARRAY_LENGTH(memoryBuckets); i++)
+    {
+        count += metricsMemoryCounts[i];
+        fprintf(file, "bms2mid_conversion_peak_memory_bytes_bucket{le=\"%.0f\"} %lu\n", memoryBuckets[i], count);
+    }
+    count += metricsMemoryCounts[ARRAY_LENGTH(memoryBuckets)];
+    fprintf(file, "bms2mid_conversion_peak_memory_bytes_bucket{le=\"+Inf\"} %lu\n", count);
+    fprintf(file, "bms2mid_conversion_peak_memory_bytes_sum %.0f\n", metricsMemorySum);
+    fprintf(file, "bms2mid_conversion_peak_memory_bytes_count %lu\n", count);
+    fputs("# HELP bms2mid_max_peak_memory_bytes Most memory any one conversion has used.\n"
+      "# TYPE bms2mid_max_peak_memory_bytes gauge\n", file);
+    fprintf(file, "bms2mid_max_peak_memory_bytes %llu\n", (unsigned long long)metricsMaxPeakMemory);
+    fputs("# HELP bms2mid_queued_files Files waiting to be converted.\n"
+      "# TYPE bms2mid_queued_files gauge\n", file);
+    fprintf(file, "bms2mid_queued_files %i\n", metricsQueuedFiles);
+    fputs("# HELP bms2mid_running_jobs Conversion jobs running.\n"
+      "# TYPE bms2mid_running_jobs gauge\n", file);
+    fprintf(file, "bms2mid_running_jobs %i\n", metricsRunningJobs);
+    if (fclose(file) != 0 || rename(tmpPath, metricsFilename) != 0)
+    {
+        fprintf(stderr, "Warning: failed to write metrics '%s': %s\n", metricsFilename, strerror(errno));
+        remove(tmpPath);
+    }
+    free(tmpPath);
+}
+
+// Returns the number of milliseconds until the metrics are due to be written again
+static int metrics_due_ms(void)
+{
+    struct timespec now;
+    int64_t elapsed;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (int64_t)(timespec_nsec(&now) - timespec_nsec(&metricsLastWrite)) / 1000000;
+    return (elapsed >= METRICS_INTERVAL_MS) ? 0 : METRICS_INTERVAL_MS - elapsed;
+}
+
+static void write_metrics_if_due(void)
+{
+    if (metricsFilename != NULL && metrics_due_ms() == 0)
+        write_metrics();
+}
+
+// Creates the pipe that children send their results through. Does nothing without --metrics.
+static void metrics_open(void)
+{
+    if (metricsFilename == NULL)
+        return;
+    if (pipe(metricsPipe) != 0)
+        fatal_error("pipe failed: %s\n", strerror(errno));
+    fcntl(metricsPipe[0], F_SETFL, O_NONBLOCK);
+    write_metrics();
+}
+
+// Called in a child
+static void metrics_send(const struct ConversionResult *result)
+{
+    if (metricsPipe[1] >= 0 && write(metricsPipe[1], result, sizeof(*result)) != sizeof(*result))
+        fprintf(stderr, "Warning: failed to send metrics: %s\n", strerror(errno));
+}
+
+static void metrics_add(const struct ConversionResult *result)
+{
+    double seconds = result->durationNsec / 1e9;
+    unsigned int bucket = 0;
+    
+    if (result->ok)
+        metricsConverted++;
+    else
+        metricsFailures[(result->errorKind < NUM_ERROR_KINDS) ? result->errorKind : ERROR_OTHER]++;
+    metricsBytesIn += result->bytesIn;
+    metricsBytesOut += result->bytesOut;
+    metricsEvents += result->events;
+    while (bucket < ARRAY_LENGTH(durationBuckets) && seconds > durationBuckets[bucket])
+        bucket++;
+    metricsDurationCounts[bucket]++;
+    metricsDurationSum += seconds;
+    bucket = 0;
+    while (bucket < ARRAY_LENGTH(memoryBuckets) && result->peakMemory > memoryBuckets[bucket])
+        bucket++;
+    metricsMemoryCounts[bucket]++;
+    metricsMemorySum += result->peakMemory;
+    if (result->peakMemory > metricsMaxPeakMemory)
+        metricsMaxPeakMemory = result->peakMemory;
+}
+
+// Adds the results waiting in the pipe. Returns false once every child has closed it.
+static bool metrics_read(void)
+{
+    struct ConversionResult results[64];
+    ssize_t len;
+    
+    while ((len = read(metricsPipe[0], results, sizeof(results))) > 0)
+    {
+        // Whole records are written at once, so whole records are read
+        for (ssize_t i = 0; i < len / (ssize_t)sizeof(*results); i++)
+        {
+            metrics_add(&results[i]);
+            if (metricsQueuedFiles > 0)
+                metricsQueuedFiles--;
+        }
+    }
+    return len != 0;
+}
+
+// Reads results until the children started by run_corpus_jobs have all exited,
+// writing the metrics as it goes
+static void metrics_collect_jobs(void)
+{
+    struct pollfd pfd = {.fd = metricsPipe[0], .events = POLLIN};
+    
+    // The children have their own copies of the write end, so this one would keep the pipe open
+    close(metricsPipe[1]);
+    metricsPipe[1] = -1;
+    while (1)
+    {
+        if (poll(&pfd, 1, metrics_due_ms()) < 0 && errno != EINTR)
+            fatal_error("poll failed: %s\n", strerror(errno));
+        if (!metrics_read())
+            break;
+        write_metrics_if_due();
+    }
+    close(metricsPipe[0]);
+    metricsPipe[0] = -1;
+    metricsRunningJobs = 0;
+    write_metrics();
+}
+
+// Converts a file in a watch mode child and sends the result to the parent. Errors
+// are reported like fatal_error would, but are caught so that their kind is counted.
+static bool convert_file_with_metrics(const char *bmsPath, const char *midiPath)
+{
+    struct ConversionResult result = {0};
+    struct timespec start;
+    struct timespec end;
+    jmp_buf handler;
+    struct stat st;
+    
+    if (metricsPipe[1] < 0)
+    {
+        convert_file(bmsPath, midiPath);
+        return true;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (setjmp(handler) == 0)
+    {
+        errorHandler = &handler;
+        convert_file(bmsPath, midiPath);
+        errorHandler = NULL;
+        result.ok = true;
+        result.events = writeFormat0 ? format0Sink.count : smfSink.count;
+        if (stat(midiPath, &st) == 0)
+            result.bytesOut = st.st_size;
+    }
+    else
+    {
+        errorHandler = NULL;
+        fprintf(stderr, "ERROR! %s", errorMessage);
+        dump_flight_recorder();
+        result.errorKind = classify_error(errorMessage);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    result.bytesIn = bmsSize;
+    result.durationNsec = timespec_nsec(&end) - timespec_nsec(&start);
+    result.peakMemory = memoryPeak;
+    metrics_send(&result);
+    return result.ok;
+}
+
+#endif
+
+//------------------------------------------------------------------------------
+// Watch Mode
+//------------------------------------------------------------------------------
+
+// Watch mode keeps a directory of .bms files converted. Each conversion runs in
+// a forked child, so the converter's global state starts out clean every time
+// and a bad file can't take the watcher down with it.
+
+#ifdef __linux__
+
+#define WATCH_DEBOUNCE_MS 20  // Editors often write a file several times when saving it
+#define MAX_JOBS 64
+
+struct WatchJob
+{
+    pid_t pid;
+    char *name;
+    struct timespec startTime;
+};
+
+static const char *watchDir;
+static char **pendingFiles = NULL;  // Files waiting to be (re)converted, by name within watchDir
+static int numPendingFiles = 0;
+static struct WatchJob runningJobs[MAX_JOBS];
+static int numRunningJobs = 0;
+static int childPipe[2] = {-1, -1};  // Written to when a job exits, so that poll wakes up
+
+static void child_exit_handler(int sig)
+{
+    int savedErrno = errno;
+    
+    (void)sig;
+    if (write(childPipe[1], "", 1) < 0)
+    {
+        // The pipe is full, so poll will wake up anyway
+    }
+    errno = savedErrno;
+}
+
+// Makes SIGCHLD wake up the watch loop through childPipe
+static void watch_children(void)
+{
+    struct sigaction action;
+    
+    if (pipe(childPipe) != 0)
+        fatal_error("pipe failed: %s\n", strerror(errno));
+    for (int i = 0; i < 2; i++)
+        fcntl(childPipe[i], F_SETFD, FD_CLOEXEC);
+    fcntl(childPipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(childPipe[1], F_SETFL, O_NONBLOCK);
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = child_exit_handler;
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, NULL);
+}
+
+static long int elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1000 + (end->tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static bool is_bms_filename(const char *name)
+{
+    size_t len = strlen(name);
+    
+    return len > 4 && strcmp(name + len - 4, ".bms") == 0;
+}
+
+static char *join_path(const char *dir, const char *name)
+{
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+    
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+// Returns the .mid path that goes with a .bms file in the watched directory
+static char *midi_path_for(const char *name)
+{
+    char *path = join_path(watchDir, name);
+    
+    strcpy(path + strlen(path) - 4, ".mid");
+    return path;
+}
+
+static void queue_file(const char *name)
+{
+    for (int i = 0; i < numPendingFiles; i++)
+    {
+        if (strcmp(pendingFiles[i], name) == 0)
+            return;
+    }
+    pendingFiles = realloc(pendingFiles, (numPendingFiles + 1) * sizeof(*pendingFiles));
+    pendingFiles[numPendingFiles++] = strdup(name);
+}
+
+// Queues every .bms file in the watched directory. If onlyStale is set, files whose
+// .mid is newer than both the .bms and the instrument list are left alone.
+static void queue_directory(bool onlyStale, time_t instrListTime)
+{
+    DIR *dir = opendir(watchDir);
+    struct dirent *ent;
+    
+    if (dir == NULL)
+        fatal_error("failed to open directory '%s': %s\n", watchDir, strerror(errno));
+    while ((ent = readdir(dir)) != NULL)
+    {
+        if (!is_bms_filename(ent->d_name))
+            continue;
+        if (onlyStale)
+        {
+            char *bmsPath = join_path(watchDir, ent->d_name);
+            char *midiPath = midi_path_for(ent->d_name);
+            struct stat bmsStat;
+            struct stat midiStat;
+            bool stale = stat(bmsPath, &bmsStat) != 0 || stat(midiPath, &midiStat) != 0
+              || midiStat.st_mtime < bmsStat.st_mtime || midiStat.st_mtime < instrListTime;
+            
+            free(bmsPath);
+            free(midiPath);
+            if (!stale)
+                continue;
+        }
+        queue_file(ent->d_name);
+    }
+    closedir(dir);
+}
+
+static bool is_running(const char *name)
+{
+    for (int i = 0; i < numRunningJobs; i++)
+    {
+        if (strcmp(runningJobs[i].name, name) == 0)
+            return true;
+    }
+    return false;
+}
+
+static void start_jobs(int maxJobs)
+{
+    int i = 0;
+    
+    while (i < numPendingFiles && numRunningJobs < maxJobs)
+    {
+        char *name = pendingFiles[i];
+        pid_t pid;
+        
+        // Don't let two conversions write the same output. The file stays queued
+        // and gets picked up again once the current conversion finishes.
+        if (is_running(name))
+        {
+            i++;
+            continue;
+        }
+        fflush(stdout);
+        fflush(stderr);
+        pid = fork();
+        if (pid < 0)
+            fatal_error("fork failed: %s\n", strerror(errno));
+        if (pid == 0)
+        {
+            char *bmsPath = join_path(watchDir, name);
+            char *midiPath = midi_path_for(name);
+            
+            signal(SIGCHLD, SIG_DFL);
+            debugMessages = false;
+            exit(convert_file_with_metrics(bmsPath, midiPath) ? 0 : 1);
+        }
+        runningJobs[numRunningJobs].pid = pid;
+        runningJobs[numRunningJobs].name = name;
+        clock_gettime(CLOCK_MONOTONIC, &runningJobs[numRunningJobs].startTime);
+        numRunningJobs++;
+        numPendingFiles--;
+        memmove(&pendingFiles[i], &pendingFiles[i + 1], (numPendingFiles - i) * sizeof(*pendingFiles));
+    }
+}
+
+static void reap_jobs(void)
+{
+    pid_t pid;
+    int status;
+    
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        for (int i = 0; i < numRunningJobs; i++)
+        {
+            struct timespec now;
+            
+            if (runningJobs[i].pid != pid)
+                continue;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+                printf("Converted %s (%li ms)\n", runningJobs[i].name, elapsed_ms(&runningJobs[i].startTime, &now));
+            else
+                printf("Failed to convert %s\n", runningJobs[i].name);
+            if (!WIFEXITED(status))
+                metricsFailures[ERROR_CRASH]++;
+            fflush(stdout);
+            free(runningJobs[i].name);
+            runningJobs[i] = runningJobs[--numRunningJobs];
+            break;
+        }
+    }
+}
+
+// Loads a changed instrument list. A list that can't be loaded (perhaps saved
+// halfway through an edit) is reported, and the previous one stays in use.
+static bool reload_instrument_list(const char *filename)
+{
+    jmp_buf handler;
+    
+    if (setjmp(handler) != 0)
+    {
+        errorHandler = NULL;
+        fprintf(stderr, "ERROR! %sKeeping the previous instrument list\n", errorMessage);
+        return false;
+    }
+    errorHandler = &handler;
+    load_instrument_list(filename);
+    errorHandler = NULL;
+    return true;
+}
+
+static void watch_directory(const char *dirName, const char *instrListFilename, int maxJobs)
+{
+    int inotifyFd;
+    int dirWatch;
+    int instrListWatch = -1;
+    const char *instrListName = NULL;
+    time_t instrListTime = 0;
+    struct timespec lastEventTime = {0, 0};
+    // inotify_event has a flexible array member, so the buffer needs proper alignment
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    
+    watchDir = dirName;
+    inotifyFd = inotify_init1(IN_CLOEXEC);
+    if (inotifyFd < 0)
+        fatal_error("inotify_init1 failed: %s\n", strerror(errno));
+    dirWatch = inotify_add_watch(inotifyFd, dirName, IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (dirWatch < 0)
+        fatal_error("failed to watch directory '%s': %s\n", dirName, strerror(errno));
+    if (instrListFilename != NULL)
+    {
+        // Editors usually save by replacing the file, which would silently drop a watch
+        // on the file itself. Watch the directory containing it instead.
+        char *listDir = strdup(instrListFilename);
+        char *slash = strrchr(listDir, '/');
+        struct stat listStat;
+        
+        if (slash != NULL)
+        {
+            instrListName = instrListFilename + (slash - listDir) + 1;
+            *(slash + (slash == listDir)) = '\0';
+        }
+        else
+        {
+            instrListName = instrListFilename;
+            strcpy(listDir, ".");
+        }
+        instrListWatch = inotify_add_watch(inotifyFd, listDir, IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (instrListWatch < 0)
+            fatal_error("failed to watch directory '%s': %s\n", listDir, strerror(errno));
+        free(listDir);
+        load_instrument_list(instrListFilename);
+        if (stat(instrListFilename, &listStat) == 0)
+            instrListTime = listStat.st_mtime;
+    }
+    
+    // Start by bringing everything up to date
+    watch_children();
+    queue_directory(true, instrListTime);
+    metrics_open();
+    printf("Watching %s\n", dirName);
+    fflush(stdout);
+    
+    while (1)
+    {
+        struct pollfd pfds[3] =
+        {
+            {.fd = inotifyFd, .events = POLLIN},
+            {.fd = childPipe[0], .events = POLLIN},
+            {.fd = metricsPipe[0], .events = POLLIN},
+        };
+        struct timespec now;
+        int timeout = -1;
+        int ret;
+        
+        // Finished jobs wake poll up through childPipe, so they don't need a timeout
+        if (numPendingFiles > 0)
+            timeout = WATCH_DEBOUNCE_MS;
+        if (metricsFilename != NULL && (timeout < 0 || metrics_due_ms() < timeout))
+            timeout = metrics_due_ms();
+        ret = poll(pfds, (metricsPipe[0] >= 0) ? 3 : 2, timeout);
+        if (ret < 0 && errno != EINTR)
+            fatal_error("poll failed: %s\n", strerror(errno));
+        if (ret > 0 && (pfds[1].revents & POLLIN))
+        {
+            char drain[64];
+            
+            while (read(childPipe[0], drain, sizeof(drain)) > 0)
+                ;
+        }
+        if (ret > 0 && (pfds[2].revents & POLLIN))
+            metrics_read();
+        if (ret > 0 && (pfds[0].revents & POLLIN))
+        {
+            ssize_t len = read(inotifyFd, buffer, sizeof(buffer));
+            
+            for (char *p = buffer; len > 0 && p < buffer + len; )
+            {
+                struct inotify_event *event = (struct inotify_event *)p;
+                
+                if (event->len > 0)
+                {
+                    if (event->wd == instrListWatch && strcmp(event->name, instrListName) == 0)
+                    {
+                        // Every sequence depends on the instrument list
+                        printf("Instrument list changed\n");
+                        if (reload_instrument_list(instrListFilename))
+                            queue_directory(false, 0);
+                    }
+                    else if (event->wd == dirWatch && is_bms_filename(event->name))
+                    {
+                        queue_file(event->name);
+                    }
+                }
+                p += sizeof(struct inotify_event) + event->len;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &lastEventTime);
+        }
+        reap_jobs();
+        // Wait until the burst of events has settled down before converting
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (numPendingFiles > 0 && elapsed_ms(&lastEventTime, &now) >= WATCH_DEBOUNCE_MS)
+            start_jobs(maxJobs);
+        metricsQueuedFiles = numPendingFiles;
+        metricsRunningJobs = numRunningJobs;
+        write_metrics_if_due();
+    }
+}
+
+#endif
+
+//------------------------------------------------------------------------------
+// Regression Check
+//------------------------------------------------------------------------------
+
+// Converts every .bms file in a directory and compares each result with the
+// golden MIDI file stored next to it (name.golden.mid). A missing golden fails
+// the check, unless it's being updated. Times and peak memory depend on the
+// machine, so they're only compared with baseline.txt in the same directory when
+// asked for, and files missing from it are recorded then.
+
+#ifdef __linux__
+
+#define CHECK_RUNS 3  // Each file is converted this many times, and the fastest run counts
+#define CHECK_MAX_SLOWDOWN 1.5
+#define CHECK_TIME_SLACK_US 2000  // Small files are too noisy to compare on ratio alone
+#define CHECK_MEMORY_SLACK_KB 1024
+
+struct CheckResult
+{
+    long int timeUs;
+    long int maxRssKb;
+};
+
+struct BaselineEntry
+{
+    char name[256];
+    struct CheckResult result;
+};
+
+// Converts a file in a child process, so its peak memory can be measured on its own
+static bool run_check_conversion(const char *bmsPath, const char *midiPath, struct CheckResult *result)
+{
+    int fds[2];
+    pid_t pid;
+    int status;
+    bool ok;
+    
+    if (pipe(fds) != 0)
+        fatal_error("pipe failed: %s\n", strerror(errno));
+    fflush(stdout);
+    fflush(stderr);
+    pid = fork();
+    if (pid < 0)
+        fatal_error("fork failed: %s\n", strerror(errno));
+    if (pid == 0)
+    {
+        struct timespec start;
+        struct timespec end;
+        struct rusage usage;
+        
+        close(fds[0]);
+        if (freopen("/dev/null", "w", stdout) == NULL)
+            exit(1);
+        debugMessages = false;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        convert_file(bmsPath, midiPath);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        getrusage(RUSAGE_SELF, &usage);
+        result->timeUs = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+        result->maxRssKb = usage.ru_maxrss;
+        if (write(fds[1], result, sizeof(*result)) != sizeof(*result))
+            exit(1);
+        exit(0);
+    }
+    close(fds[1]);
+    ok = (read(fds[0], result, sizeof(*result)) == sizeof(*result));
+    close(fds[0]);
+    waitpid(pid, &status, 0);
+    return ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool files_equal(const char *path1, const char *path2)
+{
+    unsigned long int size1;
+    unsigned long int size2;
+    uint8_t *data1 = read_file(path1, &size1);
+    uint8_t *data2 = read_file(path2, &size2);
+    bool equal = data1 != NULL && data2 != NULL && size1 == size2 && memcmp(data1, data2, size1) == 0;
+    
+    free(data1);
+    free(data2);
+    return equal;
+}
+
+static bool copy_file(const char *src, const char *dest)
+{
+    unsigned long int size;
+    uint8_t *data = read_file(src, &size);
+    FILE *file;
+    bool ok;
+    
+    if (data == NULL || (file = fopen(dest, "wb")) == NULL)
+    {
+        free(data);
+        return false;
+    }
+    ok = fwrite(data, 1, size, file) == size;
+    ok = (fclose(file) == 0) && ok;
+    free(data);
+    return ok;
+}
+
+static int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Returns true if everything passed
+static bool run_check(const char *dirName, bool update, bool useBaseline)
+{
+    DIR *dir = opendir(dirName);
+    struct dirent *ent;
+    char **names = NULL;
+    int numNames = 0;
+    struct BaselineEntry *baseline = NULL;
+    int numBaseline = 0;
+    char *baselinePath = join_path(dirName, "baseline.txt");
+    FILE *baselineFile;
+    bool baselineChanged = false;
+    int numFailed = 0;
+    
+    if (dir == NULL)
+        fatal_error("failed to open directory '%s': %s\n", dirName, strerror(errno));
+    while ((ent = readdir(dir)) != NULL)
+    {
+        if (is_bms_filename(ent->d_name))
+        {
+            names = realloc(names, (numNames + 1) * sizeof(*names));
+            names[numNames++] = strdup(ent->d_name);
+        }
+    }
+    closedir(dir);
+    qsort(names, numNames, sizeof(*names), compare_strings);
+    
+    // Load the baseline
+    baselineFile = useBaseline ? fopen(baselinePath, "r") : NULL;
+    if (baselineFile != NULL)
+    {
+        struct BaselineEntry entry;
+        
+        while (fscanf(baselineFile, "%255s %li %li", entry.name, &entry.result.timeUs, &entry.result.maxRssKb) == 3)
+        {
+            baseline = realloc(baseline, (numBaseline + 1) * sizeof(*baseline));
+            baseline[numBaseline++] = entry;
+        }
+        fclose(baselineFile);
+    }
+    
+    for (int i = 0; i < numNames; i++)
+    {
+        char *bmsPath = join_path(dirName, names[i]);
+        char *midiPath = malloc(strlen(bmsPath) + 16);
+        char *goldenPath = malloc(strlen(bmsPath) + 16);
+        struct CheckResult best = {0, 0};
+        struct BaselineEntry *entry = NULL;
+        const char *status = "ok";
+        bool converted = true;
+        
+        strcpy(midiPath, bmsPath);
+        strcpy(midiPath + strlen(midiPath) - 4, ".out.mid");
+        strcpy(goldenPath, bmsPath);
+        strcpy(goldenPath + strlen(goldenPath) - 4, ".golden.mid");
+        for (int run = 0; run < CHECK_RUNS; run++)
+        {
+            struct CheckResult result;
+            
+            // A failed run leaves nothing in result, so only successful runs are timed
+            converted = run_check_conversion(bmsPath, midiPath, &result);
+            if (!converted)
+                break;
+            if (run == 0 || result.timeUs < best.timeUs)
+                best.timeUs = result.timeUs;
+            if (result.maxRssKb > best.maxRssKb)
+                best.maxRssKb = result.maxRssKb;
+        }
+        for (int j = 0; j < numBaseline; j++)
+        {
+            if (strcmp(baseline[j].name, names[i]) == 0)
+                entry = &baseline[j];
+        }
+        
+        if (!converted)
+        {
+            status = "FAILED (conversion failed)";
+        }
+        else
+        {
+            FILE *golden = fopen(goldenPath, "rb");
+            
+            if (golden != NULL)
+                fclose(golden);
+            if (update)
+            {
+                if (!copy_file(midiPath, goldenPath))
+                    fatal_error("failed to write '%s'\n", goldenPath);
+                status = "recorded";
+            }
+            else if (golden == NULL)
+            {
+                status = "FAILED (no golden file, run with --update to record it)";
+            }
+            else if (!files_equal(midiPath, goldenPath))
+            {
+                status = "FAILED (output changed)";
+            }
+            if (!useBaseline)
+            {
+                // Times aren't compared
+            }
+            else if (entry == NULL || update)
+            {
+                if (entry == NULL)
+                {
+                    baseline = realloc(baseline, (numBaseline + 1) * sizeof(*baseline));
+                    entry = &baseline[numBaseline++];
+                    snprintf(entry->name, sizeof(entry->name), "%s", names[i]);
+                }
+                entry->result = best;
+                baselineChanged = true;
+            }
+            else if (status[0] != 'F')
+            {
+                if (best.timeUs > entry->result.timeUs * CHECK_MAX_SLOWDOWN + CHECK_TIME_SLACK_US)
+                    status = "FAILED (slower than baseline)";
+                else if (best.maxRssKb > entry->result.maxRssKb * CHECK_MAX_SLOWDOWN + CHECK_MEMORY_SLACK_KB)
+                    status = "FAILED (more memory than baseline)";
+            }
+        }
+        printf("%-32s %8li us %8li KiB", names[i], best.timeUs, best.maxRssKb);
+        if (entry != NULL)
+            printf("  (baseline %li us %li KiB)", entry->result.timeUs, entry->result.maxRssKb);
+        printf("  %s\n", status);
+        if (status[0] == 'F')
+        {
+            numFailed++;
+            if (strcmp(status, "FAILED (output changed)") == 0)
+                verify_songs(goldenPath, midiPath);
+        }
+        remove(midiPath);
+        free(goldenPath);
+        free(midiPath);
+        free(bmsPath);
+    }
+    
+    if (baselineChanged)
+    {
+        baselineFile = fopen(baselinePath, "w");
+        if (baselineFile == NULL)
+            fatal_error("failed to write '%s': %s\n", baselinePath, strerror(errno));
+        for (int i = 0; i < numBaseline; i++)
+            fprintf(baselineFile, "%s %li %li\n", baseline[i].name, baseline[i].result.timeUs, baseline[i].result.maxRssKb);
+        fclose(baselineFile);
+    }
+    printf("%i files checked, %i failed\n", numNames, numFailed);
+    
+    for (int i = 0; i < numNames; i++)
+        free(names[i]);
+    free(names);
+    free(baseline);
+    free(baselinePath);
+    return numFailed == 0;
+}
+
+#endif
+
+//------------------------------------------------------------------------------
+// Corpus Processing
+//------------------------------------------------------------------------------
+
+// Helpers for the modes that go through a whole directory tree of sequences. The
+// work is split between forked children, each of which decodes every numJobs-th
+// file, so that the decoder's global state doesn't need to be shared.
+
+#ifdef __linux__
+
+struct Corpus
+{
+    char *dirName;
+    char **names;  // Paths of the .bms files within dirName, sorted
+    int numNames;
+};
+
+static void add_corpus_files(struct Corpus *corpus, const char *subdirName)
+{
+    char *dirPath = (subdirName != NULL) ? join_path(corpus->dirName, subdirName) : strdup(corpus->dirName);
+    DIR *dir = opendir(dirPath);
+    struct dirent *ent;
+    
+    if (dir == NULL)
+        fatal_error("failed to open directory '%s': %s\n", dirPath, strerror(errno));
+    while ((ent = readdir(dir)) != NULL)
+    {
+        char *name;
+        char *path;
+        struct stat st;
+        
+        if (ent->d_name[0] == '.')
+            continue;
+        name = (subdirName != NULL) ? join_path(subdirName, ent->d_name) : strdup(ent->d_name);
+        path = join_path(corpus->dirName, name);
+        if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+        {
+            add_corpus_files(corpus, name);
+            free(name);
+        }
+        else if (is_bms_filename(ent->d_name))
+        {
+            corpus->names = realloc(corpus->names, (corpus->numNames + 1) * sizeof(*corpus->names));
+            corpus->names[corpus->numNames++] = name;
+        }
+        else
+        {
+            free(name);
+        }
+        free(path);
+    }
+    closedir(dir);
+    free(dirPath);
+}
+
+static void load_corpus(struct Corpus *corpus, const char *dirName)
+{
+    corpus->dirName = strdup(dirName);
+    corpus->names = NULL;
+    corpus->numNames = 0;
+    add_corpus_files(corpus, NULL);
+    qsort(corpus->names, corpus->numNames, sizeof(*corpus->names), compare_strings);
+}
+
+static void free_corpus(struct Corpus *corpus)
+{
+    for (int i = 0; i < corpus->numNames; i++)
+        free(corpus->names[i]);
+    free(corpus->names);
+    free(corpus->dirName);
+}
+
+// Decodes a file of the corpus, passing its events to the sinks that have been
+// added. Returns false (after printing a warning) if the file couldn't be read or
+// isn't a valid sequence.
+static bool decode_corpus_file(const struct Corpus *corpus, int index)
+{
+    char *path = join_path(corpus->dirName, corpus->names[index]);
+    jmp_buf handler;
+    bool ok = false;
+    int span = trace_begin(0, "file", "%s", corpus->names[index]);
+    
+    reset_decoder();
+    bmsData = read_file(path, &bmsSize);
+    if (bmsData == NULL)
+    {
+        fprintf(stderr, "Warning: failed to open '%s': %s\n", path, strerror(errno));
+        free(path);
+        trace_end(span);
+        return false;
+    }
+    if (setjmp(handler) == 0)
+    {
+        errorHandler = &handler;
+        read_bms();
+        ok = true;
+    }
+    else
+    {
+        fprintf(stderr, "Warning: skipping '%s': %s", path, errorMessage);
+    }
+    errorHandler = NULL;
+    free((void *)bmsData);
+    bmsData = NULL;
+    free(path);
+    trace_end(span);
+    return ok;
+}
+
+// Runs job in numJobs children at once, passing each its shard number, and waits
+// for all of them. Returns false if any of them failed.
+static bool run_corpus_jobs(int numJobs, void (*job)(int shard, void *arg), void *arg)
+{
+    pid_t pids[MAX_JOBS];
+    bool ok = true;
+    int span = trace_begin(0, "phase", "run %i jobs", numJobs);
+    
+    assert(numJobs <= MAX_JOBS);
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < numJobs; i++)
+    {
+        pids[i] = fork();
+        if (pids[i] < 0)
+            fatal_error("fork failed: %s\n", strerror(errno));
+        if (pids[i] == 0)
+        {
+            if (freopen("/dev/null", "w", stdout) == NULL)
+                exit(1);
+            debugMessages = false;
+            trace_forked();
+            job(i, arg);
+            write_trace_part(i);
+            exit(0);
+        }
+    }
+    numTraceParts = numJobs;
+    if (metricsPipe[0] >= 0)
+        metrics_collect_jobs();
+    for (int i = 0; i < numJobs; i++)
+    {
+        int status;
+        
+        waitpid(pids[i], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            ok = false;
+    }
+    trace_end(span);
+    return ok;
+}
+
+static char *shard_filename(const char *filename, int shard)
+{
+    char *name = malloc(strlen(filename) + 16);
+    
+    sprintf(name, "%s.shard%i", filename, shard);
+    return name;
+}
+
+#endif
+
+//------------------------------------------------------------------------------
+// Batch Conversion
+//------------------------------------------------------------------------------
+
+// Converts every .bms file under a directory to a .mid file next to it, and writes
+// a manifest listing each file with hashes of what was read and written. With
+// --shard i/N, only the ith of N shards is converted, so that a big run can be
+// split between machines that see the same directory. Every machine works out the
+// same partition from the names and sizes of the files: the files are taken
+// largest first (ties broken by a hash of the name, then by the name) and each
+// goes to the shard with the least work so far, so the shards come out even.
+//
+// --merge-manifests checks that the manifests of all N shards were made from the
+// same input, and that between them they list each file once, in the shard it
+// belongs to. It then combines them into one manifest.
+//
+// A manifest is a text file like this, with the files sorted by name:
+//   bms2mid manifest 1
+//   shard 2/4
+//   inputs 120 0123456789abcdef         (number of files, hash of their names and sizes)
+//   ok 4312 0123456789abcdef fedcba9876543210 sub/a.bms
+//   failed 880 0123456789abcdef 0000000000000000 sub/b.bms
+// where each file has its size, the hash of its contents and the hash of the
+// MIDI file it became. A merged manifest says "shard all/4".
+
+#ifdef __linux__
+
+#define MANIFEST_VERSION 1
+#define BATCH_FILE_COST 4096  // Work per file besides its size, so that lots of small files are spread out too
+
+struct ManifestEntry
+{
+    char *name;
+    uint32_t bmsSize;
+    uint64_t bmsHash;
+    uint64_t midiHash;  // 0 if the conversion failed
+    bool ok;
+    int shard;  // Numbered from 0
+};
+
+struct Manifest
+{
+    int shard;  // Numbered from 0
+    int numShards;
+    int numInputs;
+    uint64_t inputsHash;
+    struct ManifestEntry *entries;
+    int numEntries;
+};
+
+struct BatchFile
+{
+    const char *name;
+    uint32_t size;
+    uint64_t nameHash;
+    int index;
+};
+
+struct BatchRun
+{
+    const struct Corpus *corpus;
+    const char *manifestFilename;
+    const uint32_t *sizes;
+    int *files;  // Indexes of the corpus files in this shard
+    int numFiles;
+    int numJobs;
+};
+
+static int compare_batch_files(const void *a, const void *b)
+{
+    const struct BatchFile *f1 = a;
+    const struct BatchFile *f2 = b;
+    
+    if (f1->size != f2->size)
+        return (f1->size > f2->size) ? -1 : 1;
+    if (f1->nameHash != f2->nameHash)
+        return (f1->nameHash < f2->nameHash) ? -1 : 1;
+    return strcmp(f1->name, f2->name);
+}
+
+// Hash of the sorted list of input files, which every shard of a run must agree on
+static uint64_t batch_inputs_hash(char *const *names, const uint32_t *sizes, int count)
+{
+    uint64_t hash = HASH_INIT;
+    
+    for (int i = 0; i < count; i++)
+    {
+        hash = hash_bytes(hash, names[i], strlen(names[i]) + 1);
+        hash = hash_bytes(hash, &sizes[i], sizeof(sizes[i]));
+    }
+    return hash;
+}
+
+// Returns the shard (from 0) that each file belongs to. This must only depend on
+// the names and sizes, so that every machine gets the same answer.
+static int *partition_files(char *const *names, const uint32_t *sizes, int count, int numShards)
+{
+    struct BatchFile *files = malloc((count + 1) * sizeof(*files));
+    uint64_t *loads = calloc(numShards, sizeof(*loads));
+    int *shards = malloc((count + 1) * sizeof(*shards));
+    
+    for (int i = 0; i < count; i++)
+    {
+        files[i].name = names[i];
+        files[i].size = sizes[i];
+        files[i].nameHash = hash_bytes(HASH_INIT, names[i], strlen(names[i]));
+        files[i].index = i;
+    }
+    qsort(files, count, sizeof(*files), compare_batch_files);
+    for (int i = 0; i < count; i++)
+    {
+        int best = 0;
+        
+        for (int s = 1; s < numShards; s++)
+        {
+            if (loads[s] < loads[best])
+                best = s;
+        }
+        shards[files[i].index] = best;
+        loads[best] += files[i].size + BATCH_FILE_COST;
+    }
+    free(loads);
+    free(files);
+    return shards;
+}
+
+static void write_manifest_entry(FILE *file, const struct ManifestEntry *entry)
+{
+    fprintf(file, "%s %lu %016llx %016llx %s\n", entry->ok ? "ok" : "failed", (unsigned long int)entry->bmsSize,
+      (unsigned long long)entry->bmsHash, (unsigned long long)entry->midiHash, entry->name);
+}
+
+// Parses an entry line, with the newline already removed. Returns false if it isn't one.
+static bool parse_manifest_entry(const char *line, struct ManifestEntry *entry)
+{
+    char status[8];
+    unsigned long int size;
+    unsigned long long bmsHash;
+    unsigned long long midiHash;
+    int nameStart = 0;
+    
+    if (sscanf(line, "%7s %lu %llx %llx %n", status, &size, &bmsHash, &midiHash, &nameStart) != 4
+     || nameStart == 0 || line[nameStart] == '\0')
+        return false;
+    if (strcmp(status, "ok") == 0)
+        entry->ok = true;
+    else if (strcmp(status, "failed") == 0)
+        entry->ok = false;
+    else
+        return false;
+    entry->name = strdup(line + nameStart);
+    entry->bmsSize = size;
+    entry->bmsHash = bmsHash;
+    entry->midiHash = midiHash;
+    return true;
+}
+
+// Reads lines until EOF, removing the newline from each. Returns false at the end.
+static bool read_manifest_line(FILE *file, char *line, size_t size)
+{
+    size_t len;
+    
+    if (fgets(line, size, file) == NULL)
+        return false;
+    len = strlen(line);
+    if (len > 0 && line[len - 1] == '\n')
+        line[--len] = '\0';
+    return true;
+}
+
+// Adds the entries of a file of entry lines to the manifest
+static void read_manifest_entries(FILE *file, const char *filename, struct Manifest *manifest)
+{
+    char line[4096];
+    
+    while (read_manifest_line(file, line, sizeof(line)))
+    {
+        struct ManifestEntry entry;
+        
+        if (!parse_manifest_entry(line, &entry))
+            fatal_error("invalid line in manifest '%s': %s\n", filename, line);
+        entry.shard = manifest->shard;
+        manifest->entries = realloc(manifest->entries, (manifest->numEntries + 1) * sizeof(*manifest->entries));
+        manifest->entries[manifest->numEntries++] = entry;
+    }
+}
+
+static void read_manifest(const char *filename, struct Manifest *manifest)
+{
+    FILE *file = fopen(filename, "r");
+    char line[4096];
+    int version;
+    unsigned long long inputsHash;
+    
+    if (file == NULL)
+        fatal_error("failed to open manifest '%s': %s\n", filename, strerror(errno));
+    memset(manifest, 0, sizeof(*manifest));
+    if (!read_manifest_line(file, line, sizeof(line)) || sscanf(line, "bms2mid manifest %i", &version) != 1)
+        fatal_error("'%s' is not a manifest\n", filename);
+    if (version != MANIFEST_VERSION)
+        fatal_error("manifest '%s' has version %i, but only version %i is supported\n", filename, version, MANIFEST_VERSION);
+    if (!read_manifest_line(file, line, sizeof(line)) || sscanf(line, "shard %i/%i", &manifest->shard, &manifest->numShards) != 2
+     || manifest->shard < 1 || manifest->shard > manifest->numShards)
+        fatal_error("manifest '%s' is not of a single shard\n", filename);
+    manifest->shard--;
+    if (!read_manifest_line(file, line, sizeof(line)) || sscanf(line, "inputs %i %llx", &manifest->numInputs, &inputsHash) != 2)
+        fatal_error("manifest '%s' doesn't describe its inputs\n", filename);
+    manifest->inputsHash = inputsHash;
+    read_manifest_entries(file, filename, manifest);
+    fclose(file);
+}
+
+static int compare_manifest_entries(const void *a, const void *b)
+{
+    return strcmp(((const struct ManifestEntry *)a)->name, ((const struct ManifestEntry *)b)->name);
+}
+
+// Writes the manifest, with its entries sorted. A shard of -1 means all shards.
+static void write_manifest(const char *filename, struct Manifest *manifest)
+{
+    FILE *file = fopen(filename, "w");
+    
+    if (file == NULL)
+        fatal_error("failed to open output file '%s': %s\n", filename, strerror(errno));
+    qsort(manifest->entries, manifest->numEntries, sizeof(*manifest->entries), compare_manifest_entries);
+    fprintf(file, "bms2mid manifest %i\n", MANIFEST_VERSION);
+    if (manifest->shard < 0)
+        fprintf(file, "shard all/%i\n", manifest->numShards);
+    else
+        fprintf(file, "shard %i/%i\n", manifest->shard + 1, manifest->numShards);
+    fprintf(file, "inputs %i %016llx\n", manifest->numInputs, (unsigned long long)manifest->inputsHash);
+    for (int i = 0; i < manifest->numEntries; i++)
+        write_manifest_entry(file, &manifest->entries[i]);
+    if (fclose(file) != 0)
+        fatal_error("failed to write '%s'\n", filename);
+}
+
+static void free_manifest(struct Manifest *manifest)
+{
+    for (int i = 0; i < manifest->numEntries; i++)
+        free(manifest->entries[i].name);
+    free(manifest->entries);
+}
+
+// Converts a file of the corpus to a .mid file next to it, and fills in its manifest entry
+static void convert_batch_file(const struct BatchRun *run, int index, struct ManifestEntry *entry)
+{
+    char *path = join_path(run->corpus->dirName, run->corpus->names[index]);
+    char *midiPath = strdup(path);
+    uint8_t *data;
+    unsigned long int size;
+    uint8_t *midiData;
+    unsigned long int midiSize;
+    FILE *file;
+    bool ok;
+    struct ConversionResult result = {0};
+    struct timespec start;
+    struct timespec end;
+    int span = trace_begin(0, "file", "%s", run->corpus->names[index]);
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    strcpy(midiPath + strlen(midiPath) - 4, ".mid");
+    entry->name = run->corpus->names[index];
+    entry->bmsSize = run->sizes[index];
+    entry->bmsHash = 0;
+    entry->midiHash = 0;
+    entry->ok = false;
+    data = read_file(path, &size);
+    if (data == NULL)
+    {
+        fprintf(stderr, "Warning: failed to open '%s': %s\n", path, strerror(errno));
+        result.errorKind = ERROR_READ;
+    }
+    else
+    {
+        result.bytesIn = size;
+        entry->bmsHash = hash_bytes(HASH_INIT, data, size);
+        ok = bms_convert(data, size, &midiData, &midiSize);
+        result.peakMemory = bms_peak_memory();
+        if (!ok)
+        {
+            fprintf(stderr, "Warning: failed to convert '%s': %s", path, bms_error());
+            result.errorKind = classify_error(bms_error());
+        }
+        else
+        {
+            result.events = smfSink.count;
+            entry->midiHash = hash_bytes(HASH_INIT, midiData, midiSize);
+            file = fopen(midiPath, "wb");
+            if (file == NULL || fwrite(midiData, 1, midiSize, file) != midiSize || fclose(file) != 0)
+            {
+                fprintf(stderr, "Warning: failed to write '%s'\n", midiPath);
+                result.errorKind = ERROR_WRITE;
+            }
+            else
+            {
+                entry->ok = true;
+                result.bytesOut = midiSize;
+            }
+            free(midiData);
+        }
+        free(data);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    result.ok = entry->ok;
+    result.durationNsec = timespec_nsec(&end) - timespec_nsec(&start);
+    metrics_send(&result);
+    free(midiPath);
+    free(path);
+    trace_end(span);
+}
+
+// Each job writes the entries of its files to its own part of the manifest
+static void batch_job(int job, void *arg)
+{
+    const struct BatchRun *run = arg;
+    char *partName = shard_filename(run->manifestFilename, job);
+    FILE *file = fopen(partName, "w");
+    
+    if (file == NULL)
+        fatal_error("failed to open output file '%s': %s\n", partName, strerror(errno));
+    for (int i = job; i < run->numFiles; i += run->numJobs)
+    {
+        struct ManifestEntry entry;
+        
+        convert_batch_file(run, run->files[i], &entry);
+        write_manifest_entry(file, &entry);
+    }
+    if (fclose(file) != 0)
+        fatal_error("failed to write '%s'\n", partName);
+    free(partName);
+}
+
+// Returns true if every file of the shard was converted
+static bool run_batch(const char *dirName, const char *manifestFilename, int shard, int numShards, int numJobs)
+{
+    struct Corpus corpus;
+    struct BatchRun run;
+    struct Manifest manifest;
+    uint32_t *sizes;
+    int *shards;
+    int numFailed = 0;
+    struct timespec start;
+    struct timespec end;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    load_corpus(&corpus, dirName);
+    sizes = malloc((corpus.numNames + 1) * sizeof(*sizes));
+    for (int i = 0; i < corpus.numNames; i++)
+    {
+        char *path = join_path(dirName, corpus.names[i]);
+        struct stat st;
+        
+        if (stat(path, &st) != 0)
+            fatal_error("failed to stat '%s': %s\n", path, strerror(errno));
+        sizes[i] = st.st_size;
+        free(path);
+    }
+    shards = partition_files(corpus.names, sizes, corpus.numNames, numShards);
+    
+    run.corpus = &corpus;
+    run.manifestFilename = manifestFilename;
+    run.sizes = sizes;
+    run.files = malloc((corpus.numNames + 1) * sizeof(*run.files));
+    run.numFiles = 0;
+    for (int i = 0; i < corpus.numNames; i++)
+    {
+        if (shards[i] == shard)
+            run.files[run.numFiles++] = i;
+    }
+    if (numJobs > run.numFiles)
+        numJobs = (run.numFiles > 0) ? run.numFiles : 1;
+    run.numJobs = numJobs;
+    metricsQueuedFiles = run.numFiles;
+    metricsRunningJobs = numJobs;
+    metrics_open();
+    if (!run_corpus_jobs(numJobs, batch_job, &run))
+        fatal_error("failed to convert shard %i/%i of '%s'\n", shard + 1, numShards, dirName);
+    
+    // Combine the parts that the jobs wrote
+    memset(&manifest, 0, sizeof(manifest));
+    manifest.shard = shard;
+    manifest.numShards = numShards;
+    manifest.numInputs = corpus.numNames;
+    manifest.inputsHash = batch_inputs_hash(corpus.names, sizes, corpus.numNames);
+    for (int job = 0; job < numJobs; job++)
+    {
+        char *partName = shard_filename(manifestFilename, job);
+        FILE *file = fopen(partName, "r");
+        
+        if (file == NULL)
+            fatal_error("failed to open '%s': %s\n", partName, strerror(errno));
+        read_manifest_entries(file, partName, &manifest);
+        fclose(file);
+        remove(partName);
+        free(partName);
+    }
+    if (manifest.numEntries != run.numFiles)
+        fatal_error("expected %i files in the manifest, but the jobs wrote %i\n", run.numFiles, manifest.numEntries);
+    write_manifest(manifestFilename, &manifest);
+    for (int i = 0; i < manifest.numEntries; i++)
+    {
+        if (!manifest.entries[i].ok)
+            numFailed++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Shard %i/%i: converted %i of its %i files (out of %i in all) in %li ms\n", shard + 1, numShards,
+      manifest.numEntries - numFailed, manifest.numEntries, corpus.numNames, elapsed_ms(&start, &end));
+    
+    free_manifest(&manifest);
+    free(run.files);
+    free(shards);
+    free(sizes);
+    free_corpus(&corpus);
+    return numFailed == 0;
+}
+
+// Checks that the manifests are of all the shards of one run, and combines them.
+// Problems with the manifests are fatal. Returns true if every file was converted.
+static bool merge_manifests(const char *mergedFilename, char *const *filenames, int count)
+{
+    struct Manifest *manifests = calloc(count, sizeof(*manifests));
+    struct Manifest merged;
+    bool *seenShards;
+    char **names;
+    uint32_t *sizes;
+    int *shards;
+    int numFailed = 0;
+    
+    for (int i = 0; i < count; i++)
+        read_manifest(filenames[i], &manifests[i]);
+    memset(&merged, 0, sizeof(merged));
+    merged.shard = -1;
+    merged.numShards = manifests[0].numShards;
+    merged.numInputs = manifests[0].numInputs;
+    merged.inputsHash = manifests[0].inputsHash;
+    if (count != merged.numShards)
+        fatal_error("expected the manifests of %i shards, but got %i\n", merged.numShards, count);
+    
+    seenShards = calloc(merged.numShards, sizeof(*seenShards));
+    for (int i = 0; i < count; i++)
+    {
+        if (manifests[i].numShards != merged.numShards)
+            fatal_error("'%s' is one of %i shards, but '%s' is one of %i\n", filenames[i], manifests[i].numShards,
+              filenames[0], merged.numShards);
+        if (manifests[i].numInputs != merged.numInputs || manifests[i].inputsHash != merged.inputsHash)
+            fatal_error("'%s' and '%s' were made from different input files\n", filenames[i], filenames[0]);
+        if (seenShards[manifests[i].shard])
+            fatal_error("more than one manifest is of shard %i/%i\n", manifests[i].shard + 1, merged.numShards);
+        seenShards[manifests[i].shard] = true;
+        merged.entries = realloc(merged.entries, (merged.numEntries + manifests[i].numEntries) * sizeof(*merged.entries));
+        memcpy(merged.entries + merged.numEntries, manifests[i].entries, manifests[i].numEntries * sizeof(*merged.entries));
+        merged.numEntries += manifests[i].numEntries;
+        free(manifests[i].entries);
+    }
+    
+    // Each file must be listed once, and the list must be the one the shards were made from
+    qsort(merged.entries, merged.numEntries, sizeof(*merged.entries), compare_manifest_entries);
+    for (int i = 1; i < merged.numEntries; i++)
+    {
+        if (strcmp(merged.entries[i].name, merged.entries[i - 1].name) == 0)
+            fatal_error("'%s' is in shards %i and %i\n", merged.entries[i].name, merged.entries[i - 1].shard + 1,
+              merged.entries[i].shard + 1);
+    }
+    if (merged.numEntries != merged.numInputs)
+        fatal_error("the manifests list %i files, but there were %i input files\n", merged.numEntries, merged.numInputs);
+    names = malloc((merged.numEntries + 1) * sizeof(*names));
+    sizes = malloc((merged.numEntries + 1) * sizeof(*sizes));
+    for (int i = 0; i < merged.numEntries; i++)
+    {
+        names[i] = merged.entries[i].name;
+        sizes[i] = merged.entries[i].bmsSize;
+    }
+    if (batch_inputs_hash(names, sizes, merged.numEntries) != merged.inputsHash)
+        fatal_error("the files in the manifests aren't the input files they were made from\n");
+    shards = partition_files(names, sizes, merged.numEntries, merged.numShards);
+    for (int i = 0; i < merged.numEntries; i++)
+    {
+        if (shards[i] != merged.entries[i].shard)
+            fatal_error("'%s' is in shard %i, but belongs in shard %i\n", merged.entries[i].name,
+              merged.entries[i].shard + 1, shards[i] + 1);
+        if (!merged.entries[i].ok)
+        {
+            printf("FAILED %s (shard %i/%i)\n", merged.entries[i].name, merged.entries[i].shard + 1, merged.numShards);
+            numFailed++;
+        }
+    }
+    
+    write_manifest(mergedFilename, &merged);
+    printf("Merged %i shards: %i files, %i failed\n", merged.numShards, merged.numEntries, numFailed);
+    free(shards);
+    free(sizes);
+    free(names);
+    free(seenShards);
+    free_manifest(&merged);
+    free(manifests);
+    return numFailed == 0;
+}
+
+#endif
+
+//------------------------------------------------------------------------------
+// Melody Index
+//------------------------------------------------------------------------------
+
+// Finds the sequences that quote a melody. Each track's notes are reduced to the
+// intervals between consecutive notes, so that a melody is found in any key, and
+// every run of INDEX_NGRAM intervals becomes a key of an inverted index that lists
+// where in the corpus the run occurs. A query looks up each run of intervals in
+// the melody and counts the places where all of them line up.
+//
+// The index is built by several children, each of which writes the n-grams of its
+// share of the files to a sorted shard. The shards are then merged into the index
+// file, which holds a table of keys sorted for a binary search, and the postings
+// of each key as delta-encoded variable length quantities. Queries map the file,
+// so only the keys and postings they look at are read.
+
+#ifdef __linux__
+
+#define INDEX_MAGIC 0x31584449  // "IDX1"
+#define INDEX_NGRAM 3  // Intervals per key, so a melody needs at least 4 notes
+#define INDEX_MAX_RESULTS 20
+#define MAX_MELODY_NOTES 64
+
+// An occurrence of an n-gram, as written to the shards
+struct IndexRecord
+{
+    uint32_t key;
+    uint32_t file;
+    uint32_t track;
+    uint32_t pos;  // Number of the n-gram's first note within the track
+    uint32_t tick;  // Time of that note
+};
+
+struct IndexHeader
+{
+    uint32_t magic;
+    uint32_t numFiles;
+    uint32_t numTracks;
+    uint32_t numKeys;
+    uint32_t namesSize;  // Total length of the file names, which each end with '\0'
+    uint32_t postingsSize;
+};
+
+// Postings refer to tracks by their number in the index's table of tracks
+struct IndexTrack
+{
+    uint32_t file;
+    uint32_t track;  // MIDI track number within the file
+};
+
+struct IndexKey
+{
+    uint32_t key;
+    uint32_t offset;  // Where the key's postings start
+    uint32_t count;
+};
+
+// The last few notes of a track
+struct NoteHistory
+{
+    uint8_t pitches[INDEX_NGRAM + 1];
+    uint32_t ticks[INDEX_NGRAM + 1];
+    uint32_t count;  // Number of notes in the track so far
+};
+
+struct IndexBuild
+{
+    const struct Corpus *corpus;
+    const char *indexFilename;
+    int numJobs;
+};
+
+static struct NoteHistory *noteHistories = NULL;
+static unsigned int numNoteHistories = 0;
+static struct IndexRecord *indexRecords = NULL;
+static unsigned long int numIndexRecords = 0;
+static unsigned long int indexRecordsCapacity = 0;
+static uint32_t indexFileNum;  // Number of the file being decoded within the corpus
+
+// Packs the intervals between INDEX_NGRAM + 1 notes into a key
+static uint32_t ngram_key(const uint8_t *pitches)
+{
+    uint32_t key = 0;
+    
+    for (int i = 0; i < INDEX_NGRAM; i++)
+        key = (key << 8) | (uint8_t)(pitches[i + 1] - pitches[i] + 128);
+    return key;
+}
+
+static void index_handle_event(struct EventSink *sink, const struct Event *event)
+{
+    struct NoteHistory *history;
+    
+    (void)sink;
+    if (event->type != EVENT_NOTE_ON || event->channel == 9)  // Drums don't have a melody
+        return;
+    if ((unsigned int)event->track >= numNoteHistories)
+    {
+        noteHistories = realloc(noteHistories, (event->track + 1) * sizeof(*noteHistories));
+        memset(noteHistories + numNoteHistories, 0, (event->track + 1 - numNoteHistories) * sizeof(*noteHistories));
+        numNoteHistories = event->track + 1;
+    }
+    history = &noteHistories[event->track];
+    memmove(history->pitches, history->pitches + 1, INDEX_NGRAM * sizeof(*history->pitches));
+    memmove(history->ticks, history->ticks + 1, INDEX_NGRAM * sizeof(*history->ticks));
+    history->pitches[INDEX_NGRAM] = event->operands[0];
+    history->ticks[INDEX_NGRAM] = event->tick;
+    history->count++;
+    if (history->count <= INDEX_NGRAM)
+        return;
+    
+    if (numIndexRecords == indexRecordsCapacity)
+    {
+        indexRecordsCapacity = (indexRecordsCapacity != 0) ? indexRecordsCapacity * 2 : 4096;
+        indexRecords = realloc(indexRecords, indexRecordsCapacity * sizeof(*indexRecords));
+    }
+    indexRecords[numIndexRecords].key = ngram_key(history->pitches);
+    indexRecords[numIndexRecords].file = indexFileNum;
+    indexRecords[numIndexRecords].track = event->track;
+    indexRecords[numIndexRecords].pos = history->count - INDEX_NGRAM - 1;
+    indexRecords[numIndexRecords].tick = history->ticks[0];
+    numIndexRecords++;
+}
+
+static struct EventSink indexSink = {index_handle_event, NULL, NULL, 0};
+
+static int compare_index_records(const void *a, const void *b)
+{
+    const struct IndexRecord *r1 = a;
+    const struct IndexRecord *r2 = b;
+    
+    if (r1->key != r2->key)
+        return (r1->key < r2->key) ? -1 : 1;
+    if (r1->file != r2->file)
+        return (r1->file < r2->file) ? -1 : 1;
+    if (r1->track != r2->track)
+        return (r1->track < r2->track) ? -1 : 1;
+    return (r1->pos > r2->pos) - (r1->pos < r2->pos);
+}
+
+static int compare_index_tracks(const void *a, const void *b)
+{
+    const struct IndexTrack *t1 = a;
+    const struct IndexTrack *t2 = b;
+    
+    if (t1->file != t2->file)
+        return (t1->file < t2->file) ? -1 : 1;
+    return (t1->track > t2->track) - (t1->track < t2->track);
+}
+
+// Decodes one share of the files and writes their n-grams to a shard, sorted
+static void index_shard_job(int shard, void *arg)
+{
+    const struct IndexBuild *build = arg;
+    char *shardName = shard_filename(build->indexFilename, shard);
+    FILE *file;
+    
+    for (int i = shard; i < build->corpus->numNames; i += build->numJobs)
+    {
+        unsigned long int firstRecord = numIndexRecords;
+        
+        free(noteHistories);
+        noteHistories = NULL;
+        numNoteHistories = 0;
+        indexFileNum = i;
+        numSinks = 0;
+        add_sink(&indexSink);
+        if (!decode_corpus_file(build->corpus, i))
+            numIndexRecords = firstRecord;
+    }
+    numSinks = 0;
+    qsort(indexRecords, numIndexRecords, sizeof(*indexRecords), compare_index_records);
+    file = fopen(shardName, "wb");
+    if (file == NULL)
+        fatal_error("failed to open output file '%s': %s\n", shardName, strerror(errno));
+    if (fwrite(indexRecords, sizeof(*indexRecords), numIndexRecords, file) != numIndexRecords || fclose(file) != 0)
+        fatal_error("failed to write '%s'\n", shardName);
+    free(shardName);
+}
+
+static void buf_put_varlen(struct ByteBuffer *buf, uint32_t val)
+{
+    unsigned long int bytes = val & 0x7F;
+    
+    while ((val >>= 7) != 0)
+    {
+        bytes <<= 8;
+        bytes |= (val & 0x7F) | 0x80;
+    }
+    while (1)
+    {
+        buf_put(buf, 1, (int)(bytes & 0xFF));
+        if (bytes & 0x80)
+            bytes >>= 8;
+        else
+            break;
+    }
+}
+
+static void build_index(const char *indexFilename, const char *dirName, int numJobs)
+{
+    struct Corpus corpus;
+    struct IndexBuild build;
+    struct IndexRecord **shards;
+    unsigned long int *shardSizes;
+    unsigned long int *shardPos;
+    unsigned long int numRecords = 0;
+    struct IndexTrack *tracks;
+    unsigned long int numTracks = 0;
+    struct IndexKey *keys = NULL;
+    unsigned long int numKeys = 0;
+    struct ByteBuffer postings = {NULL, 0, 0};
+    struct IndexHeader header;
+    struct timespec start;
+    struct timespec end;
+    uint32_t namesSize = 0;
+    uint32_t prevDoc = 0;
+    uint32_t prevPos = 0;
+    uint32_t prevTick = 0;
+    FILE *file;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    load_corpus(&corpus, dirName);
+    if (numJobs > corpus.numNames)
+        numJobs = (corpus.numNames > 0) ? corpus.numNames : 1;
+    build.corpus = &corpus;
+    build.indexFilename = indexFilename;
+    build.numJobs = numJobs;
+    if (!run_corpus_jobs(numJobs, index_shard_job, &build))
+        fatal_error("failed to index '%s'\n", dirName);
+    
+    // Load the shards
+    shards = malloc(numJobs * sizeof(*shards));
+    shardSizes = malloc(numJobs * sizeof(*shardSizes));
+    shardPos = calloc(numJobs, sizeof(*shardPos));
+    for (int i = 0; i < numJobs; i++)
+    {
+        char *shardName = shard_filename(indexFilename, i);
+        unsigned long int size;
+        
+        shards[i] = (struct IndexRecord *)read_file(shardName, &size);
+        if (shards[i] == NULL)
+            fatal_error("failed to read '%s': %s\n", shardName, strerror(errno));
+        shardSizes[i] = size / sizeof(**shards);
+        numRecords += shardSizes[i];
+        remove(shardName);
+        free(shardName);
+    }
+    
+    // Number the tracks that have notes
+    tracks = malloc((numRecords + 1) * sizeof(*tracks));
+    for (int i = 0; i < numJobs; i++)
+    {
+        for (unsigned long int j = 0; j < shardSizes[i]; j++)
+        {
+            tracks[numTracks].file = shards[i][j].file;
+            tracks[numTracks].track = shards[i][j].track;
+            numTracks++;
+        }
+    }
+    qsort(tracks, numTracks, sizeof(*tracks), compare_index_tracks);
+    if (numTracks != 0)
+    {
+        unsigned long int n = 1;
+        
+        for (unsigned long int i = 1; i < numTracks; i++)
+        {
+            if (compare_index_tracks(&tracks[i], &tracks[n - 1]) != 0)
+                tracks[n++] = tracks[i];
+        }
+        numTracks = n;
+    }
+    
+    // Merge the shards, writing the postings of each key as they come out in order.
+    // A key's postings are sorted by track and position, so each one is stored as
+    // the difference from the one before it.
+    for (;;)
+    {
+        const struct IndexRecord *record = NULL;
+        int shard = -1;
+        struct IndexTrack track;
+        uint32_t doc;
+        
+        for (int i = 0; i < numJobs; i++)
+        {
+            if (shardPos[i] < shardSizes[i]
+             && (record == NULL || compare_index_records(&shards[i][shardPos[i]], record) < 0))
+            {
+                record = &shards[i][shardPos[i]];
+                shard = i;
+            }
+        }
+        if (record == NULL)
+            break;
+        shardPos[shard]++;
+        
+        track.file = record->file;
+        track.track = record->track;
+        doc = (const struct IndexTrack *)bsearch(&track, tracks, numTracks, sizeof(*tracks), compare_index_tracks) - tracks;
+        if (numKeys == 0 || keys[numKeys - 1].key != record->key)
+        {
+            keys = realloc(keys, (numKeys + 1) * sizeof(*keys));
+            keys[numKeys].key = record->key;
+            keys[numKeys].offset = postings.length;
+            keys[numKeys].count = 0;
+            numKeys++;
+            prevDoc = 0;
+            prevPos = 0;
+            prevTick = 0;
+        }
+        buf_put_varlen(&postings, doc - prevDoc);
+        if (doc != prevDoc)
+        {
+            prevPos = 0;
+            prevTick = 0;
+        }
+        buf_put_varlen(&postings, record->pos - prevPos);
+        buf_put_varlen(&postings, record->tick - prevTick);
+        prevDoc = doc;
+        prevPos = record->pos;
+        prevTick = record->tick;
+        keys[numKeys - 1].count++;
+    }
+    
+    file = fopen(indexFilename, "wb");
+    if (file == NULL)
+        fatal_error("failed to open output file '%s': %s\n", indexFilename, strerror(errno));
+    for (int i = 0; i < corpus.numNames; i++)
+        namesSize += strlen(corpus.names[i]) + 1;
+    namesSize = (namesSize + 3) & ~3;  // Keep the tables after the names aligned
+    header.magic = INDEX_MAGIC;
+    header.numFiles = corpus.numNames;
+    header.numTracks = numTracks;
+    header.numKeys = numKeys;
+    header.namesSize = namesSize;
+    header.postingsSize = postings.length;
+    fwrite(&header, sizeof(header), 1, file);
+    for (int i = 0; i < corpus.numNames; i++)
+        fwrite(corpus.names[i], 1, strlen(corpus.names[i]) + 1, file);
+    for (uint32_t i = ftell(file) - sizeof(header); i < namesSize; i++)
+        fputc(0, file);
+    fwrite(tracks, sizeof(*tracks), numTracks, file);
+    fwrite(keys, sizeof(*keys), numKeys, file);
+    fwrite(postings.data, 1, postings.length, file);
+    if (fclose(file) != 0)
+        fatal_error("failed to write '%s': %s\n", indexFilename, strerror(errno));
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Indexed %i files (%lu tracks, %lu n-grams, %lu distinct) in %li ms\n",
+      corpus.numNames, numTracks, numRecords, numKeys, elapsed_ms(&start, &end));
+    for (int i = 0; i < numJobs; i++)
+        free(shards[i]);
+    free(shards);
+    free(shardSizes);
+    free(shardPos);
+    free(tracks);
+    free(keys);
+    free(postings.data);
+    free_corpus(&corpus);
+}
+
+// A place where a melody may start: the first note of an n-gram that matched,
+// minus the n-gram's position in the melody
+struct MelodyCandidate
+{
+    uint32_t doc;
+    uint32_t start;
+    uint32_t tick;
+    uint32_t gram;  // Position of the matching n-gram in the melody
+};
+
+struct MelodyResult
+{
+    uint32_t doc;
+    uint32_t fullMatches;
+    uint32_t bestGrams;  // Most n-grams of the melody that lined up in one place
+    uint32_t tick;  // Time of the first full match, or of the best partial one
+};
+
+static int compare_melody_candidates(const void *a, const void *b)
+{
+    const struct MelodyCandidate *c1 = a;
+    const struct MelodyCandidate *c2 = b;
+    
+    if (c1->doc != c2->doc)
+        return (c1->doc < c2->doc) ? -1 : 1;
+    if (c1->start != c2->start)
+        return (c1->start < c2->start) ? -1 : 1;
+    return (c1->gram > c2->gram) - (c1->gram < c2->gram);
+}
+
+static int compare_melody_results(const void *a, const void *b)
+{
+    const struct MelodyResult *r1 = a;
+    const struct MelodyResult *r2 = b;
+    
+    if (r1->fullMatches != r2->fullMatches)
+        return (r1->fullMatches > r2->fullMatches) ? -1 : 1;
+    if (r1->bestGrams != r2->bestGrams)
+        return (r1->bestGrams > r2->bestGrams) ? -1 : 1;
+    return (r1->doc > r2->doc) - (r1->doc < r2->doc);
+}
+
+static int compare_index_keys(const void *a, const void *b)
+{
+    uint32_t k1 = ((const struct IndexKey *)a)->key;
+    uint32_t k2 = ((const struct IndexKey *)b)->key;
+    
+    return (k1 > k2) - (k1 < k2);
+}
+
+// Parses a MIDI note number or a note name like C4, F#3 or Bb5 (where C4 is 60)
+static bool parse_pitch(const char *str, int *pitch)
+{
+    static const int semitones[] = {9, 11, 0, 2, 4, 5, 7};  // A to G
+    char *end;
+    int octave;
+    
+    if (isdigit((unsigned char)str[0]))
+    {
+        *pitch = strtol(str, &end, 10);
+        return *end == '\0' && *pitch < 128;
+    }
+    if (toupper((unsigned char)str[0]) < 'A' || toupper((unsigned char)str[0]) > 'G')
+        return false;
+    *pitch = semitones[toupper((unsigned char)str[0]) - 'A'];
+    str++;
+    if (*str == '#')
+        (*pitch)++, str++;
+    else if (*str == 'b')
+        (*pitch)--, str++;
+    octave = strtol(str, &end, 10);
+    if (end == str || *end != '\0')
+        return false;
+    *pitch += (octave + 1) * 12;
+    return *pitch >= 0 && *pitch < 128;
+}
+
+static void search_index(const char *indexFilename, const char *melody)
+{
+    uint8_t pitches[MAX_MELODY_NOTES];
+    int numPitches = 0;
+    int numGrams;
+    char *melodyCopy = strdup(melody);
+    int fd;
+    struct stat st;
+    const uint8_t *data;
+    const struct IndexHeader *header;
+    const char *names;
+    const struct IndexTrack *tracks;
+    const struct IndexKey *keys;
+    const uint8_t *postings;
+    const char **fileNames;
+    struct MelodyCandidate *candidates = NULL;
+    unsigned long int numCandidates = 0;
+    struct MelodyResult *results = NULL;
+    unsigned long int numResults = 0;
+    struct timespec start;
+    struct timespec end;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (char *tok = strtok(melodyCopy, ", "); tok != NULL; tok = strtok(NULL, ", "))
+    {
+        int pitch;
+        
+        if (!parse_pitch(tok, &pitch))
+            fatal_error("'%s' is not a note\n", tok);
+        if (numPitches == MAX_MELODY_NOTES)
+            fatal_error("a melody can't have more than %i notes\n", MAX_MELODY_NOTES);
+        pitches[numPitches++] = pitch;
+    }
+    free(melodyCopy);
+    if (numPitches <= INDEX_NGRAM)
+        fatal_error("a melody needs at least %i notes\n", INDEX_NGRAM + 1);
+    numGrams = numPitches - INDEX_NGRAM;
+    
+    // Map the index
+    fd = open(indexFilename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0)
+        fatal_error("failed to open index '%s': %s\n", indexFilename, strerror(errno));
+    if ((size_t)st.st_size < sizeof(*header))
+        fatal_error("'%s' is not a melody index\n", indexFilename);
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        fatal_error("failed to map index '%s': %s\n", indexFilename, strerror(errno));
+    close(fd);
+    header = (const struct IndexHeader *)data;
+    if (header->magic != INDEX_MAGIC || header->numFiles > header->namesSize
+     || sizeof(*header) + (uint64_t)header->namesSize + (uint64_t)header->numTracks * sizeof(*tracks)
+        + (uint64_t)header->numKeys * sizeof(*keys) + header->postingsSize != (uint64_t)st.st_size)
+        fatal_error("'%s' is not a melody index\n", indexFilename);
+    names = (const char *)(header + 1);
+    tracks = (const struct IndexTrack *)(names + header->namesSize);
+    keys = (const struct IndexKey *)(tracks + header->numTracks);
+    postings = (const uint8_t *)(keys + header->numKeys);
+    
+    // The tables point into each other, so a corrupt index could send the search
+    // outside the file. Every file name has to end within the names, every track
+    // has to belong to a file, and every key's postings (at least 3 bytes each)
+    // have to fit within the postings.
+    fileNames = malloc(header->numFiles * sizeof(*fileNames));
+    for (uint32_t i = 0, nameOffset = 0; i < header->numFiles; i++)
+    {
+        const char *nameEnd = memchr(names + nameOffset, '\0', header->namesSize - nameOffset);
+        
+        if (nameEnd == NULL)
+            fatal_error("index '%s' is corrupt\n", indexFilename);
+        fileNames[i] = names + nameOffset;
+        nameOffset = nameEnd + 1 - names;
+    }
+    for (uint32_t i = 0; i < header->numTracks; i++)
+    {
+        if (tracks[i].file >= header->numFiles)
+            fatal_error("index '%s' is corrupt\n", indexFilename);
+    }
+    for (uint32_t i = 0; i < header->numKeys; i++)
+    {
+        if (keys[i].offset > header->postingsSize || keys[i].count > (header->postingsSize - keys[i].offset) / 3)
+            fatal_error("index '%s' is corrupt\n", indexFilename);
+    }
+    
+    // Find where each n-gram of the melody occurs
+    for (int gram = 0; gram < numGrams; gram++)
+    {
+        struct IndexKey search;
+        const struct IndexKey *key;
+        const uint8_t *p;
+        uint32_t doc = 0;
+        uint32_t pos = 0;
+        uint32_t tick = 0;
+        
+        search.key = ngram_key(pitches + gram);
+        key = bsearch(&search, keys, header->numKeys, sizeof(*keys), compare_index_keys);
+        if (key == NULL)
+            continue;
+        candidates = realloc(candidates, (numCandidates + key->count) * sizeof(*candidates));
+        p = postings + key->offset;
+        for (uint32_t i = 0; i < key->count; i++)
+        {
+            uint32_t docDelta;
+            uint32_t posDelta;
+            uint32_t tickDelta;
+            
+            if (!read_varlen(&p, postings + header->postingsSize, &docDelta)
+             || !read_varlen(&p, postings + header->postingsSize, &posDelta)
+             || !read_varlen(&p, postings + header->postingsSize, &tickDelta))
+                fatal_error("index '%s' is corrupt\n", indexFilename);
+            if (docDelta != 0)
+            {
+                pos = 0;
+                tick = 0;
+            }
+            doc += docDelta;
+            pos += posDelta;
+            tick += tickDelta;
+            if (pos < (uint32_t)gram || doc >= header->numTracks)
+                continue;
+            candidates[numCandidates].doc = doc;
+            candidates[numCandidates].start = pos - gram;
+            candidates[numCandidates].tick = tick;
+            candidates[numCandidates].gram = gram;
+            numCandidates++;
+        }
+    }
+    
+    // Count the n-grams that line up at each starting place, and rank the tracks
+    qsort(candidates, numCandidates, sizeof(*candidates), compare_melody_candidates);
+    for (unsigned long int i = 0; i < numCandidates; )
+    {
+        unsigned long int j = i;
+        struct MelodyResult *result;
+        
+        while (j < numCandidates && candidates[j].doc == candidates[i].doc && candidates[j].start == candidates[i].start)
+            j++;
+        if (numResults == 0 || results[numResults - 1].doc != candidates[i].doc)
+        {
+            results = realloc(results, (numResults + 1) * sizeof(*results));
+            results[numResults].doc = candidates[i].doc;
+            results[numResults].fullMatches = 0;
+            results[numResults].bestGrams = 0;
+            numResults++;
+        }
+        result = &results[numResults - 1];
+        if (j - i == (unsigned long int)numGrams)
+        {
+            if (result->fullMatches == 0)
+                result->tick = candidates[i].tick;
+            result->fullMatches++;
+        }
+        if (j - i > result->bestGrams)
+        {
+            result->bestGrams = j - i;
+            if (result->fullMatches == 0)
+                result->tick = candidates[i].tick;
+        }
+        i = j;
+    }
+    qsort(results, numResults, sizeof(*results), compare_melody_results);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    for (unsigned long int i = 0; i < numResults && i < INDEX_MAX_RESULTS; i++)
+    {
+        const struct IndexTrack *track = &tracks[results[i].doc];
+        
+        if (results[i].fullMatches != 0)
+        {
+            printf("%s track %u: %u matches, the first at tick %u\n", fileNames[track->file], track->track,
+              results[i].fullMatches, results[i].tick);
+        }
+        else
+        {
+            printf("%s track %u: %u of %i n-grams line up at tick %u\n", fileNames[track->file], track->track,
+              results[i].bestGrams, numGrams, results[i].tick);
+        }
+    }
+    printf("%lu tracks matched in %.2f ms\n", numResults,
+      ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / 1e6);
+    free(fileNames);
+    free(candidates);
+    free(results);
+    munmap((void *)data, st.st_size);
+}
+
+#endif
+
+//------------------------------------------------------------------------------
+// Duplicate Detection
+//------------------------------------------------------------------------------
+
+// Finds tracks and subroutines (the targets of 0xC4 calls) that are repeated
+// across a corpus, exactly or with small changes. Each one's notes are reduced to
+// tokens that don't depend on when it starts or what key it's in: the interval to
+// the previous note and the time since the previous token. Runs of SHINGLE_LENGTH
+// tokens are hashed into a MinHash signature, whose values agree between two items
+// about as often as their sets of runs overlap (their Jaccard similarity).
+//
+// Items with the same tokens are grouped as identical first, and one of each group
+// goes on to locality-sensitive hashing: the signature is cut into bands, and only
+// items that share a band exactly are compared. Signatures are computed by forked
+// children, one shard of the files each.
+
+#ifdef __linux__
+
+#define MINHASH_SIZE 64
+#define MINHASH_BANDS 16  // Items with a similarity of 0.5 share a band about 2/3 of the time
+#define SHINGLE_LENGTH 4
+#define MIN_FINGERPRINT_TOKENS 8  // Shorter items match too much by chance
+#define DUPLICATE_SIMILARITY 0.7
+#define MAX_BUCKET_ITEMS 256  // Bigger buckets are skipped, rather than comparing every pair in them
+
+enum FingerprintKind
+{
+    FINGERPRINT_TRACK,
+    FINGERPRINT_SUBROUTINE,
+};
+
+struct Fingerprint
+{
+    uint32_t file;
+    uint32_t id;  // Track number, or the subroutine's address
+    uint32_t kind;
+    uint32_t numTokens;
+    uint64_t exactHash;  // Hash of all of the tokens
+    uint32_t signature[MINHASH_SIZE];
+};
+
+// A track or subroutine being fingerprinted
+struct FingerprintBuilder
+{
+    struct Fingerprint fingerprint;
+    uint64_t window[SHINGLE_LENGTH];  // The last few tokens
+    int prevPitch;
+    uint32_t prevTick;
+    int depth;  // For subroutines, the call depth of their body
+    bool active;
+};
+
+struct FingerprintJob
+{
+    const struct Corpus *corpus;
+    const char *outputName;
+    int numJobs;
+};
+
+static uint64_t minhashMul[MINHASH_SIZE];
+static uint64_t minhashAdd[MINHASH_SIZE];
+static struct FingerprintBuilder *trackBuilders = NULL;
+static unsigned int numTrackBuilders = 0;
+static struct FingerprintBuilder subBuilders[STACK_LIMIT];  // Subroutines being called, innermost last
+static int numSubBuilders = 0;
+static uint32_t *seenSubs = NULL;  // Subroutines of the current file that have been fingerprinted
+static int numSeenSubs = 0;
+static struct Fingerprint *fingerprints = NULL;
+static unsigned long int numFingerprints = 0;
+static unsigned long int fingerprintsCapacity = 0;
+static uint32_t fingerprintFile;
+
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// Hash function i is (minhashMul[i] * x + minhashAdd[i]) >> 32, with odd multipliers
+static void init_minhash(void)
+{
+    for (int i = 0; i < MINHASH_SIZE; i++)
+    {
+        minhashMul[i] = mix64(2 * i + 1) | 1;
+        minhashAdd[i] = mix64(2 * i + 2);
+    }
+}
+
+static void begin_fingerprint(struct FingerprintBuilder *builder, enum FingerprintKind kind, uint32_t id)
+{
+    memset(builder, 0, sizeof(*builder));
+    builder->fingerprint.file = fingerprintFile;
+    builder->fingerprint.id = id;
+    builder->fingerprint.kind = kind;
+    builder->fingerprint.exactHash = HASH_INIT;
+    memset(builder->fingerprint.signature, 0xFF, sizeof(builder->fingerprint.signature));
+    builder->prevPitch = -1;
+    builder->active = true;
+}
+
+static void add_fingerprint_note(struct FingerprintBuilder *builder, const struct Event *event)
+{
+    struct Fingerprint *fp = &builder->fingerprint;
+    int pitch = event->operands[0];
+    uint32_t token[3];
+    uint64_t shingle;
+    
+    token[0] = event->type;
+    token[1] = (builder->prevPitch >= 0) ? pitch - builder->prevPitch : 0;
+    token[2] = (fp->numTokens != 0) ? event->tick - builder->prevTick : 0;
+    if (event->type == EVENT_NOTE_ON)
+        builder->prevPitch = pitch;
+    builder->prevTick = event->tick;
+    fp->exactHash = hash_bytes(fp->exactHash, token, sizeof(token));
+    memmove(builder->window, builder->window + 1, (SHINGLE_LENGTH - 1) * sizeof(*builder->window));
+    builder->window[SHINGLE_LENGTH - 1] = hash_bytes(HASH_INIT, token, sizeof(token));
+    fp->numTokens++;
+    if (fp->numTokens < SHINGLE_LENGTH)
+        return;
+    
+    shingle = HASH_INIT;
+    for (int i = 0; i < SHINGLE_LENGTH; i++)
+        shingle = mix64(shingle ^ builder->window[i]);
+    for (int i = 0; i < MINHASH_SIZE; i++)
+    {
+        uint32_t h = (minhashMul[i] * shingle + minhashAdd[i]) >> 32;
+        
+        fp->signature[i] = (h < fp->signature[i]) ? h : fp->signature[i];
+    }
+}
+
+static void end_fingerprint(struct FingerprintBuilder *builder)
+{
+    if (builder->active && builder->fingerprint.numTokens >= MIN_FINGERPRINT_TOKENS)
+    {
+        if (numFingerprints == fingerprintsCapacity)
+        {
+            fingerprintsCapacity = (fingerprintsCapacity != 0) ? fingerprintsCapacity * 2 : 256;
+            fingerprints = realloc(fingerprints, fingerprintsCapacity * sizeof(*fingerprints));
+        }
+        fingerprints[numFingerprints++] = builder->fingerprint;
+    }
+    builder->active = false;
+}
+
+static void fingerprint_handle_event(struct EventSink *sink, const struct Event *event)
+{
+    (void)sink;
+    if ((unsigned int)event->track >= numTrackBuilders)
+    {
+        trackBuilders = realloc(trackBuilders, (event->track + 1) * sizeof(*trackBuilders));
+        for (int i = numTrackBuilders; i <= event->track; i++)
+            begin_fingerprint(&trackBuilders[i], FINGERPRINT_TRACK, i);
+        numTrackBuilders = event->track + 1;
+    }
+    switch (event->type)
+    {
+    case EVENT_NOTE_ON:
+    case EVENT_NOTE_OFF:
+        add_fingerprint_note(&trackBuilders[event->track], event);
+        for (int i = 0; i < numSubBuilders; i++)
+        {
+            if (subBuilders[i].active)
+                add_fingerprint_note(&subBuilders[i], event);
+        }
+        break;
+    case EVENT_CALL:
+    {
+        bool seen = false;
+        
+        // Each subroutine is only fingerprinted the first time it's called
+        for (int i = 0; i < numSeenSubs && !seen; i++)
+            seen = (seenSubs[i] == event->operands[0]);
+        assert(numSubBuilders < STACK_LIMIT);
+        begin_fingerprint(&subBuilders[numSubBuilders], FINGERPRINT_SUBROUTINE, event->operands[0]);
+        subBuilders[numSubBuilders].depth = event->depth + 1;
+        subBuilders[numSubBuilders].active = !seen;
+        numSubBuilders++;
+        if (!seen)
+        {
+            seenSubs = realloc(seenSubs, (numSeenSubs + 1) * sizeof(*seenSubs));
+            seenSubs[numSeenSubs++] = event->operands[0];
+        }
+        break;
+    }
+    case EVENT_RETURN:
+        if (numSubBuilders > 0 && subBuilders[numSubBuilders - 1].depth == event->depth + 1)
+            end_fingerprint(&subBuilders[--numSubBuilders]);
+        break;
+    case EVENT_TRACK_END:
+        // A subroutine that never returns ends with the track
+        while (numSubBuilders > 0)
+            end_fingerprint(&subBuilders[--numSubBuilders]);
+        end_fingerprint(&trackBuilders[event->track]);
+        break;
+    default:
+        break;
+    }
+}
+
+static struct EventSink fingerprintSink = {fingerprint_handle_event, NULL, NULL, 0};
+
+static void fingerprint_shard_job(int shard, void *arg)
 {
-    uint8_t event2 = read_u8(file);
+    const struct FingerprintJob *job = arg;
+    char *shardName = shard_filename(job->outputName, shard);
+    FILE *file;
     
-    DEBUG_printf("[PAN]\t");
-    switch (event2)
+    for (int i = shard; i < job->corpus->numNames; i += job->numJobs)
     {
-        case 0x03:  // Change panning
-        {
-            uint8_t pan = read_u8(file);
-            uint8_t duration = read_u8(file);
-            
-            assert(pan <= 127);
-            DEBUG_printf("(set pan) pan = %u, duration = %u\n", pan, duration);
-            track_write_varlen(currTrack, delay);
-            track_write_u8(currTrack, 0xB0 + midiTracks[currTrack].channel);
-            track_write_u8(currTrack, 0x0A);
-            track_write_u8(currTrack, pan);
-            delay = 0;
-            break;
-        }
-        default:
-            DEBUG_printf("(unknown)\n");
-            fskip(file, 2);
+        unsigned long int firstFingerprint = numFingerprints;
+        
+        free(trackBuilders);
+        trackBuilders = NULL;
+        numTrackBuilders = 0;
+        numSubBuilders = 0;
+        numSeenSubs = 0;
+        fingerprintFile = i;
+        numSinks = 0;
+        add_sink(&fingerprintSink);
+        if (!decode_corpus_file(job->corpus, i))
+            numFingerprints = firstFingerprint;
     }
+    numSinks = 0;
+    file = fopen(shardName, "wb");
+    if (file == NULL)
+        fatal_error("failed to open output file '%s': %s\n", shardName, strerror(errno));
+    if (fwrite(fingerprints, sizeof(*fingerprints), numFingerprints, file) != numFingerprints || fclose(file) != 0)
+        fatal_error("failed to write '%s'\n", shardName);
+    free(shardName);
 }
 
-// We don't know what this event does. Just print out its data
-static void event_unknown(FILE *file, uint8_t event, int length)
+struct BandEntry
+{
+    uint64_t hash;
+    uint32_t item;
+};
+
+struct DuplicatePair
 {
-    unsigned long int addr = ftell(file) - 1;
+    uint32_t a;
+    uint32_t b;
+    float similarity;
+};
+
+static int compare_fingerprints_exact(const void *a, const void *b)
+{
+    const struct Fingerprint *f1 = *(const struct Fingerprint *const *)a;
+    const struct Fingerprint *f2 = *(const struct Fingerprint *const *)b;
     
-    DEBUG_printf("[UNKNOWN 0x%X]\t", event);
-    for (int i = 0; i < length; i++)
-    {
-        uint8_t val = read_u8(file);
-        DEBUG_printf("0x%X ", val);
-    }
-    DEBUG_printf(" at address 0x%X\n", (unsigned int)addr);
+    if (f1->exactHash != f2->exactHash)
+        return (f1->exactHash < f2->exactHash) ? -1 : 1;
+    if (f1->numTokens != f2->numTokens)
+        return (f1->numTokens < f2->numTokens) ? -1 : 1;
+    // Keep the groups in corpus order
+    return (f1 > f2) - (f1 < f2);
 }
 
-static void read_bms(FILE *file)
+static int compare_band_entries(const void *a, const void *b)
 {
-    metaTrack = add_track();
+    const struct BandEntry *e1 = a;
+    const struct BandEntry *e2 = b;
     
-    while (1)
+    if (e1->hash != e2->hash)
+        return (e1->hash < e2->hash) ? -1 : 1;
+    return (e1->item > e2->item) - (e1->item < e2->item);
+}
+
+static int compare_pairs(const void *a, const void *b)
+{
+    const struct DuplicatePair *p1 = a;
+    const struct DuplicatePair *p2 = b;
+    
+    if (p1->a != p2->a)
+        return (p1->a < p2->a) ? -1 : 1;
+    return (p1->b > p2->b) - (p1->b < p2->b);
+}
+
+static int compare_pairs_by_similarity(const void *a, const void *b)
+{
+    const struct DuplicatePair *p1 = a;
+    const struct DuplicatePair *p2 = b;
+    
+    if (p1->similarity != p2->similarity)
+        return (p1->similarity > p2->similarity) ? -1 : 1;
+    return compare_pairs(a, b);
+}
+
+static void print_fingerprint_name(const struct Corpus *corpus, const struct Fingerprint *fp)
+{
+    if (fp->kind == FINGERPRINT_TRACK)
+        printf("%s track %u", corpus->names[fp->file], fp->id);
+    else
+        printf("%s subroutine 0x%X", corpus->names[fp->file], fp->id);
+}
+
+static void find_duplicates(const char *dirName, int numJobs)
+{
+    struct Corpus corpus;
+    struct FingerprintJob job;
+    const char *tmpDir = getenv("TMPDIR");  // Where the children write their shards
+    char *outputName;
+    struct Fingerprint **sorted;
+    uint32_t *reps = NULL;  // One item of each group of identical ones
+    unsigned long int numReps = 0;
+    unsigned long int numIdentical = 0;
+    struct BandEntry *entries;
+    struct DuplicatePair *pairs = NULL;
+    unsigned long int numPairs = 0;
+    unsigned long int pairsCapacity = 0;
+    unsigned long int numSimilar = 0;
+    struct timespec start;
+    struct timespec end;
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    init_minhash();
+    load_corpus(&corpus, dirName);
+    if (numJobs > corpus.numNames)
+        numJobs = (corpus.numNames > 0) ? corpus.numNames : 1;
+    if (tmpDir == NULL)
+        tmpDir = "/tmp";
+    outputName = malloc(strlen(tmpDir) + 64);
+    sprintf(outputName, "%s/bms2mid-fingerprints-%li", tmpDir, (long int)getpid());
+    job.corpus = &corpus;
+    job.outputName = outputName;
+    job.numJobs = numJobs;
+    if (!run_corpus_jobs(numJobs, fingerprint_shard_job, &job))
+        fatal_error("failed to fingerprint '%s'\n", dirName);
+    
+    for (int i = 0; i < numJobs; i++)
     {
-        uint8_t event = read_u8(file);
-        
-        switch (event)
-        {
-        case 0x80:
-            event_delay_u8(file);
-            break;
-        case 0x88:
-            event_delay_u16(file);
-            break;
-        case 0xC1:
-            event_track_start(file);
-            break;
-        case 0x9A:
-            event_pan(file);
-            break;
-        case 0x9C:
-            event_volume(file);
-            break;
-        case 0xA4:
-            event_instrument(file);
-            break;
-        case 0x9E:  // Pitch bend, probably
-            event_unknown(file, event, 2);
-            break;
+        char *shardName = shard_filename(outputName, i);
+        unsigned long int size;
+        uint8_t *data = read_file(shardName, &size);
         
-        // These events appear in mboss.bms and enemy2.bms. I have no idea what they do.
-        case 0xCC:
-            event_unknown(file, event, 2);
-            break;
-        case 0xAC:  // seems to always be followed by a 0xCC event.
-        {
-            uint8_t val1 = read_u8(file);
-            uint8_t val2 = read_u8(file);
-            uint8_t val3 = read_u8(file);
-            
-            DEBUG_printf("[UNKNOWN 0xAC] 0x%X, 0x%X, 0x%X\n", val1, val2, val3);
-            if (val3 == 0)
-                goto track_end;
-            break;
-        }
-        case 0xAD:
-            event_unknown(file, event, 3);
-            break;
-        case 0xD6:
-            event_unknown(file, event, 1);
-            break;
+        if (data == NULL)
+            fatal_error("failed to read '%s': %s\n", shardName, strerror(errno));
+        fingerprints = realloc(fingerprints, numFingerprints * sizeof(*fingerprints) + size);
+        memcpy(fingerprints + numFingerprints, data, size);
+        numFingerprints += size / sizeof(*fingerprints);
+        free(data);
+        remove(shardName);
+        free(shardName);
+    }
+    
+    // Group the identical items
+    sorted = malloc(numFingerprints * sizeof(*sorted));
+    for (unsigned long int i = 0; i < numFingerprints; i++)
+        sorted[i] = &fingerprints[i];
+    qsort(sorted, numFingerprints, sizeof(*sorted), compare_fingerprints_exact);
+    reps = malloc(numFingerprints * sizeof(*reps));
+    for (unsigned long int i = 0; i < numFingerprints; )
+    {
+        unsigned long int j = i + 1;
         
-        case 0xF4:
-            event_unknown(file, event, 1);
-            break;
-        case 0x98:  // seems to appear near the beginning of a track
-        case 0xE6:  // seems to appear near the beginning of a track
-        case 0xE7:
-            event_unknown(file, event, 2);
-            break;
-        case 0xCB:  // Not really sure how long this is, but 7 bytes seems to do the trick.
-            event_unknown(file, event, 7);
-            break;
-        case 0xC4:
-            event_subroutine_call(file);
-            break;
-        case 0xC6:
-            event_subroutine_return(file);
-            break;
-        case 0xC8:  // Goto event for looping. We ignore this because MIDIs can't loop
+        while (j < numFingerprints && sorted[j]->exactHash == sorted[i]->exactHash
+         && sorted[j]->numTokens == sorted[i]->numTokens)
+            j++;
+        reps[numReps++] = sorted[i] - fingerprints;
+        if (j - i > 1)
         {
-            uint8_t val1 = read_u8(file);
-            uint8_t val2 = read_u8(file);
-            uint8_t val3 = read_u8(file);
-            uint8_t val4 = read_u8(file);
-            
-            DEBUG_printf("[GOTO] %u, %u, %u, %u\n", val1, val2, val3, val4);
-            break;
-        }
-        case 0xFD:
-            event_tempo(file);
-            break;
-        case 0xFE:
-            event_ticks_per_qnote(file);
-            break;
-        case 0xFF:  // End of track
-            DEBUG_printf("[TRACK_END]\t%i\n", currTrack);
-          track_end:
-            track_write_varlen(currTrack, 0);
-            track_write_u8(currTrack, 0xFF);
-            track_write_u8(currTrack, 0x2F);
-            track_write_u8(currTrack, 0);
-            if (!inTrack)
-            {
-                // End of meta track
-                track_write_varlen(metaTrack, 0);
-                track_write_u8(metaTrack, 0xFF);
-                track_write_u8(metaTrack, 0x2F);
-                track_write_u8(metaTrack, 0);
-                return;
-            }
-            fseek(file, savedPos, SEEK_SET);
-            delay = 0;
-            inTrack = false;
-            break;
-        default:
-            if (event < 0x80)  // Note on
-                event_note_on(file, event);
-            else if (event >= 0x81 && event <= 0x87)  // Note off
-                event_note_off(event & 7);
-            else
+            printf("identical (%lu tokens): ", (unsigned long int)sorted[i]->numTokens);
+            for (unsigned long int k = i; k < j; k++)
             {
-                fatal_error("Unhandled BMS event 0x%X at address 0x%X\n",
-                  event, (unsigned int)(ftell(file) - 1));
-            }
-        }
-    }
-}
-
-static void create_instrument_conversion_table(FILE *file)
-{
-    const char *const instrNames[] =
-    {
-        // Piano
-        "Acoustic Grand Piano", "Bright Piano", "Electric Grand Piano", "Honky-tonk Piano", "Electric Piano 1", "Electric Piano 2", "Harpsichord", "Clavinet",
-        // Melodic Percussion
-        "Celesta", "Glockenspiel", "Music Box", "Vibraphone", "Marimba", "Xylophone", "Tubular Bells", "Dulcimer",
-        // Organ
-        "Hammond Organ", "Percussive Organ", "Rock Organ", "Church Organ", "Reed Organ", "Accordian", "Harmonica", "Tango Accordian",
-        // Guitar
-        "Nylon String Guitar", "Steel String Guitar", "Jazz Guitar", "Clean Electric Guitar", "Muted Guitar", "Overdrive Guitar", "Distortion Guitar", "Guitar Harmonics",
-        // Bass
-        "Acoustic Bass", "Fingered Bass", "Picked Bass", "Fretless Bass", "Slap Bass 1", "Slap Bass 2", "Synth Bass 1", "Synth Bass 2",
-        // String
-        "Violin", "Viola", "Cello", "Contrabass", "Tremolo Strings", "Pizzicato Strings", "Orchestral Harp", "Timpani",
-        // Ensemble
-        "String Ensemble 1", "String Ensemble 2", "Synth Strings 1", "Synth Strings 2", "Choir Ahh", "Choir Oohh", "Synth Voice", "Orchestral Hit",
-        // Brass
-        "Trumpet", "Trombone", "Tuba", "Muted Trumpet", "French Horn", "Brass Section", "Synth Brass 1", "Synth Brass 2",
-        // Reed
-        "Soprano Sax", "Alto Sax", "Tenor Sax", "Baritone Sax", "Oboe", "English Horn", "Bassoon", "Clarinet",
-        // Pipe
-        "Piccolo", "Flute", "Recorder", "Pan Flute", "Blown Bottle", "Shakuhachi", "Whistle", "Ocarina",
-        // Synth Lead
-        "Square Lead", "Sawtooth Lead", "Calliope Lead", "Chiff Lead", "Charang Lead", "Voice Lead", "Fifth Lead", "Bass & Lead",
-        // Synth Pad
-        "New Age", "Warm", "Polysynth", "Choir", "Bowed", "Metallic", "Halo", "Sweep",
-        // Synth FX
-        "FX Rain", "FX Soundtrack", "FX Crystal", "FX Atmosphere", "FX Brightness", "FX Goblins", "FX Echo Drops", "FX Star Theme",
-        // Ethnic
-        "Sitar", "Banjo", "Shamisen", "Koto", "Kalimba", "Bagpipe", "Fiddle", "Shanai",
-        // Percussive
-        "Tinkle Bell", "Agogo", "Steel Drums", "Woodblock", "Taiko Drum", "Melodic Tom", "Synth Drum", "Reverse Cymbal",
-        // Sound Effects
-        "Guitar Fret Noise", "Breath Noise", "Seashore", "Bird Tweet", "Telephone Ring", "Helicopter", "Applause", "Gunshot",
-        "Drum Kit",
-    };
-    size_t bufferSize = 1;
-    char *buffer = malloc(bufferSize);
-    bool endOfFile = false;
+                if (k != i)
+                    printf(", ");
+                print_fingerprint_name(&corpus, sorted[k]);
+            }
+            printf("\n");
+            numIdentical++;
+        }
+        i = j;
+    }
     
-    while (!endOfFile)
+    // Items that share a band of their signatures become candidate pairs
+    entries = malloc(numReps * sizeof(*entries));
+    for (int band = 0; band < MINHASH_BANDS; band++)
     {
-        int offset = 0;
-        int instrNum;
+        const int rows = MINHASH_SIZE / MINHASH_BANDS;
         
-        buffer[0] = '\0';        
-        while (1)
+        for (unsigned long int i = 0; i < numReps; i++)
         {
-            if (fgets(buffer + offset, bufferSize - offset, file) == NULL)
-                goto done;
-            offset = strlen(buffer);
-            if (offset + 1 < bufferSize)
-                break;
-            bufferSize *= 2;
-            buffer = realloc(buffer, bufferSize);
+            entries[i].hash = hash_bytes(HASH_INIT + band, fingerprints[reps[i]].signature + band * rows,
+              rows * sizeof(uint32_t));
+            entries[i].item = reps[i];
         }
-        if (offset == 0)
-            continue;
-        char *nl = strchr(buffer, '\n');
-        if (nl != NULL)
-            *nl = '\0';
-        if (sscanf(buffer, "%i", &instrNum) != 1)  // If it's not a number, check the names.
+        qsort(entries, numReps, sizeof(*entries), compare_band_entries);
+        for (unsigned long int i = 0; i < numReps; )
         {
-            char *name;
-            
-            // Strip space
-            name = buffer + offset - 1;
-            while (isspace(*name))
-                *(name--) = '\0';
-            name = buffer;
-            while (isspace(*name))
-                name++;
+            unsigned long int j = i + 1;
             
-            for (instrNum = 0; instrNum < ARRAY_LENGTH(instrNames); instrNum++)
+            while (j < numReps && entries[j].hash == entries[i].hash)
+                j++;
+            if (j - i <= MAX_BUCKET_ITEMS)
             {
-                if (strcmp(name, instrNames[instrNum]) == 0)
-                    goto got_instrument;
+                for (unsigned long int k = i; k < j; k++)
+                {
+                    for (unsigned long int l = k + 1; l < j; l++)
+                    {
+                        if (numPairs == pairsCapacity)
+                        {
+                            pairsCapacity = (pairsCapacity != 0) ? pairsCapacity * 2 : 1024;
+                            pairs = realloc(pairs, pairsCapacity * sizeof(*pairs));
+                        }
+                        pairs[numPairs].a = entries[k].item;
+                        pairs[numPairs].b = entries[l].item;
+                        numPairs++;
+                    }
+                }
             }
-            fatal_error("Unknown instrument '%s'\n", name);
+            i = j;
         }
-      got_instrument:
-        DEBUG_printf("Instrument %i is %s\n", instrListCount, instrNames[instrNum]);
-        instrList = realloc(instrList, (instrListCount + 1) * sizeof(*instrList));
-        instrList[instrListCount] = instrNum;
-        instrListCount++;
     }
-  done:
-    free(buffer);
+    free(entries);
+    
+    // Estimate the similarity of each candidate pair once
+    qsort(pairs, numPairs, sizeof(*pairs), compare_pairs);
+    for (unsigned long int i = 0; i < numPairs; i++)
+    {
+        int same = 0;
+        
+        // The similar pairs are moved to the front as they are found, which never
+        // overwrites pairs[i - 1] before it is compared here
+        if (i > 0 && compare_pairs(&pairs[i], &pairs[i - 1]) == 0)
+            continue;
+        for (int k = 0; k < MINHASH_SIZE; k++)
+            same += (fingerprints[pairs[i].a].signature[k] == fingerprints[pairs[i].b].signature[k]);
+        pairs[i].similarity = (float)same / MINHASH_SIZE;
+        if (pairs[i].similarity >= DUPLICATE_SIMILARITY)
+            pairs[numSimilar++] = pairs[i];
+    }
+    qsort(pairs, numSimilar, sizeof(*pairs), compare_pairs_by_similarity);
+    for (unsigned long int i = 0; i < numSimilar; i++)
+    {
+        printf("similar (%.2f): ", pairs[i].similarity);
+        print_fingerprint_name(&corpus, &fingerprints[pairs[i].a]);
+        printf(", ");
+        print_fingerprint_name(&corpus, &fingerprints[pairs[i].b]);
+        printf("\n");
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Fingerprinted %lu tracks and subroutines in %i files: %lu groups of identical ones "
+      "and %lu similar pairs, in %li ms\n", numFingerprints, corpus.numNames, numIdentical, numSimilar,
+      elapsed_ms(&start, &end));
+    free(outputName);
+    free(sorted);
+    free(reps);
+    free(pairs);
+    free(fingerprints);
+    fingerprints = NULL;
+    numFingerprints = 0;
+    free_corpus(&corpus);
 }
 
+#endif
+
+#ifndef BMS2MID_NO_MAIN
 int main(int argc, char **argv)
 {
-    FILE *bmsFile;
+    const char *watchDirName = NULL;
+    long int headCount = -1;
+    bool reverse = false;
+    bool verify = false;
+    bool update = false;
+    bool useBaseline = false;
+    const char *checkDirName = NULL;
+    const char *fixtureSeed = NULL;
+    const char *sf2Filename = NULL;
+    const char *genListFilename = NULL;
+    const char *playTarget = NULL;
+    const char *indexFilename = NULL;
+    const char *searchIndexFilename = NULL;
+    const char *duplicatesDirName = NULL;
+    const char *batchDirName = NULL;
+    const char *mergedManifestFilename = NULL;
+    int shard = 0;
+    int numShards = 1;
+    int maxJobs = 0;
+    int argi = 1;
+    int numArgs;
     
+    signal(SIGABRT, abort_handler);
     // MinGW's stupid assert function aborts without flushing stderr, so we never get to see the message.
     // We can work around that by disabling buffering on stderr.
 #if defined(_WIN32) && !defined(NDEBUG)
     setvbuf(stderr, NULL, _IONBF, 0);
 #endif
 
-    if (argc != 3 && argc != 4)
+    // Parse options
+    while (argi < argc && strncmp(argv[argi], "--", 2) == 0)
     {
-        usage(argv[0]);
-        return 1;
+        const char *opt = argv[argi++];
+        
+        // Options without an argument
+        if (strcmp(opt, "--reverse") == 0)
+        {
+            reverse = true;
+            continue;
+        }
+        if (strcmp(opt, "--verify") == 0)
+        {
+            verify = true;
+            continue;
+        }
+        if (strcmp(opt, "--update") == 0)
+        {
+            update = true;
+            continue;
+        }
+        if (strcmp(opt, "--baseline") == 0)
+        {
+            useBaseline = true;
+            continue;
+        }
+        if (strcmp(opt, "--format0") == 0)
+        {
+            writeFormat0 = true;
+            continue;
+        }
+        if (argi >= argc)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        if (strcmp(opt, "--watch") == 0)
+            watchDirName = argv[argi++];
+        else if (strcmp(opt, "--jobs") == 0)
+            maxJobs = atoi(argv[argi++]);
+        else if (strcmp(opt, "--cache") == 0)
+            cacheDir = argv[argi++];
+        else if (strcmp(opt, "--trace") == 0)
+            traceFilename = argv[argi++];
+        else if (strcmp(opt, "--memory-limit") == 0)
+            memoryLimit = parse_memory_size(argv[argi++]);
+#ifdef __linux__
+        else if (strcmp(opt, "--event-cache") == 0)
+            eventCacheDir = argv[argi++];
+        else if (strcmp(opt, "--metrics") == 0)
+            metricsFilename = argv[argi++];
+#endif
+        else if (strcmp(opt, "--events") == 0)
+            eventsFilename = argv[argi++];
+        else if (strcmp(opt, "--stats") == 0)
+            statsFilename = argv[argi++];
+        else if (strcmp(opt, "--disasm") == 0)
+            disasmFilename = argv[argi++];
+        else if (strcmp(opt, "--render") == 0)
+            renderFilename = argv[argi++];
+        else if (strcmp(opt, "--bank") == 0 && numBankFilenames < MAX_BANK_FILES)
+            bankFilenames[numBankFilenames++] = argv[argi++];
+        else if (strcmp(opt, "--wsys") == 0 && numWsysFilenames < MAX_BANK_FILES)
+            wsysFilenames[numWsysFilenames++] = argv[argi++];
+        else if (strcmp(opt, "--aw-dir") == 0)
+            awDirName = argv[argi++];
+        else if (strcmp(opt, "--sf2") == 0)
+            sf2Filename = argv[argi++];
+        else if (strcmp(opt, "--gen-instrument-list") == 0)
+            genListFilename = argv[argi++];
+        else if (strcmp(opt, "--check") == 0)
+            checkDirName = argv[argi++];
+        else if (strcmp(opt, "--gen-fixture") == 0)
+            fixtureSeed = argv[argi++];
+        else if (strcmp(opt, "--index") == 0)
+            indexFilename = argv[argi++];
+        else if (strcmp(opt, "--search") == 0)
+            searchIndexFilename = argv[argi++];
+        else if (strcmp(opt, "--find-duplicates") == 0)
+            duplicatesDirName = argv[argi++];
+        else if (strcmp(opt, "--batch") == 0)
+            batchDirName = argv[argi++];
+        else if (strcmp(opt, "--merge-manifests") == 0)
+            mergedManifestFilename = argv[argi++];
+        else if (strcmp(opt, "--shard") == 0)
+        {
+            if (sscanf(argv[argi++], "%i/%i", &shard, &numShards) != 2 || numShards < 1 || shard < 1 || shard > numShards)
+                fatal_error("--shard takes a shard number and count like 2/4\n");
+            shard--;
+        }
+        else if (strcmp(opt, "--play") == 0)
+            playTarget = argv[argi++];
+        else if (strcmp(opt, "--head") == 0)
+            headCount = atol(argv[argi++]);
+        else if (strcmp(opt, "--tracks") == 0)
+            trackFilter = parse_number_list(argv[argi++], 31);
+        else if (strcmp(opt, "--channels") == 0)
+            channelFilter = parse_number_list(argv[argi++], MAX_CHANNELS - 1);
+        else if (strcmp(opt, "--only") == 0)
+            eventClassFilter = parse_event_classes(argv[argi++]);
+        else if (strcmp(opt, "--pitch") == 0)
+        {
+            if (sscanf(argv[argi++], "%i-%i", &minPitchFilter, &maxPitchFilter) != 2)
+                fatal_error("--pitch takes a range like 36-60\n");
+        }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    numArgs = argc - argi;
+    trace_start();
+    
+    if (genListFilename != NULL)
+    {
+        if (numArgs != 0)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        generate_instrument_list(genListFilename);
+        return 0;
     }
     
-    // Open bms file
-    bmsFile = fopen(argv[1], "rb");
-    if (bmsFile == NULL)
-        fatal_error("failed to open input file '%s': %s\n", argv[1], strerror(errno));
+    if (numBankFilenames != 0)
+    {
+        int span = trace_begin(0, "phase", "load banks");
+        
+        load_banks();
+        trace_end(span);
+    }
     
-    // Open midi file
-    midiFile = fopen(argv[2], "wb");
-    if (midiFile == NULL)
-        fatal_error("failed to open output file '%s': %s\n", argv[2], strerror(errno));
+#ifdef __linux__
+    if (maxJobs <= 0)
+        maxJobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (maxJobs > MAX_JOBS)
+        maxJobs = MAX_JOBS;
+#endif
+    if (maxJobs <= 0)
+        maxJobs = 1;
+    
+    if (watchDirName != NULL)
+    {
+        if (numArgs > 1)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        if (eventsFilename != NULL || statsFilename != NULL || disasmFilename != NULL || renderFilename != NULL)
+            fatal_error("--events, --stats, --disasm and --render can't be used with --watch\n");
+#ifdef __linux__
+        watch_directory(watchDirName, (numArgs == 1) ? argv[argi] : NULL, maxJobs);
+#else
+        fatal_error("watch mode is only supported on Linux\n");
+#endif
+        return 0;
+    }
+    
+    if (fixtureSeed != NULL)
+    {
+        if (numArgs != 1)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        generate_fixture(strtoul(fixtureSeed, NULL, 0), argv[argi]);
+        return 0;
+    }
+    
+    if (sf2Filename != NULL)
+    {
+        if (numArgs > 1)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        if (numArgs == 1)
+            load_instrument_list(argv[argi]);
+        write_sf2(sf2Filename);
+        return 0;
+    }
+    
+    if (checkDirName != NULL)
+    {
+        if (numArgs > 1)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        if (numArgs == 1)
+            load_instrument_list(argv[argi]);
+#ifdef __linux__
+        return run_check(checkDirName, update, useBaseline) ? 0 : 1;
+#else
+        fatal_error("--check is only supported on Linux\n");
+#endif
+    }
     
-    if (argc == 4)
+    if (indexFilename != NULL || duplicatesDirName != NULL)
     {
-        FILE *convTblFile = fopen(argv[3], "r");
+        int numDirArgs = (indexFilename != NULL) ? 1 : 0;
         
-        if (convTblFile == NULL)
-            fatal_error("failed to open instrument conversion file '%s': %s\n", argv[3], strerror(errno));
-        create_instrument_conversion_table(convTblFile);
-        fclose(convTblFile);
+        if (numArgs != numDirArgs && numArgs != numDirArgs + 1)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        if (numArgs == numDirArgs + 1)
+            load_instrument_list(argv[argi + numDirArgs]);
+#ifdef __linux__
+        if (indexFilename != NULL)
+            build_index(indexFilename, argv[argi], maxJobs);
+        else
+            find_duplicates(duplicatesDirName, maxJobs);
+#else
+        fatal_error("--index and --find-duplicates are only supported on Linux\n");
+#endif
+        return 0;
     }
     
-    read_bms(bmsFile);
+    if (batchDirName != NULL)
+    {
+        if (numArgs != 1 && numArgs != 2)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        if (numArgs == 2)
+            load_instrument_list(argv[argi + 1]);
+#ifdef __linux__
+        return run_batch(batchDirName, argv[argi], shard, numShards, maxJobs) ? 0 : 1;
+#else
+        fatal_error("--batch is only supported on Linux\n");
+#endif
+    }
     
-    // Now, actually write the MIDI file
+    if (mergedManifestFilename != NULL)
+    {
+        if (numArgs < 1)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+#ifdef __linux__
+        return merge_manifests(mergedManifestFilename, argv + argi, numArgs) ? 0 : 1;
+#else
+        fatal_error("--merge-manifests is only supported on Linux\n");
+#endif
+    }
     
-    // Write header chunk
-    fputs("MThd", midiFile);             // chunk type
-    write_u32(midiFile, 6);              // chunk length
-    write_u16(midiFile, 1);              // format type
-    write_u16(midiFile, numMidiTracks);  // number of tracks
-    write_u16(midiFile, (ticksPerQNote != 0) ? ticksPerQNote : 120);  // ticks per quarter note (default to 120 if not set)
+    if (searchIndexFilename != NULL)
+    {
+        if (numArgs != 1)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+#ifdef __linux__
+        search_index(searchIndexFilename, argv[argi]);
+#else
+        fatal_error("--search is only supported on Linux\n");
+#endif
+        return 0;
+    }
     
-    // Write tracks
-    for (unsigned int i = 0; i < numMidiTracks; i++)
+    if (playTarget != NULL)
     {
-        DEBUG_printf("Track %u: channel %i\n", i, midiTracks[i].channel);
-        fputs("MTrk", midiFile);
-        write_u32(midiFile, midiTracks[i].length);
-        fwrite(midiTracks[i].buffer, 1, midiTracks[i].length, midiFile);
+        if (numArgs != 1 && numArgs != 2)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        if (numArgs == 2)
+            load_instrument_list(argv[argi + 1]);
+#ifdef __linux__
+        play_file(argv[argi], playTarget);
+#else
+        fatal_error("--play is only supported on Linux\n");
+#endif
+        return 0;
     }
-    DEBUG_printf("%i midi tracks\n", numMidiTracks);
-    fclose(bmsFile);
-    fclose(midiFile);
+    
+    if (reverse)
+    {
+        if (numArgs != 2)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        write_bms(argv[argi], argv[argi + 1]);
+        return 0;
+    }
+    
+    if (verify)
+    {
+        if (numArgs != 2 && numArgs != 3)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        if (numArgs == 3)
+            load_instrument_list(argv[argi + 2]);
+        return verify_songs(argv[argi], argv[argi + 1]) ? 0 : 1;
+    }
+    
+    if (headCount >= 0)
+    {
+        if (numArgs != 1 && numArgs != 2)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        if (numArgs == 2)
+            load_instrument_list(argv[argi + 1]);
+        print_first_events(argv[argi], headCount);
+        return 0;
+    }
+    
+    if (numArgs != 2 && numArgs != 3)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    
+    if (numArgs == 3)
+        load_instrument_list(argv[argi + 2]);
+    
+    convert_file(argv[argi], argv[argi + 1]);
     return 0;
 }
+#endif
@@ -0,0 +1,148 @@
+/*
+ * Copyright 2017 Cameron Hall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Interface for programs that use bms2mid.c as a library (built with
+// BMS2MID_NO_MAIN defined). The converter keeps its state in globals, so
+// only one sequence can be decoded at a time, unless it's also built with
+// BMS2MID_THREADS, which gives each thread its own. Invalid sequences are
+// reported through bms_error instead of exiting.
+
+#ifndef BMS2MID_H
+#define BMS2MID_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum EventType
+{
+    EVENT_NOTE_ON,
+    EVENT_NOTE_OFF,
+    EVENT_DELAY,
+    EVENT_TRACK_START,
+    EVENT_TRACK_END,
+    EVENT_BANK,
+    EVENT_PROGRAM,
+    EVENT_VOLUME,
+    EVENT_PAN,
+    EVENT_TEMPO,
+    EVENT_TICKS_PER_QNOTE,
+    EVENT_CALL,
+    EVENT_RETURN,
+    EVENT_GOTO,
+    EVENT_UNKNOWN,
+    NUM_EVENT_TYPES
+};
+
+// Operands of each event type:
+//   NOTE_ON          pitch, velocity, voice
+//   NOTE_OFF         pitch, 0, voice
+//   DELAY            ticks
+//   TRACK_START      BMS offset of the track
+//   BANK             bank
+//   PROGRAM          MIDI program, BMS instrument
+//   VOLUME, PAN      value, duration
+//   TEMPO            beats per minute, microseconds per quarter note
+//   TICKS_PER_QNOTE  ticks
+//   CALL, RETURN     destination
+//   GOTO, UNKNOWN    the raw operand bytes
+struct Event
+{
+    enum EventType type;
+    uint8_t opcode;
+    uint32_t offset;  // Address of the opcode in the BMS file
+    int track;  // MIDI track the event belongs to
+    int channel;
+    int depth;  // Subroutine call depth
+    uint32_t tick;  // Absolute time within the track
+    uint32_t delta;  // Time since the previous MIDI event in the track
+    int numOperands;
+    uint32_t operands[8];
+};
+
+// Starts decoding the BMS data in data, which must stay valid until bms_iter_close is called.
+// Returns false if it fails (such as by going over the memory limit); bms_error says why,
+// and bms_iter_close still has to be called.
+bool bms_iter_open(const uint8_t *data, unsigned long int size);
+
+// Like bms_iter_open, but the events of all tracks come out merged in time order,
+// instead of each track being decoded to its end when it is started. Tracks are
+// decoded side by side, so only as much of each one is decoded as has been asked
+// for. A track started after time 0 starts at the time it was started.
+bool bms_iter_open_merged(const uint8_t *data, unsigned long int size);
+
+// Decodes up to the next event and stores it in event. Returns false at the end of the sequence.
+bool bms_iter_next(struct Event *event);
+
+// Stops decoding and frees the decoder's memory. The rest of the sequence is never decoded.
+void bms_iter_close(void);
+
+// A note, paired up from a NOTE_ON event and the event that ends it
+struct Note
+{
+    uint32_t start;  // Absolute time of the note on
+    uint32_t duration;  // Ticks until the note off (or the next note on the same voice)
+    uint8_t pitch;
+    uint8_t velocity;
+    int channel;
+    uint32_t offset;  // Address of the note on opcode in the BMS file
+};
+
+// Decodes the whole sequence in data and indexes its notes by time, replacing the
+// notes of any sequence opened before. data isn't needed afterwards. Returns false
+// if the data is not a valid sequence.
+bool bms_notes_open(const uint8_t *data, unsigned long int size);
+
+// Returns the number of MIDI tracks of the sequence opened by bms_notes_open.
+int bms_notes_track_count(void);
+
+// Returns the notes of a track, sorted by start time, and stores how many there are in *count.
+const struct Note *bms_notes_track(int track, unsigned int *count);
+
+// Finds the notes of a track that sound at some point between startTick and endTick
+// (not including endTick itself), in O(log n) time plus the number of notes found.
+// Notes with no duration count as one tick long. Stores up to maxNotes of them in
+// notes, sorted by start time, and returns how many there are in total.
+unsigned int bms_notes_between(int track, uint32_t startTick, uint32_t endTick, struct Note *notes, unsigned int maxNotes);
+
+// Frees the notes of the sequence opened by bms_notes_open.
+void bms_notes_close(void);
+
+// Converts the BMS data in data to a MIDI file. On success, stores the MIDI file in
+// *midiData (to be freed by the caller) and its size in *midiSize, and returns true.
+// Returns false if the data is not a valid sequence.
+bool bms_convert(const uint8_t *data, unsigned long int size, uint8_t **midiData, unsigned long int *midiSize);
+
+// Returns a message describing why the last call to bms_convert, bms_iter_open or
+// bms_iter_next failed, or NULL if it didn't. bms_iter_next also returns false after an error.
+const char *bms_error(void);
+
+// Limits the memory that the MIDI tracks and tables of one sequence may use to bytes
+// (0, the default, for no limit). A sequence that needs more fails with an error.
+// The notes kept by bms_notes_open count towards it until bms_notes_close, but not
+// towards the limit of later sequences. With BMS2MID_THREADS, the limit only applies to the calling thread.
+void bms_set_memory_limit(unsigned long int bytes);
+
+// Returns the most memory the MIDI tracks and tables have used since the last sequence
+// was opened or converted, in bytes
+unsigned long int bms_peak_memory(void);
+
+#endif  // BMS2MID_H
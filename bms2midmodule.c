@@ -0,0 +1,372 @@
+/*
+ * Copyright 2017 Cameron Hall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Python extension module around the library interface in bms2mid.h (see the
+// python target in the Makefile). bms2mid.c is built with BMS2MID_THREADS, so
+// each thread decodes its own sequence, and the GIL is released while decoding.
+// Converting files from a pool of Python threads uses every core, without a
+// process or temporary file per file.
+//
+//   convert(data, memory_limit=0) -> bytes
+//       Converts BMS data (bytes, bytearray, memoryview or anything else with
+//       the buffer protocol) to a MIDI file.
+//   events(data, merged=False, memory_limit=0) -> EventArray
+//       Decodes the events of BMS data. The array exposes the struct Event
+//       records through the buffer protocol, in the format EVENT_FORMAT with
+//       the fields in EVENT_FIELDS, so that memoryview, struct.iter_unpack or
+//       numpy.frombuffer can read them without copying. Indexing it gives a
+//       tuple of the fields of one event, in the order of EVENT_FIELDS, with
+//       the num_operands operands in a tuple of their own. In the buffer, the
+//       last field is always 8 operands wide, so struct.iter_unpack gives the
+//       first 9 fields followed by all 8 operands (17 values per event).
+//   peak_memory() -> int
+//       Most memory the last conversion in this thread used.
+//
+// Sequences that can't be decoded, or that need more than memory_limit bytes,
+// raise bms2mid.Error. check_python.py checks this.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bms2mid.h"
+
+#define ARRAY_LENGTH(x) (sizeof(x) / sizeof(*x))
+
+#define EVENT_FORMAT "@iBIiiiIIi8I"  // struct Event in struct module syntax
+
+static const char *const eventFields[] =
+{
+    "type", "opcode", "offset", "track", "channel", "depth", "tick", "delta", "num_operands", "operands",
+};
+
+static const struct
+{
+    const char *name;
+    int type;
+} eventTypes[] =
+{
+    {"EVENT_NOTE_ON",         EVENT_NOTE_ON},
+    {"EVENT_NOTE_OFF",        EVENT_NOTE_OFF},
+    {"EVENT_DELAY",           EVENT_DELAY},
+    {"EVENT_TRACK_START",     EVENT_TRACK_START},
+    {"EVENT_TRACK_END",       EVENT_TRACK_END},
+    {"EVENT_BANK",            EVENT_BANK},
+    {"EVENT_PROGRAM",         EVENT_PROGRAM},
+    {"EVENT_VOLUME",          EVENT_VOLUME},
+    {"EVENT_PAN",             EVENT_PAN},
+    {"EVENT_TEMPO",           EVENT_TEMPO},
+    {"EVENT_TICKS_PER_QNOTE", EVENT_TICKS_PER_QNOTE},
+    {"EVENT_CALL",            EVENT_CALL},
+    {"EVENT_RETURN",          EVENT_RETURN},
+    {"EVENT_GOTO",            EVENT_GOTO},
+    {"EVENT_UNKNOWN",         EVENT_UNKNOWN},
+};
+
+static PyObject *bmsError = NULL;
+
+// Raises bms2mid.Error with one of the converter's messages, which end in a newline
+static void set_bms_error(const char *message)
+{
+    size_t length = strlen(message);
+    PyObject *value;
+    
+    if (length > 0 && message[length - 1] == '\n')
+        length--;
+    value = PyUnicode_DecodeUTF8(message, length, "replace");
+    if (value != NULL)
+    {
+        PyErr_SetObject(bmsError, value);
+        Py_DECREF(value);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Event Arrays
+//------------------------------------------------------------------------------
+
+// The events are never changed after decoding, so the array is read-only and
+// can be shared with any number of buffer views.
+
+struct EventArray
+{
+    PyObject_HEAD
+    struct Event *events;
+    Py_ssize_t numEvents;
+};
+
+static void event_array_dealloc(PyObject *self)
+{
+    struct EventArray *array = (struct EventArray *)self;
+    
+    free(array->events);
+    Py_TYPE(self)->tp_free(self);
+}
+
+static Py_ssize_t event_array_length(PyObject *self)
+{
+    return ((struct EventArray *)self)->numEvents;
+}
+
+static PyObject *event_array_item(PyObject *self, Py_ssize_t index)
+{
+    struct EventArray *array = (struct EventArray *)self;
+    const struct Event *event;
+    PyObject *operands;
+    
+    if (index < 0 || index >= array->numEvents)
+    {
+        PyErr_SetString(PyExc_IndexError, "event index out of range");
+        return NULL;
+    }
+    event = &array->events[index];
+    operands = PyTuple_New(event->numOperands);
+    if (operands == NULL)
+        return NULL;
+    for (int i = 0; i < event->numOperands; i++)
+        PyTuple_SET_ITEM(operands, i, PyLong_FromUnsignedLong(event->operands[i]));
+    return Py_BuildValue("(iIIiiiIIiN)", (int)event->type, (unsigned int)event->opcode, (unsigned int)event->offset,
+      event->track, event->channel, event->depth, (unsigned int)event->tick, (unsigned int)event->delta,
+      event->numOperands, operands);
+}
+
+static int event_array_get_buffer(PyObject *self, Py_buffer *view, int flags)
+{
+    struct EventArray *array = (struct EventArray *)self;
+    
+    if (flags & PyBUF_WRITABLE)
+    {
+        PyErr_SetString(PyExc_BufferError, "event arrays are read-only");
+        view->obj = NULL;
+        return -1;
+    }
+    view->obj = Py_NewRef(self);
+    view->buf = array->events;
+    view->len = array->numEvents * sizeof(struct Event);
+    view->readonly = 1;
+    view->itemsize = sizeof(struct Event);
+    view->format = (flags & PyBUF_FORMAT) ? EVENT_FORMAT : NULL;
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) ? &array->numEvents : NULL;
+    view->strides = ((flags & PyBUF_STRIDES) == PyBUF_STRIDES) ? &view->itemsize : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+static PySequenceMethods eventArraySequence =
+{
+    .sq_length = event_array_length,
+    .sq_item = event_array_item,
+};
+
+static PyBufferProcs eventArrayBuffer =
+{
+    .bf_getbuffer = event_array_get_buffer,
+};
+
+static PyTypeObject eventArrayType =
+{
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "bms2mid.EventArray",
+    .tp_doc = PyDoc_STR("Decoded events of a BMS sequence, readable through the buffer protocol"),
+    .tp_basicsize = sizeof(struct EventArray),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = event_array_dealloc,
+    .tp_as_sequence = &eventArraySequence,
+    .tp_as_buffer = &eventArrayBuffer,
+};
+
+//------------------------------------------------------------------------------
+// Module Functions
+//------------------------------------------------------------------------------
+
+static PyObject *convert(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"data", "memory_limit", NULL};
+    Py_buffer data;
+    unsigned long int memoryLimit = 0;
+    uint8_t *midiData;
+    unsigned long int midiSize;
+    bool ok;
+    PyObject *result;
+    
+    (void)self;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y*|k", keywords, &data, &memoryLimit))
+        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    bms_set_memory_limit(memoryLimit);
+    ok = bms_convert(data.buf, data.len, &midiData, &midiSize);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&data);
+    if (!ok)
+    {
+        set_bms_error(bms_error());
+        return NULL;
+    }
+    result = PyBytes_FromStringAndSize((const char *)midiData, midiSize);
+    free(midiData);
+    return result;
+}
+
+static PyObject *events(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"data", "merged", "memory_limit", NULL};
+    Py_buffer data;
+    int merged = 0;
+    unsigned long int memoryLimit = 0;
+    struct Event *eventList;
+    size_t numEvents = 0;
+    size_t capacity = 1024;
+    const char *error = NULL;
+    char limitMessage[64];
+    bool opened;
+    struct EventArray *array;
+    
+    (void)self;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y*|pk", keywords, &data, &merged, &memoryLimit))
+        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    bms_set_memory_limit(memoryLimit);
+    eventList = malloc(capacity * sizeof(*eventList));
+    if (merged)
+        opened = bms_iter_open_merged(data.buf, data.len);
+    else
+        opened = bms_iter_open(data.buf, data.len);
+    while (opened && eventList != NULL && bms_iter_next(&eventList[numEvents]))
+    {
+        numEvents++;
+        if (numEvents == capacity)
+        {
+            struct Event *newList;
+            
+            // The event list counts towards the memory limit too
+            capacity *= 2;
+            if (memoryLimit != 0 && capacity * sizeof(*eventList) > memoryLimit)
+            {
+                snprintf(limitMessage, sizeof(limitMessage), "Memory limit of %lu bytes exceeded\n", memoryLimit);
+                error = limitMessage;
+                break;
+            }
+            newList = realloc(eventList, capacity * sizeof(*eventList));
+            if (newList == NULL)
+                free(eventList);
+            eventList = newList;
+        }
+    }
+    if (error == NULL)
+        error = bms_error();
+    bms_iter_close();
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&data);
+    if (eventList == NULL)
+        return PyErr_NoMemory();
+    if (error != NULL)
+    {
+        free(eventList);
+        set_bms_error(error);
+        return NULL;
+    }
+    array = PyObject_New(struct EventArray, &eventArrayType);
+    if (array == NULL)
+    {
+        free(eventList);
+        return NULL;
+    }
+    array->events = eventList;
+    array->numEvents = numEvents;
+    return (PyObject *)array;
+}
+
+static PyObject *peak_memory(PyObject *self, PyObject *args)
+{
+    (void)self;
+    (void)args;
+    return PyLong_FromUnsignedLong(bms_peak_memory());
+}
+
+static PyMethodDef moduleMethods[] =
+{
+    {"convert", (PyCFunction)(void (*)(void))convert, METH_VARARGS | METH_KEYWORDS,
+      PyDoc_STR("convert(data, memory_limit=0) -> bytes\n\nConverts BMS data to a MIDI file.")},
+    {"events", (PyCFunction)(void (*)(void))events, METH_VARARGS | METH_KEYWORDS,
+      PyDoc_STR("events(data, merged=False, memory_limit=0) -> EventArray\n\nDecodes the events of BMS data.")},
+    {"peak_memory", peak_memory, METH_NOARGS,
+      PyDoc_STR("peak_memory() -> int\n\nMost memory the last conversion in this thread used, in bytes.")},
+    {NULL, NULL, 0, NULL},
+};
+
+static struct PyModuleDef moduleDef =
+{
+    PyModuleDef_HEAD_INIT,
+    .m_name = "bms2mid",
+    .m_doc = PyDoc_STR("Converts Nintendo BMS music sequences to MIDI files"),
+    .m_size = -1,
+    .m_methods = moduleMethods,
+};
+
+// Adds the exception, the event array type and the constants to module
+static bool add_module_objects(PyObject *module)
+{
+    PyObject *fields = PyTuple_New(ARRAY_LENGTH(eventFields));
+    bool ok;
+    
+    if (fields == NULL)
+        return false;
+    for (unsigned int i = 0; i < ARRAY_LENGTH(eventFields); i++)
+        PyTuple_SET_ITEM(fields, i, PyUnicode_FromString(eventFields[i]));
+    ok = PyModule_AddObjectRef(module, "EVENT_FIELDS", fields) == 0;
+    Py_DECREF(fields);
+    if (!ok)
+        return false;
+    bmsError = PyErr_NewException("bms2mid.Error", NULL, NULL);
+    if (bmsError == NULL
+     || PyModule_AddObjectRef(module, "Error", bmsError) < 0
+     || PyModule_AddObjectRef(module, "EventArray", (PyObject *)&eventArrayType) < 0
+     || PyModule_AddStringConstant(module, "EVENT_FORMAT", EVENT_FORMAT) < 0)
+        return false;
+    for (unsigned int i = 0; i < ARRAY_LENGTH(eventTypes); i++)
+    {
+        if (PyModule_AddIntConstant(module, eventTypes[i].name, eventTypes[i].type) < 0)
+            return false;
+    }
+    return true;
+}
+
+PyMODINIT_FUNC PyInit_bms2mid(void)
+{
+    PyObject *module;
+    
+    if (PyType_Ready(&eventArrayType) < 0)
+        return NULL;
+    module = PyModule_Create(&moduleDef);
+    if (module != NULL && !add_module_objects(module))
+    {
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
@@ -0,0 +1,153 @@
+/*
+ * Copyright 2017 Cameron Hall
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Checks the library interface in bms2mid.h (see the check target in the Makefile):
+//   check_api bmsFile goldenFile
+// The sequence has to convert to the same MIDI file as the command line tool
+// (goldenFile), and the iterators and note index have to agree with each other.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bms2mid.h"
+
+#define TINY_MEMORY_LIMIT 16  // Less than the first track buffer
+
+static int numFailed = 0;
+
+static void check(bool ok, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAILED: %s\n", what);
+        numFailed++;
+    }
+}
+
+static uint8_t *read_file(const char *filename, unsigned long int *size)
+{
+    FILE *file = fopen(filename, "rb");
+    uint8_t *data;
+    
+    if (file == NULL)
+        return NULL;
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    rewind(file);
+    data = malloc(*size + 1);
+    if (fread(data, 1, *size, file) != *size)
+    {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    return data;
+}
+
+// Returns the number of NOTE_ON events, or -1 if decoding fails
+static long int count_notes(const uint8_t *data, unsigned long int size, bool merged)
+{
+    struct Event event;
+    long int count = 0;
+    bool opened = merged ? bms_iter_open_merged(data, size) : bms_iter_open(data, size);
+    
+    while (opened && bms_iter_next(&event))
+    {
+        if (event.type == EVENT_NOTE_ON)
+            count++;
+    }
+    bms_iter_close();
+    return (opened && bms_error() == NULL) ? count : -1;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long int bmsSize;
+    unsigned long int goldenSize;
+    uint8_t *bms;
+    uint8_t *golden;
+    uint8_t *midiData = NULL;
+    unsigned long int midiSize = 0;
+    long int numNotes;
+    long int numIndexed = 0;
+    
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s bmsFile goldenFile\n", argv[0]);
+        return 1;
+    }
+    bms = read_file(argv[1], &bmsSize);
+    golden = read_file(argv[2], &goldenSize);
+    if (bms == NULL || golden == NULL)
+    {
+        fprintf(stderr, "failed to read '%s' or '%s'\n", argv[1], argv[2]);
+        return 1;
+    }
+    
+    // bms_convert
+    check(bms_convert(bms, bmsSize, &midiData, &midiSize), "bms_convert failed");
+    check(bms_error() == NULL, "bms_error set after bms_convert succeeded");
+    check(midiSize == goldenSize && memcmp(midiData, golden, goldenSize) == 0, "bms_convert differs from the golden file");
+    check(bms_peak_memory() > 0, "bms_peak_memory is 0 after bms_convert");
+    free(midiData);
+    
+    // The iterators, in both orders, and the note index see the same notes
+    numNotes = count_notes(bms, bmsSize, false);
+    check(numNotes > 0, "bms_iter_open gave no notes");
+    check(count_notes(bms, bmsSize, true) == numNotes, "bms_iter_open_merged gave different notes from bms_iter_open");
+    check(bms_notes_open(bms, bmsSize), "bms_notes_open failed");
+    for (int track = 0; track < bms_notes_track_count(); track++)
+    {
+        unsigned int count;
+        const struct Note *notes = bms_notes_track(track, &count);
+        
+        numIndexed += count;
+        for (unsigned int i = 1; i < count; i++)
+            check(notes[i - 1].start <= notes[i].start, "bms_notes_track isn't sorted by start time");
+        if (count != 0)
+            check(bms_notes_between(track, 0, UINT32_MAX, NULL, 0) == count, "bms_notes_between doesn't find every note");
+    }
+    check(numIndexed == numNotes, "bms_notes_open gave different notes from bms_iter_open");
+    bms_notes_close();
+    
+    // Going over the memory limit is reported by every entry point, without exiting
+    bms_set_memory_limit(TINY_MEMORY_LIMIT);
+    check(!bms_convert(bms, bmsSize, &midiData, &midiSize), "bms_convert succeeded over the memory limit");
+    check(bms_error() != NULL && strncmp(bms_error(), "Memory limit", 12) == 0, "bms_convert didn't report the memory limit");
+    check(count_notes(bms, bmsSize, false) < 0, "bms_iter_open succeeded over the memory limit");
+    check(count_notes(bms, bmsSize, true) < 0, "bms_iter_open_merged succeeded over the memory limit");
+    check(!bms_notes_open(bms, bmsSize), "bms_notes_open succeeded over the memory limit");
+    bms_notes_close();
+    bms_set_memory_limit(0);
+    
+    // Still works afterwards
+    check(bms_convert(bms, bmsSize, &midiData, &midiSize), "bms_convert failed after an error");
+    check(midiSize == goldenSize && memcmp(midiData, golden, goldenSize) == 0, "bms_convert differs from the golden file after an error");
+    free(midiData);
+    
+    free(bms);
+    free(golden);
+    return (numFailed == 0) ? 0 : 1;
+}
@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+#
+# Checks the Python module (see the check-python target in the Makefile):
+#   python3 check_python.py fixture.bms
+# Run it from the directory the module was built in.
+
+import struct
+import sys
+from concurrent.futures import ThreadPoolExecutor
+
+import bms2mid
+
+THREADS = 4
+JOBS = 32
+
+
+def expect_error(name, func, *args, **kwargs):
+    try:
+        func(*args, **kwargs)
+    except bms2mid.Error as e:
+        print("ok: %s raised bms2mid.Error (%s)" % (name, e))
+        return True
+    except BaseException as e:
+        print("FAILED: %s raised %s instead of bms2mid.Error" % (name, type(e).__name__))
+        return False
+    print("FAILED: %s didn't raise bms2mid.Error" % name)
+    return False
+
+
+def main():
+    with open(sys.argv[1], "rb") as f:
+        data = f.read()
+    ok = True
+
+    # Without a limit, the same sequence converts
+    midi = bms2mid.convert(data)
+    if not midi.startswith(b"MThd"):
+        print("FAILED: convert didn't return a MIDI file")
+        ok = False
+    if len(bms2mid.events(data)) == 0 or len(bms2mid.events(data, merged=True)) == 0:
+        print("FAILED: events returned no events")
+        ok = False
+
+    # A limit smaller than the first track buffer has to fail with an exception,
+    # whether it's hit while the decoder starts or later on
+    for limit in (16, 1000):
+        ok &= expect_error("convert(memory_limit=%d)" % limit, bms2mid.convert, data, memory_limit=limit)
+        for merged in (False, True):
+            ok &= expect_error("events(merged=%s, memory_limit=%d)" % (merged, limit),
+                               bms2mid.events, data, merged=merged, memory_limit=limit)
+
+    # The module still works after the errors
+    if bms2mid.convert(data) != midi:
+        print("FAILED: convert gave different output after the errors")
+        ok = False
+
+    # The buffer holds nothing but the decoded events, so it's the same every time
+    for merged in (False, True):
+        first = bytes(memoryview(bms2mid.events(data, merged=merged)))
+        second = bytes(memoryview(bms2mid.events(data, merged=merged)))
+        if first != second:
+            print("FAILED: events(merged=%s) gave different buffer contents each time" % merged)
+            ok = False
+
+    # Items follow EVENT_FIELDS, and agree with the buffer read through EVENT_FORMAT
+    events = bms2mid.events(data)
+    unpacked = list(struct.iter_unpack(bms2mid.EVENT_FORMAT, memoryview(events)))
+    for item, values in zip(events, unpacked):
+        fields = dict(zip(bms2mid.EVENT_FIELDS, item))
+        numOperands = fields["num_operands"]
+        if (len(item) != len(bms2mid.EVENT_FIELDS) or len(values) != 17
+         or item[:9] != values[:9] or fields["operands"] != values[9:9 + numOperands]
+         or any(values[9 + numOperands:])):
+            print("FAILED: event %r doesn't match EVENT_FIELDS and the buffer %r" % (item, values))
+            ok = False
+            break
+
+    # Conversions from several threads at once give the same results as one at a time
+    def job(i):
+        if i % 3 == 0:
+            return bms2mid.convert(data)
+        return bytes(memoryview(bms2mid.events(data, merged=(i % 3 == 2))))
+    serial = [job(i) for i in range(JOBS)]
+    with ThreadPoolExecutor(THREADS) as pool:
+        threaded = list(pool.map(job, range(JOBS)))
+    if threaded != serial:
+        print("FAILED: conversions in %d threads differ from serial ones" % THREADS)
+        ok = False
+
+    if not ok:
+        sys.exit(1)
+    print("ok: events buffers, items and threaded conversions")
+
+
+if __name__ == "__main__":
+    main()